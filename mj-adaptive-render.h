@@ -18,92 +18,1275 @@
 #ifndef MJ_ADAPTIVE_RENDER_H
 #define MJ_ADAPTIVE_RENDER_H 1
 
+#include <vector>
+#include <map>
+#include <algorithm>
 #include "mj-surface.h"
 #include "mj-calc.h"
+#include "mj-calc-simd.h"
+#include "mj-thread-pool.h"
 
+/*
+ * compute n points starting from (x0, y0) stepping (dx, dy) in one batch,
+ * the distance estimates go to dist if it is not NULL
+ */
+template<typename Frame>
+void mj_render_line(const MJ_Surface<double>& surface, const Frame& frame,
+                    double center_x, double center_y, double pixel_width,
+                    int x0, int y0, int dx, int dy, int n, const MJ_Surface<double> *dist = NULL)
+{
+    if (n <= 0)
+        return;
+
+    double *zx = new double[4 * n];
+    double *zy = zx + n;
+    double *result = zy + n;
+    double *de = dist ? result + n : NULL;
+
+    for (int k = 0; k < n; k++) {
+        zx[k] = (x0 + k * dx - center_x) * pixel_width;
+        zy[k] = (center_y - (y0 + k * dy)) * pixel_width;
+    }
+
+    mj_calc_batch(frame, zx, zy, result, n, de);
+
+    for (int k = 0; k < n; k++)
+        surface(x0 + k * dx, y0 + k * dy) = result[k];
+
+    if (dist)
+        for (int k = 0; k < n; k++)
+            (*dist)(x0 + k * dx, y0 + k * dy) = de[k];
+
+    delete[] zx;
+}
+
+/*
+ * The points of a surface at multiples of stride, as a surface of their
+ * own. The coarse levels of a progressive render work on these.
+ */
 template<typename T>
-void mj_recursive_render(const MJ_Surface<double>& surface, T cx, T cy,
-                         double center_x, double center_y, double pixel_width,
-                         int left_x, int right_x, int top_y, int bottom_y,
-                         int max_iter, int julia_mode)
+class MJ_StridedSurface {
+public:
+    inline MJ_StridedSurface(const MJ_Surface<T>& surface, int stride) : m_surface(surface), m_stride(stride)
+    {
+    }
+
+    inline T& operator()(int x, int y) const
+    {
+        return m_surface(x * m_stride, y * m_stride);
+    }
+
+    inline int width() const
+    {
+        return (m_surface.width() - 1) / m_stride + 1;
+    }
+
+    inline int height() const
+    {
+        return (m_surface.height() - 1) / m_stride + 1;
+    }
+
+private:
+    const MJ_Surface<T>&    m_surface;
+    int                     m_stride;
+};
+
+/* the value at (x, y) inside a box blending the linear interpolations of its border along both axes */
+template<typename Surface>
+inline double mj_interpolate_point(const Surface& surface, int left_x, int right_x, int top_y, int bottom_y,
+                                   int x, int y)
 {
-    int width = right_x - left_x + 1;
-    int height = bottom_y - top_y + 1;
-    if (width <= 2 || height <= 2)
+    double u = double(x - left_x) / (right_x - left_x), v = double(y - top_y) / (bottom_y - top_y);
+    double lt = surface(left_x, top_y), rt = surface(right_x, top_y);
+    double lb = surface(left_x, bottom_y), rb = surface(right_x, bottom_y);
+
+    return (1.0 - u) * surface(left_x, y) + u * surface(right_x, y) +
+           (1.0 - v) * surface(x, top_y) + v * surface(x, bottom_y) -
+           (1.0 - v) * ((1.0 - u) * lt + u * rt) - v * ((1.0 - u) * lb + u * rb);
+}
+
+/* fill the inside of a box from its border */
+template<typename Surface>
+inline void mj_interpolate_box(const Surface& surface, int left_x, int right_x, int top_y, int bottom_y)
+{
+    for (int y = top_y + 1; y <= bottom_y - 1; y++)
+        for (int x = left_x + 1; x <= right_x - 1; x++)
+            surface(x,y) = mj_interpolate_point(surface, left_x, right_x, top_y, bottom_y, x, y);
+}
+
+/* guessing samples this many points inside a box, and only in boxes with many more inside */
+#define MJ_GUESS_SAMPLES 5
+#define MJ_GUESS_MIN_AREA 64
+
+/* lines of a box split are computed in tasks of this many points */
+#define MJ_RENDER_CHUNK 64
+
+/*
+ * The points computed by the renders of one view, kept for the next render
+ * of it: their values, distance estimates and orbits, with known marking
+ * the points the current render does not compute. A render with a larger
+ * max_iter takes the points whose result does not depend on it from here
+ * and continues the orbits of the others, so it gets what a render from
+ * scratch would.
+ */
+template<typename T>
+struct MJ_RenderCache {
+    MJ_Surface<double>          values;
+    MJ_Surface<double>          *dist;
+    MJ_Surface<unsigned char>   known;
+    MJ_Surface<MJ_Orbit<T>>     orbits;
+
+    MJ_RenderCache(int width, int height) :
+        values(width, height), dist(NULL), known(width, height), orbits(width, height),
+        m_max_iter(0), m_escalate(0)
+    {
+        reset();
+    }
+
+    ~MJ_RenderCache()
+    {
+        delete dist;
+    }
+
+    /* forget every point, for another view */
+    void reset()
+    {
+        for (int y = 0; y < values.height(); y++) {
+            for (int x = 0; x < values.width(); x++) {
+                known(x, y) = 0;
+                orbits(x, y).k = 0;
+            }
+        }
+    }
+
+    /*
+     * Keep the points for a view scale times the pixel width, its center
+     * shift_x, shift_y pixels right and down of center_x, center_y. The point
+     * at (x, y) comes from (center_x + shift_x + (x - center_x) * scale, ...)
+     * when that is a point of the cache, the others are forgotten. Pans and
+     * zooms by powers of 2 of a grid on the old one keep points.
+     */
+    void move(double center_x, double center_y, double shift_x, double shift_y, double scale)
+    {
+        int width = values.width(), height = values.height();
+        int *src_x = new int[2 * (width + height)];
+        int *order_x = src_x + width;
+        int *src_y = order_x + width;
+        int *order_y = src_y + height;
+
+        move_axis(width, center_x, shift_x, scale, src_x, order_x);
+        move_axis(height, center_y, shift_y, scale, src_y, order_y);
+
+        for (int j = 0; j < height; j++) {
+            int y = order_y[j], sy = src_y[y];
+            for (int i = 0; i < width; i++) {
+                int x = order_x[i], sx = src_x[x];
+                if (sx < 0 || sy < 0) {
+                    orbits(x, y).k = 0;
+                    continue;
+                }
+                values(x, y) = values(sx, sy);
+                if (dist)
+                    (*dist)(x, y) = (*dist)(sx, sy);
+                orbits(x, y) = orbits(sx, sy);
+            }
+        }
+        delete[] src_x;
+    }
+
+    /*
+     * Mark the points a render with max_iter can take as they are. Points of
+     * a larger max_iter or another escalate are forgotten, and so are points
+     * without distance estimates when they are wanted.
+     */
+    void begin(int max_iter, int escalate, int with_dist)
+    {
+        if (max_iter < m_max_iter || escalate != m_escalate || (with_dist && !dist)) {
+            reset();
+            if (with_dist && !dist)
+                dist = new MJ_Surface<double>(values.width(), values.height());
+        }
+        if (!with_dist) {
+            delete dist;
+            dist = NULL;
+        }
+        m_max_iter = max_iter, m_escalate = escalate;
+
+        for (int y = 0; y < values.height(); y++) {
+            for (int x = 0; x < values.width(); x++) {
+                int k = orbits(x, y).k;
+                known(x, y) = (k == MJ_ORBIT_DONE || k >= max_iter);
+            }
+        }
+    }
+
+private:
+    /*
+     * The source of every position of an axis, -1 for none, and an order
+     * of the positions in which each is moved before its source is
+     * overwritten. As the sources are distinct and move the same way, they
+     * form chains, each walked from the position no other one reads.
+     */
+    static void move_axis(int n, double center, double shift, double scale, int *src, int *order)
+    {
+        unsigned char *is_read = new unsigned char[n];
+        int m = 0;
+
+        for (int k = 0; k < n; k++) {
+            double u = center + shift + (k - center) * scale;
+            src[k] = (u >= 0.0 && u < n && u == floor(u)) ? int(u) : -1;
+            is_read[k] = 0;
+        }
+        for (int k = 0; k < n; k++)
+            if (src[k] >= 0 && src[k] != k)
+                is_read[src[k]] = 1;
+
+        for (int k = 0; k < n; k++) {
+            if (is_read[k])
+                continue;
+            for (int j = k; ; j = src[j]) {
+                order[m++] = j;
+                if (src[j] < 0 || src[j] == j)
+                    break;
+            }
+        }
+        delete[] is_read;
+    }
+
+    int m_max_iter, m_escalate;
+
+    MJ_RenderCache(const MJ_RenderCache&);
+    MJ_RenderCache& operator=(const MJ_RenderCache&);
+};
+
+/*
+ * Parameters and result shared by the tasks of one level of
+ * mj_adaptive_render. The level works on the points of level (and
+ * level_dist) at multiples of stride. With known, a computed point is also
+ * stored in cache (and cache_dist) and marked, a later level takes it from
+ * there instead of computing it again. With orbits, the points continue
+ * their orbits and leave them there. Point (x, y) of the level is at
+ * (x + cache_x, y + cache_y) of those.
+ */
+template<typename Frame>
+struct MJ_RenderJob {
+    typedef MJ_Orbit<typename Frame::scalar> Orbit;
+
+    const Frame&                    frame;
+    double                          center_x, center_y, pixel_width;
+    double                          de_fill;
+    double                          guess;
+    int                             stride;
+    const MJ_Surface<double>&       level;
+    const MJ_Surface<double>        *level_dist;
+    const MJ_Surface<double>        *cache, *cache_dist;
+    const MJ_Surface<unsigned char> *known;
+    const MJ_Surface<Orbit>         *orbits;
+    int                             cache_x, cache_y;
+    MJ_StridedSurface<double>       surface;
+    MJ_StridedSurface<double>       *dist;
+    std::atomic<long>               nb_filled;
+    std::atomic<long>               nb_guessed;
+
+    MJ_RenderJob(const Frame& frame, double center_x, double center_y, double pixel_width,
+                 double de_fill, double guess, int stride,
+                 const MJ_Surface<double>& level, const MJ_Surface<double> *level_dist,
+                 const MJ_Surface<double> *cache = NULL, const MJ_Surface<double> *cache_dist = NULL,
+                 const MJ_Surface<unsigned char> *known = NULL, const MJ_Surface<Orbit> *orbits = NULL,
+                 int cache_x = 0, int cache_y = 0) :
+        frame(frame), center_x(center_x), center_y(center_y), pixel_width(pixel_width),
+        de_fill(de_fill), guess(guess), stride(stride), level(level), level_dist(level_dist),
+        cache(cache), cache_dist(cache_dist), known(known), orbits(orbits), cache_x(cache_x), cache_y(cache_y),
+        surface(level, stride),
+        dist(level_dist ? new MJ_StridedSurface<double>(*level_dist, stride) : NULL),
+        nb_filled(0), nb_guessed(0)
+    {
+    }
+
+    ~MJ_RenderJob()
+    {
+        delete dist;
+    }
+
+    /* the offset of point (x, y) of the level from the center */
+    inline void offset(int x, int y, double &zx, double &zy) const
+    {
+        zx = (x * stride - center_x) * pixel_width;
+        zy = (center_y - y * stride) * pixel_width;
+    }
+
+    void render_line(int x0, int y0, int dx, int dy, int n) const
+    {
+        if (!known) {
+            mj_render_line(level, frame, center_x, center_y, pixel_width, x0 * stride, y0 * stride,
+                           dx * stride, dy * stride, n, level_dist);
+            return;
+        }
+
+        int *xs = new int[2 * n];
+        int *ys = xs + n;
+        for (int k = 0; k < n; k++)
+            xs[k] = x0 + k * dx, ys[k] = y0 + k * dy;
+        render_points(xs, ys, n);
+        delete[] xs;
+    }
+
+    /* points (xs[k], ys[k]) of the level, with known those not known yet are computed as a line of their own */
+    void render_points(const int *xs, const int *ys, int n) const
+    {
+        double *zx = new double[4 * n];
+        double *zy = zx + n;
+        double *result = zy + n;
+        double *de = level_dist ? result + n : NULL;
+        Orbit *orbit = orbits ? new Orbit[n] : NULL;
+        int *idx = new int[n];
+        int m = 0;
+
+        for (int k = 0; k < n; k++) {
+            int x = xs[k] * stride, y = ys[k] * stride;
+            if (known && (*known)(x + cache_x, y + cache_y))
+                continue;
+            zx[m] = (x - center_x) * pixel_width;
+            zy[m] = (center_y - y) * pixel_width;
+            if (orbit)
+                orbit[m] = (*orbits)(x + cache_x, y + cache_y);
+            idx[m++] = k;
+        }
+
+        if (m)
+            mj_calc_batch(frame, zx, zy, result, m, de, orbit);
+
+        for (int j = 0; j < m; j++) {
+            int x = xs[idx[j]] * stride, y = ys[idx[j]] * stride;
+            if (!known) {
+                level(x, y) = result[j];
+                if (de)
+                    (*level_dist)(x, y) = de[j];
+                continue;
+            }
+            x += cache_x, y += cache_y;
+            (*cache)(x, y) = result[j];
+            if (de)
+                (*cache_dist)(x, y) = de[j];
+            if (orbit)
+                (*orbits)(x, y) = orbit[j];
+            (*known)(x, y) = 1;
+        }
+
+        for (int k = 0; known && k < n; k++) {
+            int x = xs[k] * stride, y = ys[k] * stride;
+            level(x, y) = (*cache)(x + cache_x, y + cache_y);
+            if (level_dist)
+                (*level_dist)(x, y) = (*cache_dist)(x + cache_x, y + cache_y);
+        }
+
+        delete[] orbit;
+        delete[] idx;
+        delete[] zx;
+    }
+
+private:
+    MJ_RenderJob(const MJ_RenderJob&);
+    MJ_RenderJob& operator=(const MJ_RenderJob&);
+};
+
+/*
+ * Lines that must be computed before the boxes they border are recursed
+ * into. The lines are cut in chunks, the task finishing the last chunk
+ * spawns the boxes.
+ */
+template<typename Frame>
+struct MJ_RenderSplit {
+    MJ_RenderJob<Frame>&    job;
+    std::atomic<int>        nb_chunks;
+    int                     nb_boxes;
+    /* left_x, right_x, top_y, bottom_y */
+    int                     boxes[2][4];
+
+    MJ_RenderSplit(MJ_RenderJob<Frame>& job) : job(job), nb_chunks(0), nb_boxes(0)
+    {
+    }
+
+    void add_box(int left_x, int right_x, int top_y, int bottom_y)
+    {
+        int *box = boxes[nb_boxes++];
+        box[0] = left_x, box[1] = right_x, box[2] = top_y, box[3] = bottom_y;
+    }
+
+    /* the last box is spawned first, so a single thread recurses in order */
+    void spawn_boxes(MJ_ThreadPool& pool);
+
+    void chunk_done(MJ_ThreadPool& pool)
+    {
+        if (--nb_chunks == 0) {
+            spawn_boxes(pool);
+            delete this;
+        }
+    }
+};
+
+template<typename Frame>
+class MJ_RenderLineTask : public MJ_Task {
+public:
+    MJ_RenderLineTask(MJ_RenderSplit<Frame> *split, int x0, int y0, int dx, int dy, int n) :
+        m_split(split), m_x0(x0), m_y0(y0), m_dx(dx), m_dy(dy), m_n(n)
+    {
+    }
+
+    void run(MJ_ThreadPool& pool)
+    {
+        m_split->job.render_line(m_x0, m_y0, m_dx, m_dy, m_n);
+        m_split->chunk_done(pool);
+    }
+
+private:
+    MJ_RenderSplit<Frame>   *m_split;
+    int                     m_x0, m_y0, m_dx, m_dy, m_n;
+};
+
+/*
+ * Queue the chunks of lines[k] = {x0, y0, dx, dy, n} in reverse, a single
+ * thread then computes them in order. A split of one chunk is not queued.
+ */
+template<typename Frame>
+void mj_render_split(MJ_ThreadPool& pool, MJ_RenderSplit<Frame> *split, const int (*lines)[5], int nb_lines)
+{
+    int nb_chunks = 0;
+    for (int k = 0; k < nb_lines; k++)
+        nb_chunks += (lines[k][4] + MJ_RENDER_CHUNK - 1) / MJ_RENDER_CHUNK;
+
+    if (nb_chunks <= 1) {
+        for (int k = 0; k < nb_lines; k++)
+            split->job.render_line(lines[k][0], lines[k][1], lines[k][2], lines[k][3], lines[k][4]);
+        split->nb_chunks = 1;
+        split->chunk_done(pool);
         return;
+    }
 
-    int all_infinity = 1;
+    split->nb_chunks = nb_chunks;
+    for (int k = nb_lines - 1; k >= 0; k--) {
+        const int *l = lines[k];
+        for (int off = (l[4] - 1) / MJ_RENDER_CHUNK * MJ_RENDER_CHUNK; off >= 0; off -= MJ_RENDER_CHUNK) {
+            int n = (l[4] - off < MJ_RENDER_CHUNK) ? l[4] - off : MJ_RENDER_CHUNK;
+            pool.spawn(new MJ_RenderLineTask<Frame>(split, l[0] + off * l[2], l[1] + off * l[3], l[2], l[3], n));
+        }
+    }
+}
 
-    for (int x = left_x; all_infinity && x <= right_x; x++)
+/* whether the border of a box is all inside the set */
+template<typename Surface>
+inline bool mj_box_is_infinity(const Surface& surface, int left_x, int right_x, int top_y, int bottom_y)
+{
+    for (int x = left_x; x <= right_x; x++)
         if (surface(x, top_y) < MJ_INFINITY || surface(x, bottom_y) < MJ_INFINITY)
-            all_infinity = 0;
-
-    for (int y = top_y + 1; all_infinity && y <= bottom_y - 1; y++)
+            return false;
+    for (int y = top_y + 1; y <= bottom_y - 1; y++)
         if (surface(left_x, y) < MJ_INFINITY || surface(right_x, y) < MJ_INFINITY)
-            all_infinity = 0;
+            return false;
+    return true;
+}
 
-    if (all_infinity) {
+/* whether the distance estimates of the border of a box are all at least limit */
+template<typename Surface>
+inline bool mj_box_is_far(const Surface& dist, double limit, int left_x, int right_x, int top_y, int bottom_y)
+{
+    for (int x = left_x; x <= right_x; x++)
+        if (!(dist(x, top_y) >= limit) || !(dist(x, bottom_y) >= limit))
+            return false;
+    for (int y = top_y + 1; y <= bottom_y - 1; y++)
+        if (!(dist(left_x, y) >= limit) || !(dist(right_x, y) >= limit))
+            return false;
+    return true;
+}
+
+/* whether the border of a box is outside the set and changes by at most guess between neighbors */
+template<typename Surface>
+inline bool mj_box_is_smooth(const Surface& surface, double guess, int left_x, int right_x, int top_y, int bottom_y)
+{
+    /* a filament or a spiral crossing the border shows up as a step between neighbors */
+    for (int x = left_x; x < right_x; x++)
+        if (!(fabs(surface(x, top_y) - surface(x + 1, top_y)) <= guess &&
+              fabs(surface(x, bottom_y) - surface(x + 1, bottom_y)) <= guess))
+            return false;
+    for (int y = top_y; y < bottom_y; y++)
+        if (!(fabs(surface(left_x, y) - surface(left_x, y + 1)) <= guess &&
+              fabs(surface(right_x, y) - surface(right_x, y + 1)) <= guess))
+            return false;
+    return surface(left_x, top_y) < MJ_INFINITY;
+}
+
+/* the samples of a box to guess: the center and the centers of the four quarters */
+inline void mj_guess_points(int left_x, int right_x, int top_y, int bottom_y, int *sx, int *sy)
+{
+    int mx = (left_x + right_x) / 2, my = (top_y + bottom_y) / 2;
+    sx[0] = mx, sx[1] = sx[3] = (left_x + mx) / 2, sx[2] = sx[4] = (mx + right_x) / 2;
+    sy[0] = my, sy[1] = sy[2] = (top_y + my) / 2, sy[3] = sy[4] = (my + bottom_y) / 2;
+}
+
+/* what mj_box_decide leaves to do with a box */
+#define MJ_BOX_DONE     0
+#define MJ_BOX_GUESS    1
+#define MJ_BOX_SPLIT    2
+
+/*
+ * With dist and de_fill, a box is not computed if the distance estimate of
+ * every border point is at least de_fill times the box diagonal. As the true
+ * distance is at least about half the estimate, no point of the set is then
+ * inside and the values are interpolated from the border. The interpolated
+ * points are counted in job.nb_filled.
+ *
+ * With guess, a box whose border is finite and changes by at most guess
+ * iterations between neighbors is to be guessed, see mj_box_guess.
+ * Otherwise the box is to be split.
+ */
+template<typename Frame>
+int mj_box_decide(MJ_RenderJob<Frame>& job, int left_x, int right_x, int top_y, int bottom_y)
+{
+    const MJ_StridedSurface<double>& surface = job.surface;
+    const MJ_StridedSurface<double> *dist = job.dist;
+    int width = right_x - left_x + 1;
+    int height = bottom_y - top_y + 1;
+    if (width <= 2 || height <= 2)
+        return MJ_BOX_DONE;
+
+    if (mj_box_is_infinity(surface, left_x, right_x, top_y, bottom_y)) {
         for (int y = top_y + 1; y <= bottom_y - 1; y++)
             for (int x = left_x + 1; x <= right_x - 1; x++)
                 surface(x,y) = MJ_INFINITY;
-        return;
+        if (dist)
+            for (int y = top_y + 1; y <= bottom_y - 1; y++)
+                for (int x = left_x + 1; x <= right_x - 1; x++)
+                    (*dist)(x,y) = 0.0;
+        return MJ_BOX_DONE;
     }
 
-    if (width < height) {
-        int middle_y = (top_y + bottom_y) / 2;
-        double zy = (center_y - middle_y) * pixel_width;
-        for (int x = left_x + 1; x <= right_x - 1; x++) {
-            double zx = (x - center_x) * pixel_width;
-            surface(x, middle_y) = mj_calc_select(cx, cy, zx, zy, max_iter, julia_mode);
+    if (dist && job.de_fill > 0.0) {
+        double limit = job.de_fill * hypot(width - 1, height - 1) * job.stride * job.pixel_width;
+        if (mj_box_is_far(*dist, limit, left_x, right_x, top_y, bottom_y)) {
+            mj_interpolate_box(surface, left_x, right_x, top_y, bottom_y);
+            mj_interpolate_box(*dist, left_x, right_x, top_y, bottom_y);
+            job.nb_filled += long(width - 2) * (height - 2);
+            return MJ_BOX_DONE;
         }
+    }
+
+    if (job.guess > 0.0 && long(width - 2) * (height - 2) >= MJ_GUESS_MIN_AREA &&
+        mj_box_is_smooth(surface, job.guess, left_x, right_x, top_y, bottom_y))
+        return MJ_BOX_GUESS;
+    return MJ_BOX_SPLIT;
+}
 
-        mj_recursive_render(surface, cx, cy, center_x, center_y, pixel_width,
-                            left_x, right_x, top_y, middle_y, max_iter, julia_mode);
-        mj_recursive_render(surface, cx, cy, center_x, center_y, pixel_width,
-                            left_x, right_x, middle_y, bottom_y, max_iter, julia_mode);
+/*
+ * A box to guess with its samples (sx[k], sy[k]) computed, see
+ * mj_guess_points. When the MJ_GUESS_SAMPLES are within guess of the
+ * interpolation of the border, the box is interpolated and true returned.
+ * This is a guess, features smaller than the spacing of the samples can be
+ * lost. The guessed points are counted in job.nb_guessed.
+ */
+template<typename Frame>
+bool mj_box_guess(MJ_RenderJob<Frame>& job, int left_x, int right_x, int top_y, int bottom_y,
+                  const int *sx, const int *sy)
+{
+    const MJ_StridedSurface<double>& surface = job.surface;
+    const MJ_StridedSurface<double> *dist = job.dist;
+    int width = right_x - left_x + 1;
+    int height = bottom_y - top_y + 1;
+
+    for (int k = 0; k < MJ_GUESS_SAMPLES; k++)
+        if (!(fabs(surface(sx[k], sy[k]) - mj_interpolate_point(surface, left_x, right_x, top_y, bottom_y,
+                                                                 sx[k], sy[k])) <= job.guess))
+            return false;
+
+    double values[MJ_GUESS_SAMPLES], values_dist[MJ_GUESS_SAMPLES];
+    for (int k = 0; k < MJ_GUESS_SAMPLES; k++) {
+        values[k] = surface(sx[k], sy[k]);
+        if (dist)
+            values_dist[k] = (*dist)(sx[k], sy[k]);
+    }
+
+    mj_interpolate_box(surface, left_x, right_x, top_y, bottom_y);
+    if (dist)
+        mj_interpolate_box(*dist, left_x, right_x, top_y, bottom_y);
+
+    /* the samples keep their computed values and are not counted as guessed */
+    long nb_samples = 0;
+    for (int k = 0; k < MJ_GUESS_SAMPLES; k++) {
+        surface(sx[k], sy[k]) = values[k];
+        if (dist)
+            (*dist)(sx[k], sy[k]) = values_dist[k];
+        int is_new = (sx[k] > left_x && sx[k] < right_x && sy[k] > top_y && sy[k] < bottom_y);
+        for (int j = 0; is_new && j < k; j++)
+            is_new = (sx[j] != sx[k] || sy[j] != sy[k]);
+        nb_samples += is_new;
+    }
+    job.nb_guessed += long(width - 2) * (height - 2) - nb_samples;
+    return true;
+}
+
+/* the line {x0, y0, dx, dy, n} splitting a box across its longer side, and the halves {left_x, right_x, top_y, bottom_y} */
+inline void mj_box_split(int left_x, int right_x, int top_y, int bottom_y, int *line, int (*halves)[4])
+{
+    int width = right_x - left_x + 1;
+    int height = bottom_y - top_y + 1;
+
+    if (width < height) {
+        int middle_y = (top_y + bottom_y) / 2;
+        line[0] = left_x + 1, line[1] = middle_y, line[2] = 1, line[3] = 0, line[4] = width - 2;
+        halves[0][0] = left_x, halves[0][1] = right_x, halves[0][2] = top_y, halves[0][3] = middle_y;
+        halves[1][0] = left_x, halves[1][1] = right_x, halves[1][2] = middle_y, halves[1][3] = bottom_y;
     } else {
         int middle_x = (left_x + right_x) / 2;
-        double zx = (middle_x - center_x) * pixel_width;
-        for (int y = top_y + 1; y <= bottom_y - 1; y++) {
-            double zy = (center_y - y) * pixel_width;
-            surface(middle_x, y) = mj_calc_select(cx, cy, zx, zy, max_iter, julia_mode);
+        line[0] = middle_x, line[1] = top_y + 1, line[2] = 0, line[3] = 1, line[4] = height - 2;
+        halves[0][0] = left_x, halves[0][1] = middle_x, halves[0][2] = top_y, halves[0][3] = bottom_y;
+        halves[1][0] = middle_x, halves[1][1] = right_x, halves[1][2] = top_y, halves[1][3] = bottom_y;
+    }
+}
+
+/*
+ * The boxes inside a box, rendered in rounds on this thread. A round decides
+ * every box of the round before it, computes the samples of the boxes to
+ * guess together, then the lines splitting the others together, whose halves
+ * make the next round. The points go to mj_calc_batch a round at a time, not
+ * a line of a few points at a time as the smallest boxes of the recursion
+ * have them. Every box is decided from the same border and samples as in
+ * mj_recursive_render, so the result is the same.
+ */
+template<typename Frame>
+void mj_batched_render(MJ_RenderJob<Frame>& job, int left_x, int right_x, int top_y, int bottom_y)
+{
+    std::vector<int> boxes, guessed, split, xs, ys;
+    boxes.push_back(left_x), boxes.push_back(right_x), boxes.push_back(top_y), boxes.push_back(bottom_y);
+
+    while (!boxes.empty()) {
+        guessed.clear(), split.clear(), xs.clear(), ys.clear();
+        for (size_t k = 0; k < boxes.size(); k += 4) {
+            const int *b = &boxes[k];
+            int decision = mj_box_decide(job, b[0], b[1], b[2], b[3]);
+            if (decision == MJ_BOX_DONE)
+                continue;
+            if (decision == MJ_BOX_SPLIT) {
+                split.insert(split.end(), b, b + 4);
+                continue;
+            }
+            guessed.insert(guessed.end(), b, b + 4);
+            xs.resize(xs.size() + MJ_GUESS_SAMPLES), ys.resize(ys.size() + MJ_GUESS_SAMPLES);
+            mj_guess_points(b[0], b[1], b[2], b[3], &xs[xs.size() - MJ_GUESS_SAMPLES],
+                            &ys[ys.size() - MJ_GUESS_SAMPLES]);
         }
 
-        mj_recursive_render(surface, cx, cy, center_x, center_y, pixel_width,
-                            left_x, middle_x, top_y, bottom_y, max_iter, julia_mode);
-        mj_recursive_render(surface, cx, cy, center_x, center_y, pixel_width,
-                            middle_x, right_x, top_y, bottom_y, max_iter, julia_mode);
+        if (!guessed.empty()) {
+            job.render_points(&xs[0], &ys[0], int(xs.size()));
+            for (size_t k = 0; k < guessed.size(); k += 4) {
+                const int *b = &guessed[k];
+                int j = int(k / 4) * MJ_GUESS_SAMPLES;
+                if (!mj_box_guess(job, b[0], b[1], b[2], b[3], &xs[j], &ys[j]))
+                    split.insert(split.end(), b, b + 4);
+            }
+        }
+
+        boxes.clear(), xs.clear(), ys.clear();
+        for (size_t k = 0; k < split.size(); k += 4) {
+            const int *b = &split[k];
+            int line[5], halves[2][4];
+            mj_box_split(b[0], b[1], b[2], b[3], line, halves);
+            for (int j = 0; j < line[4]; j++)
+                xs.push_back(line[0] + j * line[2]), ys.push_back(line[1] + j * line[3]);
+            boxes.insert(boxes.end(), halves[0], halves[0] + 4);
+            boxes.insert(boxes.end(), halves[1], halves[1] + 4);
+        }
+        if (!xs.empty())
+            job.render_points(&xs[0], &ys[0], int(xs.size()));
     }
 }
 
-template<typename T>
-void mj_adaptive_render(const MJ_Surface<double>& surface, T cx, T cy,
+/* boxes at most this many points on a side are rendered by mj_batched_render */
+#define MJ_RENDER_BATCH_SIZE MJ_RENDER_CHUNK
+
+/*
+ * A box is decided by mj_box_decide, guessed by mj_box_guess or split in two
+ * halves, each recursed into once the line between them is computed. Boxes
+ * small enough go to mj_batched_render.
+ */
+template<typename Frame>
+void mj_recursive_render(MJ_ThreadPool& pool, MJ_RenderJob<Frame>& job,
+                         int left_x, int right_x, int top_y, int bottom_y)
+{
+    if (right_x - left_x < MJ_RENDER_BATCH_SIZE && bottom_y - top_y < MJ_RENDER_BATCH_SIZE) {
+        mj_batched_render(job, left_x, right_x, top_y, bottom_y);
+        return;
+    }
+
+    int decision = mj_box_decide(job, left_x, right_x, top_y, bottom_y);
+    if (decision == MJ_BOX_DONE)
+        return;
+
+    if (decision == MJ_BOX_GUESS) {
+        int sx[MJ_GUESS_SAMPLES], sy[MJ_GUESS_SAMPLES];
+        mj_guess_points(left_x, right_x, top_y, bottom_y, sx, sy);
+        job.render_points(sx, sy, MJ_GUESS_SAMPLES);
+        if (mj_box_guess(job, left_x, right_x, top_y, bottom_y, sx, sy))
+            return;
+    }
+
+    MJ_RenderSplit<Frame> *split = new MJ_RenderSplit<Frame>(job);
+    int line[1][5], halves[2][4];
+    mj_box_split(left_x, right_x, top_y, bottom_y, line[0], halves);
+    split->add_box(halves[0][0], halves[0][1], halves[0][2], halves[0][3]);
+    split->add_box(halves[1][0], halves[1][1], halves[1][2], halves[1][3]);
+    mj_render_split(pool, split, line, 1);
+}
+
+template<typename Frame>
+class MJ_RenderBoxTask : public MJ_Task {
+public:
+    MJ_RenderBoxTask(MJ_RenderJob<Frame>& job, const int *box) :
+        m_job(job), m_left_x(box[0]), m_right_x(box[1]), m_top_y(box[2]), m_bottom_y(box[3])
+    {
+    }
+
+    void run(MJ_ThreadPool& pool)
+    {
+        mj_recursive_render(pool, m_job, m_left_x, m_right_x, m_top_y, m_bottom_y);
+    }
+
+private:
+    MJ_RenderJob<Frame>&    m_job;
+    int                     m_left_x, m_right_x, m_top_y, m_bottom_y;
+};
+
+template<typename Frame>
+void MJ_RenderSplit<Frame>::spawn_boxes(MJ_ThreadPool& pool)
+{
+    for (int k = nb_boxes - 1; k >= 0; k--)
+        pool.spawn(new MJ_RenderBoxTask<Frame>(job, boxes[k]));
+}
+
+/* the border of the surface, then the boxes inside, on the threads of pool */
+template<typename Frame>
+class MJ_RenderTask : public MJ_Task {
+public:
+    MJ_RenderTask(MJ_RenderJob<Frame>& job) : m_job(job)
+    {
+    }
+
+    void run(MJ_ThreadPool& pool)
+    {
+        int width = m_job.surface.width();
+        int height = m_job.surface.height();
+        const int lines[4][5] = {
+            {0, 0, 1, 0, width},
+            {0, height - 1, 1, 0, width},
+            {0, 1, 0, 1, height - 2},
+            {width - 1, 1, 0, 1, height - 2}
+        };
+
+        MJ_RenderSplit<Frame> *split = new MJ_RenderSplit<Frame>(m_job);
+        split->add_box(0, width - 1, 0, height - 1);
+        mj_render_split(pool, split, lines, 4);
+    }
+
+private:
+    MJ_RenderJob<Frame>&    m_job;
+};
+
+/*
+ * The points on the border of a box, held by themselves: the top and bottom
+ * rows, then the left and right columns between them. Point k of the border
+ * is at position(k), the box reads them as a surface.
+ */
+class MJ_BoxBorder {
+public:
+    MJ_BoxBorder(int left_x, int right_x, int top_y, int bottom_y) :
+        left_x(left_x), right_x(right_x), top_y(top_y), bottom_y(bottom_y),
+        m_width(right_x - left_x + 1), m_height(bottom_y - top_y + 1),
+        m_points(2 * m_width + 2 * (m_height - 2))
+    {
+    }
+
+    int size() const
+    {
+        return int(m_points.size());
+    }
+
+    void position(int k, int& x, int& y) const
+    {
+        if (k < 2 * m_width) {
+            x = left_x + k % m_width, y = (k < m_width) ? top_y : bottom_y;
+            return;
+        }
+        k -= 2 * m_width;
+        x = (k < m_height - 2) ? left_x : right_x, y = top_y + 1 + k % (m_height - 2);
+    }
+
+    inline double& operator()(int x, int y)
+    {
+        return m_points[index(x, y)];
+    }
+
+    inline double operator()(int x, int y) const
+    {
+        return m_points[index(x, y)];
+    }
+
+    const int left_x, right_x, top_y, bottom_y;
+
+private:
+    inline int index(int x, int y) const
+    {
+        if (y == top_y)
+            return x - left_x;
+        if (y == bottom_y)
+            return m_width + x - left_x;
+        return 2 * m_width + (x == left_x ? 0 : m_height - 2) + y - top_y - 1;
+    }
+
+    int                 m_width, m_height;
+    std::vector<double> m_points;
+};
+
+/* the lines kept past this many values and distance estimates are forgotten */
+#define MJ_RENDER_LINES_MAX (1 << 22)
+
+/*
+ * The points computed by clipped renders outside their surfaces, for the
+ * next parts of the same image: its ring and the lines splitting its boxes,
+ * by the box. The parts mostly go down the image, lines of the boxes above
+ * the part rendered are forgotten, and all of them past MJ_RENDER_LINES_MAX
+ * points. A part copied by symmetry back up the image computes again those
+ * it needs.
+ */
+class MJ_RenderLines {
+public:
+    MJ_RenderLines() : m_size(0)
+    {
+    }
+
+    /* the line of kind (0 for a split, 1 for a ring) of box {root, left_x, right_x, top_y, bottom_y} */
+    const std::vector<double> *find(int kind, const int *box) const
+    {
+        std::map<Key, std::vector<double>>::const_iterator it = m_lines.find(Key(kind, box));
+        return (it == m_lines.end()) ? NULL : &it->second;
+    }
+
+    void add(int kind, const int *box, const std::vector<double>& points)
+    {
+        if (m_size + points.size() > MJ_RENDER_LINES_MAX)
+            m_lines.clear(), m_size = 0;
+        m_lines[Key(kind, box)] = points;
+        m_size += points.size();
+    }
+
+    /* forget the lines of the boxes of root above row y */
+    void forget_above(int root, int y)
+    {
+        std::map<Key, std::vector<double>>::iterator it = m_lines.begin();
+        while (it != m_lines.end()) {
+            if (it->first.box[0] == root && it->first.box[4] < y) {
+                m_size -= it->second.size();
+                m_lines.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+private:
+    struct Key {
+        int kind, box[5];
+
+        Key(int kind, const int *box) : kind(kind)
+        {
+            for (int k = 0; k < 5; k++)
+                this->box[k] = box[k];
+        }
+
+        bool operator<(const Key& other) const
+        {
+            if (kind != other.kind)
+                return kind < other.kind;
+            return std::lexicographical_compare(box, box + 5, other.box, other.box + 5);
+        }
+    };
+
+    std::map<Key, std::vector<double>>  m_lines;
+    size_t                              m_size;
+
+    MJ_RenderLines(const MJ_RenderLines&);
+    MJ_RenderLines& operator=(const MJ_RenderLines&);
+};
+
+/*
+ * A surface rendered as the part at (x, y) of a larger surface of width x
+ * height, root telling the larger ones of an image apart in lines (which
+ * may be NULL).
+ */
+struct MJ_RenderClip {
+    int             x, y, width, height;
+    int             root;
+    MJ_RenderLines  *lines;
+};
+
+/* the boxes left by a clipped render, their borders set */
+template<typename Frame>
+class MJ_RenderBoxesTask : public MJ_Task {
+public:
+    MJ_RenderBoxesTask(MJ_RenderJob<Frame>& job, const std::vector<int>& boxes) : m_job(job), m_boxes(boxes)
+    {
+    }
+
+    void run(MJ_ThreadPool& pool)
+    {
+        for (int k = int(m_boxes.size()) / 4 - 1; k >= 0; k--)
+            pool.spawn(new MJ_RenderBoxTask<Frame>(m_job, &m_boxes[4 * k]));
+    }
+
+private:
+    MJ_RenderJob<Frame>&    m_job;
+    const std::vector<int>& m_boxes;
+};
+
+/*
+ * The render of a part of a larger surface, making the decisions the render
+ * of the larger one makes: its boxes are walked from the whole, the points
+ * on the borders of those crossing the side of the part are computed
+ * wherever they are, and the boxes inside it are rendered as usual.
+ */
+template<typename Frame>
+class MJ_ClippedRender {
+public:
+    MJ_ClippedRender(MJ_ThreadPool& pool, MJ_RenderJob<Frame>& job, const MJ_RenderClip& clip) :
+        m_pool(pool), m_job(job), m_clip(clip),
+        m_right_x(clip.x + job.surface.width() - 1), m_bottom_y(clip.y + job.surface.height() - 1)
+    {
+    }
+
+    void run()
+    {
+        MJ_BoxBorder border(0, m_clip.width - 1, 0, m_clip.height - 1);
+        MJ_BoxBorder *border_dist = m_job.dist ? new MJ_BoxBorder(0, m_clip.width - 1, 0, m_clip.height - 1) : NULL;
+        int n = border.size();
+        int *xs = new int[2 * n];
+        int *ys = xs + n;
+        for (int k = 0; k < n; k++)
+            border.position(k, xs[k], ys[k]);
+
+        if (m_clip.lines)
+            m_clip.lines->forget_above(m_clip.root, m_clip.y);
+        const std::vector<double>& points = line(1, border, xs, ys, n);
+        for (int k = 0; k < n; k++) {
+            border(xs[k], ys[k]) = points[k];
+            if (border_dist)
+                (*border_dist)(xs[k], ys[k]) = points[n + k];
+        }
+        delete[] xs;
+
+        box(border, border_dist);
+        delete border_dist;
+        if (!m_boxes.empty())
+            m_pool.run(new MJ_RenderBoxesTask<Frame>(m_job, m_boxes));
+    }
+
+private:
+    /* computes the points k of a line in [begin, end) chunks, on the threads of the pool */
+    struct Chunks {
+        MJ_ClippedRender&   render;
+        const int           *xs, *ys;
+        int                 n;
+        double              *values, *dist;
+
+        void operator()(int k) const
+        {
+            int begin = k * MJ_RENDER_CHUNK, end = std::min(n, begin + MJ_RENDER_CHUNK);
+            render.points(xs + begin, ys + begin, end - begin, values + begin, dist ? dist + begin : NULL);
+        }
+    };
+
+    inline bool is_inside(int x, int y) const
+    {
+        return x >= m_clip.x && x <= m_right_x && y >= m_clip.y && y <= m_bottom_y;
+    }
+
+    /* points (xs[k], ys[k]) of the larger surface, those of the part are also set there */
+    void points(const int *xs, const int *ys, int n, double *values, double *dist)
+    {
+        double *zx = new double[4 * n];
+        double *zy = zx + n;
+        double *result = zy + n;
+        double *de = result + n;
+        int *inside = new int[3 * n];
+        int *inside_x = inside + n;
+        int *inside_y = inside_x + n;
+        int m = 0, nb_inside = 0;
+
+        for (int k = 0; k < n; k++) {
+            int x = xs[k] - m_clip.x, y = ys[k] - m_clip.y;
+            if (is_inside(xs[k], ys[k])) {
+                inside[nb_inside] = k, inside_x[nb_inside] = x, inside_y[nb_inside++] = y;
+                continue;
+            }
+            m_job.offset(x, y, zx[m], zy[m]);
+            m++;
+        }
+
+        if (m)
+            mj_calc_batch(m_job.frame, zx, zy, result, m, dist ? de : NULL);
+        if (nb_inside)
+            m_job.render_points(inside_x, inside_y, nb_inside);
+
+        for (int k = 0, j = 0, i = 0; k < n; k++) {
+            if (i < nb_inside && inside[i] == k) {
+                values[k] = m_job.surface(inside_x[i], inside_y[i]);
+                if (dist)
+                    dist[k] = (*m_job.dist)(inside_x[i], inside_y[i]);
+                i++;
+                continue;
+            }
+            values[k] = result[j];
+            if (dist)
+                dist[k] = de[j];
+            j++;
+        }
+        delete[] inside;
+        delete[] zx;
+    }
+
+    /* the values then the distance estimates of the line of kind of the box of border, from lines if it is there */
+    const std::vector<double>& line(int kind, const MJ_BoxBorder& border, const int *xs, const int *ys, int n)
+    {
+        int key[5] = {m_clip.root, border.left_x, border.right_x, border.top_y, border.bottom_y};
+        const std::vector<double> *points = m_clip.lines ? m_clip.lines->find(kind, key) : NULL;
+        if (points)
+            return *points;
+
+        m_line.resize(m_job.dist ? 2 * n : n);
+        Chunks chunks = {*this, xs, ys, n, &m_line[0], m_job.dist ? &m_line[n] : NULL};
+        mj_parallel_for(m_pool, 0, (n + MJ_RENDER_CHUNK - 1) / MJ_RENDER_CHUNK, chunks);
+        if (m_clip.lines)
+            m_clip.lines->add(kind, key, m_line);
+        return m_line;
+    }
+
+    /* the box of border, as mj_recursive_render decides it */
+    void box(const MJ_BoxBorder& border, const MJ_BoxBorder *border_dist)
+    {
+        const MJ_StridedSurface<double>& surface = m_job.surface;
+        const MJ_StridedSurface<double> *dist = m_job.dist;
+        int left_x = border.left_x, right_x = border.right_x, top_y = border.top_y, bottom_y = border.bottom_y;
+        int width = right_x - left_x + 1, height = bottom_y - top_y + 1;
+
+        for (int k = 0; k < border.size(); k++) {
+            int x, y;
+            border.position(k, x, y);
+            if (!is_inside(x, y))
+                continue;
+            surface(x - m_clip.x, y - m_clip.y) = border(x, y);
+            if (dist)
+                (*dist)(x - m_clip.x, y - m_clip.y) = (*border_dist)(x, y);
+        }
+
+        /* the inside of the box in the part */
+        int x0 = std::max(left_x + 1, m_clip.x), x1 = std::min(right_x - 1, m_right_x);
+        int y0 = std::max(top_y + 1, m_clip.y), y1 = std::min(bottom_y - 1, m_bottom_y);
+        if (width <= 2 || height <= 2 || x0 > x1 || y0 > y1)
+            return;
+
+        if (is_inside(left_x, top_y) && is_inside(right_x, bottom_y)) {
+            int box[4] = {left_x - m_clip.x, right_x - m_clip.x, top_y - m_clip.y, bottom_y - m_clip.y};
+            m_boxes.insert(m_boxes.end(), box, box + 4);
+            return;
+        }
+
+        if (mj_box_is_infinity(border, left_x, right_x, top_y, bottom_y)) {
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    surface(x - m_clip.x, y - m_clip.y) = MJ_INFINITY;
+                    if (dist)
+                        (*dist)(x - m_clip.x, y - m_clip.y) = 0.0;
+                }
+            }
+            return;
+        }
+
+        if (dist && m_job.de_fill > 0.0) {
+            double limit = m_job.de_fill * hypot(width - 1, height - 1) * m_job.stride * m_job.pixel_width;
+            if (mj_box_is_far(*border_dist, limit, left_x, right_x, top_y, bottom_y)) {
+                interpolate(border, border_dist, x0, x1, y0, y1);
+                m_job.nb_filled += long(x1 - x0 + 1) * (y1 - y0 + 1);
+                return;
+            }
+        }
+
+        if (m_job.guess > 0.0 && long(width - 2) * (height - 2) >= MJ_GUESS_MIN_AREA &&
+            mj_box_is_smooth(border, m_job.guess, left_x, right_x, top_y, bottom_y)) {
+            int sx[MJ_GUESS_SAMPLES], sy[MJ_GUESS_SAMPLES];
+            double values[MJ_GUESS_SAMPLES], values_dist[MJ_GUESS_SAMPLES];
+            mj_guess_points(left_x, right_x, top_y, bottom_y, sx, sy);
+            points(sx, sy, MJ_GUESS_SAMPLES, values, dist ? values_dist : NULL);
+
+            int is_guessed = 1;
+            for (int k = 0; is_guessed && k < MJ_GUESS_SAMPLES; k++)
+                is_guessed = fabs(values[k] - mj_interpolate_point(border, left_x, right_x, top_y, bottom_y,
+                                                                   sx[k], sy[k])) <= m_job.guess;
+            if (is_guessed) {
+                interpolate(border, border_dist, x0, x1, y0, y1);
+                long nb_samples = 0;
+                for (int k = 0; k < MJ_GUESS_SAMPLES; k++) {
+                    if (sx[k] < x0 || sx[k] > x1 || sy[k] < y0 || sy[k] > y1)
+                        continue;
+                    surface(sx[k] - m_clip.x, sy[k] - m_clip.y) = values[k];
+                    if (dist)
+                        (*dist)(sx[k] - m_clip.x, sy[k] - m_clip.y) = values_dist[k];
+                    int is_new = 1;
+                    for (int j = 0; is_new && j < k; j++)
+                        is_new = (sx[j] != sx[k] || sy[j] != sy[k]);
+                    nb_samples += is_new;
+                }
+                m_job.nb_guessed += long(x1 - x0 + 1) * (y1 - y0 + 1) - nb_samples;
+                return;
+            }
+        }
+
+        /* the split of mj_recursive_render */
+        int is_row = (width < height);
+        int middle = is_row ? (top_y + bottom_y) / 2 : (left_x + right_x) / 2;
+        int n = is_row ? width - 2 : height - 2;
+        int *xs = new int[2 * n];
+        int *ys = xs + n;
+        for (int k = 0; k < n; k++) {
+            xs[k] = is_row ? left_x + 1 + k : middle;
+            ys[k] = is_row ? middle : top_y + 1 + k;
+        }
+        std::vector<double> points = line(0, border, xs, ys, n);
+        delete[] xs;
+
+        for (int half = 0; half < 2; half++) {
+            int l = left_x, r = right_x, t = top_y, b = bottom_y;
+            if (is_row)
+                (half ? t : b) = middle;
+            else
+                (half ? l : r) = middle;
+            MJ_BoxBorder child(l, r, t, b);
+            MJ_BoxBorder *child_dist = dist ? new MJ_BoxBorder(l, r, t, b) : NULL;
+            for (int k = 0; k < child.size(); k++) {
+                int x, y, on_line;
+                child.position(k, x, y);
+                on_line = is_row ? (y == middle && x > left_x && x < right_x) :
+                                   (x == middle && y > top_y && y < bottom_y);
+                int j = is_row ? x - left_x - 1 : y - top_y - 1;
+                child(x, y) = on_line ? points[j] : border(x, y);
+                if (child_dist)
+                    (*child_dist)(x, y) = on_line ? points[n + j] : (*border_dist)(x, y);
+            }
+            box(child, child_dist);
+            delete child_dist;
+        }
+    }
+
+    /* the points of the box of border in the part from x0, y0 to x1, y1, from the border */
+    void interpolate(const MJ_BoxBorder& border, const MJ_BoxBorder *border_dist, int x0, int x1, int y0, int y1)
+    {
+        int left_x = border.left_x, right_x = border.right_x, top_y = border.top_y, bottom_y = border.bottom_y;
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                m_job.surface(x - m_clip.x, y - m_clip.y) =
+                    mj_interpolate_point(border, left_x, right_x, top_y, bottom_y, x, y);
+                if (border_dist)
+                    (*m_job.dist)(x - m_clip.x, y - m_clip.y) =
+                        mj_interpolate_point(*border_dist, left_x, right_x, top_y, bottom_y, x, y);
+            }
+        }
+    }
+
+    MJ_ThreadPool&          m_pool;
+    MJ_RenderJob<Frame>&    m_job;
+    const MJ_RenderClip&    m_clip;
+    int                     m_right_x, m_bottom_y;
+    std::vector<int>        m_boxes;
+    std::vector<double>     m_line;
+
+    MJ_ClippedRender(const MJ_ClippedRender&);
+    MJ_ClippedRender& operator=(const MJ_ClippedRender&);
+};
+
+/* the stride of the first level of a progressive render, halved down to 1 */
+#define MJ_PROGRESSIVE_STRIDE 8
+
+/* receives the levels of a progressive mj_adaptive_render before the last one */
+class MJ_RenderProgress {
+public:
+    virtual ~MJ_RenderProgress() {}
+
+    /* the points of surface at multiples of stride are set */
+    virtual void level(const MJ_Surface<double>& surface, int stride) = 0;
+};
+
+/*
+ * Returns the number of points interpolated by de_fill, those guessed go to
+ * *nb_guessed. With progress, the surface is first rendered at every
+ * MJ_PROGRESSIVE_STRIDE points and finer until every point. A level keeps
+ * the points computed by the ones before, so none is computed twice, and
+ * the last level makes the same decisions as a render without progress.
+ * With cache, the points are kept there and taken from the renders before,
+ * point (x, y) of the surface at (x + cache_x, y + cache_y) of the cache.
+ * The points are also marked with guess, whose samples inside a box are
+ * not computed again by the lines that split it. With clip, the surface is
+ * rendered as a part of a larger one, without progress or cache.
+ */
+template<typename Frame>
+long mj_adaptive_render(MJ_ThreadPool& pool, const MJ_Surface<double>& surface, const Frame& frame,
                         double center_x, double center_y, double pixel_width,
-                        int max_iter, int julia_mode)
+                        const MJ_Surface<double> *dist = NULL, double de_fill = 0.0,
+                        double guess = 0.0, long *nb_guessed = NULL, MJ_RenderProgress *progress = NULL,
+                        MJ_RenderCache<typename Frame::scalar> *cache = NULL, int cache_x = 0, int cache_y = 0,
+                        const MJ_RenderClip *clip = NULL)
 {
-    for (int x = 0; x < surface.width(); x++) {
-        double zx = (x - center_x) * pixel_width;
-        double zy = center_y * pixel_width;
-        surface(x,0) = mj_calc_select(cx, cy, zx, zy, max_iter, julia_mode);
+    const MJ_Surface<double> *values = &surface, *values_dist = dist;
+    MJ_Surface<unsigned char> *known = NULL;
+    MJ_Surface<MJ_Orbit<typename Frame::scalar>> *orbits = NULL;
 
-        int y = surface.height() - 1;
-        zy = (center_y - y) * pixel_width;
-        surface(x,y) = mj_calc_select(cx, cy, zx, zy, max_iter, julia_mode);
+    if (cache) {
+        if (cache_x < 0 || cache_y < 0 || cache->values.width() < surface.width() + cache_x ||
+            cache->values.height() < surface.height() + cache_y)
+            throw "render cache does not fit the surface";
+        cache->begin(frame.max_iter, frame.escalate, dist != NULL);
+        values = &cache->values, values_dist = cache->dist;
+        known = &cache->known, orbits = &cache->orbits;
+    } else if (progress || guess > 0.0) {
+        cache_x = cache_y = 0;
+        known = new MJ_Surface<unsigned char>(surface.width(), surface.height());
+        for (int y = 0; y < surface.height(); y++)
+            for (int x = 0; x < surface.width(); x++)
+                (*known)(x, y) = 0;
     }
 
-    for (int y = 1; y < surface.height() - 1; y++) {
-        double zx = -center_x * pixel_width;
-        double zy = (center_y - y) * pixel_width;
-        surface(0,y) = mj_calc_select(cx, cy, zx, zy, max_iter, julia_mode);
+    if (progress) {
+        MJ_Surface<double> level(surface.width(), surface.height());
+        MJ_Surface<double> *level_dist = dist ? new MJ_Surface<double>(surface.width(), surface.height()) : NULL;
 
-        int x = surface.width() - 1;
-        zx = (x - center_x) * pixel_width;
-        surface(x,y) = mj_calc_select(cx, cy, zx, zy, max_iter, julia_mode);
+        for (int stride = MJ_PROGRESSIVE_STRIDE; stride > 1; stride /= 2) {
+            MJ_RenderJob<Frame> job(frame, center_x, center_y, pixel_width, de_fill, guess, stride,
+                                    level, level_dist, values, values_dist, known, orbits, cache_x, cache_y);
+            if (job.surface.width() < 3 || job.surface.height() < 3)
+                continue;
+            pool.run(new MJ_RenderTask<Frame>(job));
+            progress->level(level, stride);
+        }
+        delete level_dist;
     }
 
-    mj_recursive_render(surface, cx, cy, center_x, center_y, pixel_width,
-                        0, surface.width() - 1, 0, surface.height() - 1,
-                        max_iter, julia_mode);
+    MJ_RenderJob<Frame> job(frame, center_x, center_y, pixel_width, de_fill, guess, 1,
+                            surface, dist, values, values_dist, known, orbits, cache_x, cache_y);
+    if (clip) {
+        MJ_ClippedRender<Frame> render(pool, job, *clip);
+        render.run();
+    } else {
+        pool.run(new MJ_RenderTask<Frame>(job));
+    }
+    if (!cache)
+        delete known;
+    if (nb_guessed)
+        *nb_guessed = job.nb_guessed;
+    return job.nb_filled;
 }
 
 #endif
@@ -21,11 +21,140 @@
 #include "mj-surface.h"
 #include "mj-color.h"
 #include "mj-calc.h"
+#include "mj-calc-simd.h"
+#include "mj-thread-pool.h"
 
-template<typename T>
-int mj_antialias(MJ_Surface<MJ_Color> const& output, MJ_Surface<double> const& input, MJ_ColorPalette const& palette,
-                 T cx, T cy, double center_x, double center_y, double pixel_width, double threshold,
-                 double period, int pass, int max_iter, int julia_mode)
+static const int mj_antialias_offset_x[8] = {
+    -1, 0, 1,
+    -1,    1,
+    -1, 0, 1
+};
+
+static const int mj_antialias_offset_y[8] = {
+    -1, -1, -1,
+     0,      0,
+     1,  1,  1
+};
+
+static const double mj_antialias_threshold_weight[8] = {
+    1.3, 1.0, 1.3,
+    1.0     , 1.0,
+    1.3, 1.0, 1.3
+};
+
+/*
+ * Pixels are supersampled where the iteration differs from a neighbor by
+ * threshold (weighted by the distance). With dist, they are instead chosen
+ * by the distance estimate, below de_threshold pixels, or by a neighbor on
+ * the other side of the interior boundary, for which a halved interior
+ * pixel is on the outside of the interior pixels and the inside of the
+ * others. Either way, a pixel once chosen stays chosen as the interior
+ * pixels are halved, so the pixels chosen do not depend on the order.
+ */
+inline int mj_need_antialias(MJ_Surface<double> const& input, int x, int y, double threshold, double pixel_width,
+                             MJ_Surface<double> const *dist, double de_threshold)
+{
+    if (dist) {
+        if (!(input(x,y) < MJ_INFINITY)) {
+            for (int k = 0; k < 8; k++)
+                if (input(x + mj_antialias_offset_x[k], y + mj_antialias_offset_y[k]) < MJ_INFINITY)
+                    return 1;
+            return 0;
+        }
+        if ((*dist)(x,y) < de_threshold * pixel_width)
+            return 1;
+        for (int k = 0; k < 8; k++)
+            if (!(input(x + mj_antialias_offset_x[k], y + mj_antialias_offset_y[k]) < 0.5 * MJ_INFINITY))
+                return 1;
+        return 0;
+    }
+
+    for (int k = 0; k < 8; k++)
+        if (fabs(input(x,y) - input(x + mj_antialias_offset_x[k], y + mj_antialias_offset_y[k])) >=
+            threshold * mj_antialias_threshold_weight[k])
+            return 1;
+    return 0;
+}
+
+/* the offsets of the 8 samples around pixel (x, y) */
+inline void mj_antialias_offsets(double center_x, double center_y, double pixel_width, int x, int y,
+                                 double *zx, double *zy)
+{
+    const double antialias_step = 1.0/3.0;
+
+    for (int k = 0; k < 8; k++) {
+        zx[k] = (x - center_x + mj_antialias_offset_x[k] * antialias_step) * pixel_width;
+        zy[k] = (center_y - y - mj_antialias_offset_y[k] * antialias_step) * pixel_width;
+    }
+}
+
+/* the 8 samples around pixel (x, y) */
+template<typename Frame>
+void mj_antialias_samples(Frame const& frame, double center_x, double center_y, double pixel_width,
+                          int x, int y, double *res)
+{
+    double antialias_zx[8], antialias_zy[8];
+
+    mj_antialias_offsets(center_x, center_y, pixel_width, x, y, antialias_zx, antialias_zy);
+    mj_calc_batch(frame, antialias_zx, antialias_zy, res, 8);
+}
+
+/*
+ * Samples of the pixels of row y that need them with the input as it is at
+ * the start of a pass, stored as x followed by the 8 samples. The samples of
+ * the row are computed in one batch.
+ */
+template<typename Frame>
+struct MJ_AntialiasRows {
+    MJ_Surface<MJ_Color> const& output;
+    MJ_Surface<double> const&   input;
+    Frame const&                frame;
+    double                      center_x, center_y, pixel_width, threshold;
+    MJ_Surface<double> const    *dist;
+    double                      de_threshold;
+    std::vector<double>         *rows;
+
+    void operator()(int y)
+    {
+        std::vector<int> xs;
+        for (int x = 1; x < input.width() - 1; x++) {
+            if (output(x-1,y-1).v[3] > 0.0f ||
+                !mj_need_antialias(input, x, y, threshold, pixel_width, dist, de_threshold))
+                continue;
+            xs.push_back(x);
+        }
+        if (xs.empty())
+            return;
+
+        int n = int(xs.size());
+        std::vector<double> zx(8 * n), zy(8 * n), res(8 * n);
+        for (int k = 0; k < n; k++)
+            mj_antialias_offsets(center_x, center_y, pixel_width, xs[k], y, &zx[8 * k], &zy[8 * k]);
+        mj_calc_batch(frame, &zx[0], &zy[0], &res[0], 8 * n);
+
+        std::vector<double>& row = rows[y];
+        for (int k = 0; k < n; k++) {
+            row.push_back(xs[k]);
+            row.insert(row.end(), &res[8 * k], &res[8 * k] + 8);
+        }
+    }
+};
+
+/*
+ * A pass supersamples the pixels chosen by mj_need_antialias. An interior
+ * pixel with a sample outside is halved, which changes the choice for the
+ * pixels after it. The samples are computed on the threads of pool with the
+ * input of the start of the pass, then the pass goes over the pixels in
+ * order and computes what was not predicted. The result does not depend on
+ * the number of threads. With samples, the pixels supersampled are added to
+ * samples[y] for their row y of the input as x followed by the 8 samples.
+ */
+template<typename Frame>
+int mj_antialias(MJ_ThreadPool& pool, MJ_Surface<MJ_Color> const& output, MJ_Surface<double> const& input,
+                 MJ_ColorPalette const& palette, Frame const& frame, double center_x, double center_y,
+                 double pixel_width, double threshold, double period, int pass,
+                 MJ_Surface<double> const *dist = NULL, double de_threshold = 0.0,
+                 std::vector<double> *samples = NULL)
 {
     if (!pass) {
         for (int x = 0, y = 0; x < input.width(); x++)
@@ -43,61 +172,51 @@ int mj_antialias(MJ_Surface<MJ_Color> const& output, MJ_Surface<double> const& i
                                   palette.infinity_color(0) : palette.color(input(x,y)/period, 0);
     }
 
-    const int offset_x[8] = {
-        -1, 0, 1,
-        -1,    1,
-        -1, 0, 1
-    };
-
-    const int offset_y[8] = {
-        -1, -1, -1,
-         0,      0,
-         1,  1,  1
+    std::vector<double> *rows = new std::vector<double>[input.height()];
+    MJ_AntialiasRows<Frame> body = {
+        output, input, frame, center_x, center_y, pixel_width, threshold, dist, de_threshold, rows
     };
-
-    const double threshold_weight[8] = {
-        1.3, 1.0, 1.3,
-        1.0     , 1.0,
-        1.3, 1.0, 1.3
-    };
-
-    const double antialias_step = 1.0/3.0;
+    mj_parallel_for(pool, 1, input.height() - 1, body);
 
     int modified = 0;
 
     MJ_Color antialias_buf[9];
+    double antialias_res[8];
 
     for (int y = 1; y < input.height() - 1; y++) {
+        const double *cached = rows[y].data(), *cached_end = cached + rows[y].size();
+
         for (int x = 1; x < input.width() - 1; x++) {
             if (output(x-1,y-1).v[3] > 0.0f)
                 continue;
 
-            int need_antialias = 0;
-            for (int k = 0; k < 8; k++) {
-                if (fabs(input(x,y) - input(x + offset_x[k], y + offset_y[k])) >= threshold * threshold_weight[k]) {
-                    need_antialias = 1;
-                    break;
-                }
-            }
-
-            if (!need_antialias) {
+            if (!mj_need_antialias(input, x, y, threshold, pixel_width, dist, de_threshold)) {
                 if (input(x,y) < MJ_INFINITY)
                     output(x-1,y-1).v[3] = 1.0f;
                 continue;
             }
 
+            while (cached < cached_end && cached[0] < x)
+                cached += 9;
+            const double *res = antialias_res;
+            if (cached < cached_end && cached[0] == x)
+                res = cached + 1;
+            else
+                mj_antialias_samples(frame, center_x, center_y, pixel_width, x, y, antialias_res);
+
             int is_infinity = 1;
             for (int k = 0; k < 8; k++) {
-                double zx = (x - center_x + offset_x[k] * antialias_step) * pixel_width;
-                double zy = (center_y - y - offset_y[k] * antialias_step) * pixel_width;
-                double res = mj_calc_select(cx, cy, zx, zy, max_iter, julia_mode);
-                if (res == MJ_INFINITY) {
+                if (res[k] == MJ_INFINITY) {
                     antialias_buf[k] = palette.infinity_color(1);
                 } else {
-                    antialias_buf[k] = palette.color(res / period, 1);
+                    antialias_buf[k] = palette.color(res[k] / period, 1);
                     is_infinity = 0;
                 }
             }
+            if (samples) {
+                samples[y].push_back(x);
+                samples[y].insert(samples[y].end(), res, res + 8);
+            }
             antialias_buf[8] = output(x-1,y-1);
             output(x-1,y-1) = mj_color_average(antialias_buf, 1, 9);
             if (input(x,y) == MJ_INFINITY && !is_infinity) {
@@ -107,7 +226,70 @@ int mj_antialias(MJ_Surface<MJ_Color> const& output, MJ_Surface<double> const& i
         }
     }
 
+    delete[] rows;
     return modified;
 }
 
+#define MJ_SIDE_LEFT    1
+#define MJ_SIDE_TOP     2
+#define MJ_SIDE_RIGHT   4
+#define MJ_SIDE_BOTTOM  8
+
+/*
+ * After the passes of mj_antialias, whether the pixels of the rectangle at
+ * (x, y) of output would be supersampled the same if the border of input
+ * were not halved on the sides not in fixed, where it is made of pixels of a
+ * larger image, halved there or not. The pixels chosen only grow with the
+ * pixels halved, so when both ways agree, the rectangle is supersampled as
+ * in the larger image.
+ */
+inline bool mj_antialias_is_settled(MJ_Surface<MJ_Color> const& output, MJ_Surface<double> const& input, int fixed,
+                                    int x, int y, int width, int height)
+{
+    const double inside = 0.5 * MJ_INFINITY;
+    int w = input.width(), h = input.height();
+    MJ_Surface<unsigned char> chosen(w, h);
+    std::vector<int> halved;
+
+    for (int j = 0; j < h; j++)
+        for (int i = 0; i < w; i++)
+            chosen(i, j) = 0;
+
+    /* the interior pixels next to a pixel outside or a border halved either way */
+    for (int j = 1; j < h - 1; j++) {
+        for (int i = 1; i < w - 1; i++) {
+            if (input(i, j) < inside)
+                continue;
+            for (int k = 0; k < 8 && !chosen(i, j); k++) {
+                int ni = i + mj_antialias_offset_x[k], nj = j + mj_antialias_offset_y[k];
+                int side = (ni == 0 ? MJ_SIDE_LEFT : 0) | (nj == 0 ? MJ_SIDE_TOP : 0) |
+                           (ni == w - 1 ? MJ_SIDE_RIGHT : 0) | (nj == h - 1 ? MJ_SIDE_BOTTOM : 0);
+                chosen(i, j) = input(ni, nj) < inside || (side & fixed);
+            }
+            if (chosen(i, j) && input(i, j) < MJ_INFINITY)
+                halved.push_back(j * w + i);
+        }
+    }
+
+    /* and those next to them that were halved */
+    while (!halved.empty()) {
+        int i = halved.back() % w, j = halved.back() / w;
+        halved.pop_back();
+        for (int k = 0; k < 8; k++) {
+            int ni = i + mj_antialias_offset_x[k], nj = j + mj_antialias_offset_y[k];
+            if (ni < 1 || nj < 1 || ni >= w - 1 || nj >= h - 1 || chosen(ni, nj) || input(ni, nj) < inside)
+                continue;
+            chosen(ni, nj) = 1;
+            if (input(ni, nj) < MJ_INFINITY)
+                halved.push_back(nj * w + ni);
+        }
+    }
+
+    for (int j = y; j < y + height; j++)
+        for (int i = x; i < x + width; i++)
+            if (input(i + 1, j + 1) >= inside && (output(i, j).v[3] > 0.0f) != (chosen(i + 1, j + 1) != 0))
+                return false;
+    return true;
+}
+
 #endif
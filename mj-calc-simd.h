@@ -0,0 +1,978 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_CALC_SIMD_H
+#define MJ_CALC_SIMD_H 1
+
+#include <stdint.h>
+#include <math.h>
+#include <complex.h>
+#include <x86intrin.h>
+#include "mj-calc.h"
+#include "mj-dd.h"
+#include "mj-f128.h"
+
+#define MJ_LANES_ALIGN __attribute__((aligned(64)))
+
+/*
+ * vector types of LANES doubles, reduce_and() folds all lanes of a mask into
+ * one, mul32() multiplies the low 32 bits of each lane into 64 bits and fms()
+ * is a * b - c rounded once, in 4 and 8 lanes. They are only inlined into
+ * functions built for the same instruction set (flatten).
+ */
+template<int LANES> struct MJ_Lanes;
+
+template<> struct MJ_Lanes<2> {
+    typedef double   vdouble __attribute__((vector_size(16)));
+    typedef int64_t  vmask   __attribute__((vector_size(16)));
+    typedef uint64_t vuint   __attribute__((vector_size(16)));
+
+    static inline vuint mul32(vuint a, vuint b)
+    {
+        return (vuint) _mm_mul_epu32((__m128i) a, (__m128i) b);
+    }
+
+    static inline __attribute__((always_inline)) int64_t reduce_and(vmask v)
+    {
+        return v[0] & v[1];
+    }
+};
+
+template<> struct MJ_Lanes<4> {
+    typedef double   vdouble __attribute__((vector_size(32)));
+    typedef int64_t  vmask   __attribute__((vector_size(32)));
+    typedef uint64_t vuint   __attribute__((vector_size(32)));
+
+    static inline __attribute__((target("avx2"))) vuint mul32(vuint a, vuint b)
+    {
+        return (vuint) _mm256_mul_epu32((__m256i) a, (__m256i) b);
+    }
+
+    static inline __attribute__((target("fma"))) vdouble fms(vdouble a, vdouble b, vdouble c)
+    {
+        return (vdouble) _mm256_fmsub_pd((__m256d) a, (__m256d) b, (__m256d) c);
+    }
+
+    static inline __attribute__((always_inline)) int64_t reduce_and(vmask v)
+    {
+        v &= __builtin_shuffle(v, (vmask){ 2, 3, 0, 1 });
+        v &= __builtin_shuffle(v, (vmask){ 1, 0, 3, 2 });
+        return v[0];
+    }
+};
+
+template<> struct MJ_Lanes<8> {
+    typedef double   vdouble __attribute__((vector_size(64)));
+    typedef int64_t  vmask   __attribute__((vector_size(64)));
+    typedef uint64_t vuint   __attribute__((vector_size(64)));
+
+    static inline __attribute__((target("avx512f"))) vuint mul32(vuint a, vuint b)
+    {
+        return (vuint) _mm512_mul_epu32((__m512i) a, (__m512i) b);
+    }
+
+    static inline __attribute__((target("avx512f"))) vdouble fms(vdouble a, vdouble b, vdouble c)
+    {
+        return (vdouble) _mm512_fmsub_pd((__m512d) a, (__m512d) b, (__m512d) c);
+    }
+
+    static inline __attribute__((always_inline)) int64_t reduce_and(vmask v)
+    {
+        v &= __builtin_shuffle(v, (vmask){ 4, 5, 6, 7, 0, 1, 2, 3 });
+        v &= __builtin_shuffle(v, (vmask){ 2, 3, 0, 1, 6, 7, 4, 5 });
+        v &= __builtin_shuffle(v, (vmask){ 1, 0, 3, 2, 5, 4, 7, 6 });
+        return v[0];
+    }
+};
+
+/*
+ * Lane-parallel mj_calc<double>. Each lane runs one point with exactly the
+ * same operation sequence as the scalar version, so the results are
+ * bit-identical as long as the compiler does not contract a*b+c into fma
+ * (build with -ffp-contract=off). A lane is refilled with the next point
+ * as soon as its point escapes, runs out of iterations or is found to be
+ * periodic. Returns the number of periodic points. With DE, the lanes also
+ * carry the derivative of mj_calc_de and store the distance estimates in de.
+ * With orbit, a point is continued from its orbit at k > 0 and leaves where
+ * it stopped there, as mj_calc_resume does.
+ */
+template<int P, int LANES, bool DE>
+static inline __attribute__((always_inline))
+long mj_calc_lanes_impl(const double *cx, const double *cy, const double *zx, const double *zy,
+                        double *result, int n, int max_iter, double *de, double deriv0, double deriv_add,
+                        MJ_Orbit<double> *orbit)
+{
+    typedef typename MJ_Lanes<LANES>::vdouble vdouble;
+    typedef typename MJ_Lanes<LANES>::vmask vmask;
+    const double fsq_max = 1.001 * pow(2.0, 2.0 / (P - 1));
+    const double tol = mj_period_tol(0.0);
+    double acx[LANES] MJ_LANES_ALIGN, acy[LANES] MJ_LANES_ALIGN, azx[LANES] MJ_LANES_ALIGN;
+    double azy[LANES] MJ_LANES_ALIGN, ak[LANES] MJ_LANES_ALIGN, afsq[LANES] MJ_LANES_ALIGN;
+    double afsq_max[LANES] MJ_LANES_ALIGN, alimit[LANES] MJ_LANES_ALIGN;
+    double apx[LANES] MJ_LANES_ALIGN, apy[LANES] MJ_LANES_ALIGN;
+    double anext[LANES] MJ_LANES_ALIGN, atol[LANES] MJ_LANES_ALIGN, adx[LANES] MJ_LANES_ALIGN;
+    double ady[LANES] MJ_LANES_ALIGN, adrx[LANES] MJ_LANES_ALIGN, adry[LANES] MJ_LANES_ALIGN;
+    int idx[LANES], window[LANES];
+    int next = 0, active = 0;
+    long nb_periodic = 0;
+
+    for (int l = 0; l < LANES; l++) {
+        if (next < n) {
+            idx[l] = next++, active++;
+            acx[l] = cx[idx[l]], acy[l] = cy[idx[l]];
+            azx[l] = apx[l] = zx[idx[l]], azy[l] = apy[l] = zy[idx[l]];
+            ak[l] = anext[l] = 0, window[l] = 1, atol[l] = tol;
+            afsq_max[l] = fsq_max, alimit[l] = max_iter;
+        } else {
+            idx[l] = -1;
+            acx[l] = acy[l] = azx[l] = azy[l] = apx[l] = apy[l] = 0;
+            ak[l] = 0, anext[l] = afsq_max[l] = alimit[l] = HUGE_VAL, atol[l] = -HUGE_VAL;
+        }
+        adrx[l] = deriv0, adry[l] = 0.0;
+        if (orbit && idx[l] >= 0 && orbit[idx[l]].k > 0) {
+            const MJ_Orbit<double>& o = orbit[idx[l]];
+            azx[l] = o.zx, azy[l] = o.zy, apx[l] = o.px, apy[l] = o.py;
+            ak[l] = o.k, anext[l] = o.next, window[l] = o.window;
+            adrx[l] = o.drx, adry[l] = o.dry;
+        }
+    }
+
+    while (active) {
+        vdouble lcx, lcy, lzx, lzy, lk, lfsq_max, llimit, lpx, lpy, lnext, ltol, fsq, dx, dy, ldrx, ldry;
+        vmask event;
+        const vmask abs_mask = (vmask){} + INT64_MAX;
+        lcx = *(const vdouble *) acx;
+        lcy = *(const vdouble *) acy;
+        lzx = *(const vdouble *) azx;
+        lzy = *(const vdouble *) azy;
+        lk = *(const vdouble *) ak;
+        lfsq_max = *(const vdouble *) afsq_max;
+        llimit = *(const vdouble *) alimit;
+        lpx = *(const vdouble *) apx;
+        lpy = *(const vdouble *) apy;
+        lnext = *(const vdouble *) anext;
+        ltol = *(const vdouble *) atol;
+        if constexpr (DE)
+            ldrx = *(const vdouble *) adrx, ldry = *(const vdouble *) adry;
+
+        for ( ; ; ) {
+            vdouble sx, sy;
+            mj_complex_pow<P>(sx, sy, lzx, lzy, &fsq);
+
+            /* sign bit is clear on lanes with fsq >= lfsq_max, lk >= llimit or lk >= lnext */
+            event = (vmask)(fsq - lfsq_max) & (vmask)(lk - llimit) & (vmask)(lk - lnext);
+            if constexpr (DE)
+                mj_deriv_step<P>(ldrx, ldry, lzx, lzy, deriv_add);
+            lzx = sx + lcx;
+            lzy = sy + lcy;
+            lk = lk + 1.0;
+
+            /* and on lanes back within ltol of the saved point */
+            dx = (vdouble)((vmask)(lzx - lpx) & abs_mask);
+            dy = (vdouble)((vmask)(lzy - lpy) & abs_mask);
+            event &= (vmask)(ltol - dx) | (vmask)(ltol - dy);
+
+            if (MJ_Lanes<LANES>::reduce_and(event) >= 0)
+                break;
+        }
+
+        *(vdouble *) azx = lzx;
+        *(vdouble *) azy = lzy;
+        *(vdouble *) ak = lk;
+        *(vdouble *) afsq = fsq;
+        *(vdouble *) adx = dx;
+        *(vdouble *) ady = dy;
+        if constexpr (DE)
+            *(vdouble *) adrx = ldrx, *(vdouble *) adry = ldry;
+
+        for (int l = 0; l < LANES; l++) {
+            if (event[l] < 0)
+                continue;
+
+            int k = ak[l] - 1.0;
+            int done = 0;
+            double res = MJ_INFINITY;
+            if (alimit[l] == max_iter) {
+                /* first stage: fsq_max, max_iter, periodicity or saving the point */
+                if (k >= max_iter) {
+                    done = 1;
+                    if (orbit) {
+                        /* iteration k is done but not tested, a point escaping there starts over */
+                        MJ_Orbit<double>& o = orbit[idx[l]];
+                        if (afsq[l] >= fsq_max) {
+                            o.k = 0;
+                        } else if (adx[l] <= tol && ady[l] <= tol) {
+                            o.k = MJ_ORBIT_DONE;
+                        } else {
+                            if (k == anext[l]) {
+                                apx[l] = azx[l], apy[l] = azy[l];
+                                window[l] *= 2;
+                                anext[l] = k + window[l];
+                            }
+                            mj_orbit_save(&o, azx[l], azy[l], apx[l], apy[l], k + 1, int(anext[l]), window[l],
+                                          adrx[l], adry[l]);
+                        }
+                    }
+                } else if (afsq[l] >= fsq_max) {
+                    afsq_max[l] = MJ_INFINITY;
+                    alimit[l] = max_iter + 1000;
+                    anext[l] = HUGE_VAL, atol[l] = -HUGE_VAL;
+                } else if (adx[l] <= tol && ady[l] <= tol) {
+                    done = 1, nb_periodic++;
+                    if (orbit)
+                        orbit[idx[l]].k = MJ_ORBIT_DONE;
+                } else {
+                    if (k == anext[l]) {
+                        apx[l] = azx[l], apy[l] = azy[l];
+                        window[l] *= 2;
+                        anext[l] = k + window[l];
+                    }
+                    continue;
+                }
+            }
+
+            if (!done) {
+                /* second stage: refine the escape until MJ_INFINITY */
+                if (afsq[l] >= MJ_INFINITY)
+                    res = (k - 1) - log2(log2(afsq[l])) / log2(P), done = 1;
+                else if (k >= max_iter + 1000)
+                    done = 1;
+                if (done && orbit)
+                    orbit[idx[l]].k = MJ_ORBIT_DONE;
+            }
+
+            if (!done)
+                continue;
+
+            result[idx[l]] = res;
+            if constexpr (DE)
+                de[idx[l]] = (res == MJ_INFINITY) ? 0.0 : mj_distance(azx[l], azy[l], adrx[l], adry[l]);
+            adrx[l] = deriv0, adry[l] = 0.0;
+            if (next < n) {
+                idx[l] = next++;
+                acx[l] = cx[idx[l]], acy[l] = cy[idx[l]];
+                azx[l] = apx[l] = zx[idx[l]], azy[l] = apy[l] = zy[idx[l]];
+                ak[l] = anext[l] = 0, window[l] = 1, atol[l] = tol;
+                afsq_max[l] = fsq_max, alimit[l] = max_iter;
+                if (orbit && orbit[idx[l]].k > 0) {
+                    const MJ_Orbit<double>& o = orbit[idx[l]];
+                    azx[l] = o.zx, azy[l] = o.zy, apx[l] = o.px, apy[l] = o.py;
+                    ak[l] = o.k, anext[l] = o.next, window[l] = o.window;
+                    adrx[l] = o.drx, adry[l] = o.dry;
+                }
+            } else {
+                idx[l] = -1, active--;
+                acx[l] = acy[l] = azx[l] = azy[l] = apx[l] = apy[l] = 0;
+                ak[l] = 0, anext[l] = afsq_max[l] = alimit[l] = HUGE_VAL, atol[l] = -HUGE_VAL;
+            }
+        }
+    }
+
+    return nb_periodic;
+}
+
+template<int P, bool DE>
+__attribute__((target("avx512f,avx512dq"), flatten))
+static long mj_calc_lanes_avx512(const double *cx, const double *cy, const double *zx, const double *zy,
+                                 double *result, int n, int max_iter, double *de, double deriv0, double deriv_add,
+                                 MJ_Orbit<double> *orbit)
+{
+    return mj_calc_lanes_impl<P, 8, DE>(cx, cy, zx, zy, result, n, max_iter, de, deriv0, deriv_add, orbit);
+}
+
+template<int P, bool DE>
+__attribute__((target("avx2"), flatten))
+static long mj_calc_lanes_avx2(const double *cx, const double *cy, const double *zx, const double *zy,
+                               double *result, int n, int max_iter, double *de, double deriv0, double deriv_add,
+                               MJ_Orbit<double> *orbit)
+{
+    return mj_calc_lanes_impl<P, 4, DE>(cx, cy, zx, zy, result, n, max_iter, de, deriv0, deriv_add, orbit);
+}
+
+template<int P, bool DE>
+__attribute__((flatten))
+static long mj_calc_lanes_sse2(const double *cx, const double *cy, const double *zx, const double *zy,
+                               double *result, int n, int max_iter, double *de, double deriv0, double deriv_add,
+                               MJ_Orbit<double> *orbit)
+{
+    return mj_calc_lanes_impl<P, 2, DE>(cx, cy, zx, zy, result, n, max_iter, de, deriv0, deriv_add, orbit);
+}
+
+template<int P, bool DE>
+inline long mj_calc_lanes(const double *cx, const double *cy, const double *zx, const double *zy,
+                          double *result, int n, int max_iter, double *de = NULL,
+                          double deriv0 = 0.0, double deriv_add = 0.0, MJ_Orbit<double> *orbit = NULL)
+{
+    static const int cpu = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") ? 512 :
+                           __builtin_cpu_supports("avx2") ? 256 : 128;
+    if (cpu == 512)
+        return mj_calc_lanes_avx512<P, DE>(cx, cy, zx, zy, result, n, max_iter, de, deriv0, deriv_add, orbit);
+    else if (cpu == 256)
+        return mj_calc_lanes_avx2<P, DE>(cx, cy, zx, zy, result, n, max_iter, de, deriv0, deriv_add, orbit);
+    else
+        return mj_calc_lanes_sse2<P, DE>(cx, cy, zx, zy, result, n, max_iter, de, deriv0, deriv_add, orbit);
+}
+
+/*
+ * The lanes of 4 and 8 doubles only run in functions built with fma, their
+ * exact products take the error term from fms() instead of Dekker's split.
+ * Both are exact, so the bits are the same.
+ */
+template<>
+inline void mj_dd_two_prod(MJ_Lanes<4>::vdouble &p, MJ_Lanes<4>::vdouble &e,
+                           MJ_Lanes<4>::vdouble a, MJ_Lanes<4>::vdouble b)
+{
+    p = a * b;
+    e = MJ_Lanes<4>::fms(a, b, p);
+}
+
+template<>
+inline void mj_dd_two_prod(MJ_Lanes<8>::vdouble &p, MJ_Lanes<8>::vdouble &e,
+                           MJ_Lanes<8>::vdouble a, MJ_Lanes<8>::vdouble b)
+{
+    p = a * b;
+    e = MJ_Lanes<8>::fms(a, b, p);
+}
+
+/* LANES MJ_DD values, the hi and the lo halves in one vector each */
+template<int LANES>
+struct MJ_LanesDD {
+    typedef MJ_DD scalar;
+    typedef typename MJ_Lanes<LANES>::vdouble vdouble;
+    typedef typename MJ_Lanes<LANES>::vmask vmask;
+    static const int lanes = LANES;
+    /* one point in lanes is still faster than a scalar MJ_DD */
+    static const int min_active = 1;
+
+    vdouble hi, lo;
+
+    static inline MJ_LanesDD set1(const MJ_DD &v)
+    {
+        MJ_LanesDD r;
+        r.hi = (vdouble){} + v.m_hi;
+        r.lo = (vdouble){} + v.m_lo;
+        return r;
+    }
+
+    static inline MJ_LanesDD load(const MJ_DD *p)
+    {
+        MJ_LanesDD r;
+        for (int l = 0; l < LANES; l++)
+            r.hi[l] = p[l].m_hi, r.lo[l] = p[l].m_lo;
+        return r;
+    }
+
+    static inline void store(MJ_DD *p, const MJ_LanesDD &v)
+    {
+        for (int l = 0; l < LANES; l++)
+            p[l].m_hi = v.hi[l], p[l].m_lo = v.lo[l];
+    }
+
+    /*
+     * Sign bit set on the lanes where a >= b as MJ_DD compares them. Vector
+     * comparisons end up split into scalar ones, the signs of differences
+     * do not. Adding 0.0 turns a difference of -0.0 into +0.0.
+     */
+    static inline vmask ge(const MJ_LanesDD &a, const MJ_LanesDD &b)
+    {
+        vmask hi_gt = (vmask)((b.hi - a.hi) + 0.0);
+        vmask hi_diff = (vmask)((a.hi - b.hi) + 0.0);
+        vmask lo_ge = ~(vmask)((a.lo - b.lo) + 0.0);
+        return hi_gt | (~(hi_diff | -hi_diff) & lo_ge);
+    }
+};
+
+template<int LANES>
+inline MJ_LanesDD<LANES> operator +(const MJ_LanesDD<LANES> &a, const MJ_LanesDD<LANES> &b)
+{
+    MJ_LanesDD<LANES> r;
+    mj_dd_add(r.hi, r.lo, a.hi, a.lo, b.hi, b.lo);
+    return r;
+}
+
+template<int LANES>
+inline MJ_LanesDD<LANES> operator -(const MJ_LanesDD<LANES> &a)
+{
+    MJ_LanesDD<LANES> r;
+    r.hi = -a.hi, r.lo = -a.lo;
+    return r;
+}
+
+template<int LANES>
+inline MJ_LanesDD<LANES> operator -(const MJ_LanesDD<LANES> &a, const MJ_LanesDD<LANES> &b)
+{
+    MJ_LanesDD<LANES> r;
+    mj_dd_add(r.hi, r.lo, a.hi, a.lo, -b.hi, -b.lo);
+    return r;
+}
+
+template<int LANES>
+inline MJ_LanesDD<LANES> operator *(const MJ_LanesDD<LANES> &a, const MJ_LanesDD<LANES> &b)
+{
+    MJ_LanesDD<LANES> r;
+    mj_dd_mul(r.hi, r.lo, a.hi, a.lo, b.hi, b.lo);
+    return r;
+}
+
+template<int LANES>
+inline MJ_LanesDD<LANES> mj_sqr(const MJ_LanesDD<LANES> &a)
+{
+    MJ_LanesDD<LANES> r;
+    mj_dd_sqr(r.hi, r.lo, a.hi, a.lo);
+    return r;
+}
+
+/*
+ * LANES MJ_F128 values, the low and the high words in one vector each. The
+ * carries come from the sign bits of bitwise expressions, not comparisons.
+ * Products are summed from 28-bit digits, each column of at most 5 digit
+ * products stays below 2^59. Adding 2^119 before taking bits 120 to 247
+ * rounds like MJ_F128::s_mul_or_sqr, whose sign corrections only touch
+ * bits 128 and up, so they are the operands shifted left by 8 bits.
+ */
+template<int LANES>
+struct MJ_LanesF128 {
+    typedef MJ_F128 scalar;
+    typedef typename MJ_Lanes<LANES>::vuint vuint;
+    typedef typename MJ_Lanes<LANES>::vmask vmask;
+    static const int lanes = LANES;
+    /* lanes only pay off full, the last points go to the mulq code */
+    static const int min_active = LANES;
+
+    vuint lo, hi;
+
+    static inline __attribute__((always_inline)) MJ_LanesF128 set1(const MJ_F128 &v)
+    {
+        MJ_LanesF128 r;
+        r.lo = (vuint){} + v.m_value[0];
+        r.hi = (vuint){} + v.m_value[1];
+        return r;
+    }
+
+    static inline __attribute__((always_inline)) MJ_LanesF128 load(const MJ_F128 *p)
+    {
+        MJ_LanesF128 r;
+        for (int l = 0; l < LANES; l++)
+            r.lo[l] = p[l].m_value[0], r.hi[l] = p[l].m_value[1];
+        return r;
+    }
+
+    static inline __attribute__((always_inline)) void store(MJ_F128 *p, const MJ_LanesF128 &v)
+    {
+        for (int l = 0; l < LANES; l++)
+            p[l].m_value[0] = v.lo[l], p[l].m_value[1] = v.hi[l];
+    }
+
+    /* carry out of a + b and borrow out of a - b, given the sum or difference d, in the sign bit */
+    static inline __attribute__((always_inline)) vuint s_carry(vuint a, vuint b, vuint d)
+    {
+        return (a & b) | ((a | b) & ~d);
+    }
+
+    static inline __attribute__((always_inline)) vuint s_borrow(vuint a, vuint b, vuint d)
+    {
+        return (~a & b) | (~(a ^ b) & d);
+    }
+
+    static inline __attribute__((always_inline)) MJ_LanesF128 s_sub(const MJ_LanesF128 &a, const MJ_LanesF128 &b)
+    {
+        MJ_LanesF128 r;
+        r.lo = a.lo - b.lo;
+        r.hi = a.hi - b.hi - (s_borrow(a.lo, b.lo, r.lo) >> 63);
+        return r;
+    }
+
+    /* sign bit set on the lanes where a >= b: no borrow out of a - b with flipped sign bits */
+    static inline __attribute__((always_inline)) vmask ge(const MJ_LanesF128 &a, const MJ_LanesF128 &b)
+    {
+        const vuint sign = (vuint){} + (uint64_t(1) << 63);
+        vuint ah = a.hi ^ sign, bh = b.hi ^ sign;
+        vuint d = ah - bh - (s_borrow(a.lo, b.lo, a.lo - b.lo) >> 63);
+        return (vmask) ~s_borrow(ah, bh, d);
+    }
+
+    /* the 28-bit digits of the unsigned value, the last one has the top 16 bits */
+    static inline __attribute__((always_inline)) void s_digits(vuint *d, const MJ_LanesF128 &a)
+    {
+        const vuint mask = (vuint){} + ((uint64_t(1) << 28) - 1);
+        d[0] = a.lo & mask;
+        d[1] = (a.lo >> 28) & mask;
+        d[2] = ((a.lo >> 56) | (a.hi << 8)) & mask;
+        d[3] = (a.hi >> 20) & mask;
+        d[4] = a.hi >> 48;
+    }
+
+    /* bits 120 to 247 of the unsigned product of the digits, rounded */
+    static inline __attribute__((always_inline)) MJ_LanesF128 s_product(const vuint *ad, const vuint *bd, int is_sqr)
+    {
+        const vuint mask = (vuint){} + ((uint64_t(1) << 28) - 1);
+        vuint col[9];
+
+        if (is_sqr) {
+            vuint ad2[5];
+#pragma GCC unroll 9
+            for (int i = 0; i < 5; i++)
+                ad2[i] = ad[i] + ad[i];
+#pragma GCC unroll 9
+            for (int c = 0; c < 9; c++) {
+                col[c] = (vuint){};
+#pragma GCC unroll 9
+                for (int i = (c < 5) ? 0 : c - 4; 2 * i < c; i++)
+                    col[c] += MJ_Lanes<LANES>::mul32(ad2[i], ad[c - i]);
+                if (c % 2 == 0)
+                    col[c] += MJ_Lanes<LANES>::mul32(ad[c / 2], ad[c / 2]);
+            }
+        } else {
+#pragma GCC unroll 9
+            for (int c = 0; c < 9; c++) {
+                col[c] = (vuint){};
+#pragma GCC unroll 9
+                for (int i = (c < 5) ? 0 : c - 4; i <= c && i < 5; i++)
+                    col[c] += MJ_Lanes<LANES>::mul32(ad[i], bd[c - i]);
+            }
+        }
+
+        col[4] += uint64_t(1) << 7;
+        vuint carry = (vuint){};
+#pragma GCC unroll 9
+        for (int c = 0; c < 9; c++) {
+            col[c] += carry;
+            carry = col[c] >> 28;
+            col[c] &= mask;
+        }
+
+        MJ_LanesF128 r;
+        r.lo = (col[4] >> 8) | (col[5] << 20) | (col[6] << 48);
+        r.hi = (col[6] >> 16) | (col[7] << 12) | (col[8] << 40);
+        return r;
+    }
+
+    /* a << shift on the lanes where the sign bit of mask is set */
+    static inline __attribute__((always_inline)) MJ_LanesF128 s_shl_masked(const MJ_LanesF128 &a, int shift, vuint mask)
+    {
+        mask = (vuint){} - (mask >> 63);
+        MJ_LanesF128 r;
+        r.lo = (a.lo << shift) & mask;
+        r.hi = ((a.hi << shift) | (a.lo >> (64 - shift))) & mask;
+        return r;
+    }
+
+    static inline __attribute__((always_inline)) MJ_LanesF128 s_mul(const MJ_LanesF128 &a, const MJ_LanesF128 &b,
+                                                                     const vuint *ad, const vuint *bd)
+    {
+        MJ_LanesF128 r = s_product(ad, bd, 0);
+        return s_sub(s_sub(r, s_shl_masked(a, 8, b.hi)), s_shl_masked(b, 8, a.hi));
+    }
+
+    /* both corrections of a * a at once */
+    static inline __attribute__((always_inline)) MJ_LanesF128 s_sqr(const MJ_LanesF128 &a, const vuint *ad)
+    {
+        return s_sub(s_product(ad, ad, 1), s_shl_masked(a, 9, a.hi));
+    }
+};
+
+template<int LANES>
+inline __attribute__((always_inline)) MJ_LanesF128<LANES> operator +(const MJ_LanesF128<LANES> &a, const MJ_LanesF128<LANES> &b)
+{
+    MJ_LanesF128<LANES> r;
+    r.lo = a.lo + b.lo;
+    r.hi = a.hi + b.hi + (MJ_LanesF128<LANES>::s_carry(a.lo, b.lo, r.lo) >> 63);
+    return r;
+}
+
+template<int LANES>
+inline __attribute__((always_inline)) MJ_LanesF128<LANES> operator -(const MJ_LanesF128<LANES> &a)
+{
+    return MJ_LanesF128<LANES>::s_sub(MJ_LanesF128<LANES>::set1(MJ_F128(0)), a);
+}
+
+template<int LANES>
+inline __attribute__((always_inline)) MJ_LanesF128<LANES> operator -(const MJ_LanesF128<LANES> &a, const MJ_LanesF128<LANES> &b)
+{
+    return MJ_LanesF128<LANES>::s_sub(a, b);
+}
+
+template<int LANES>
+inline __attribute__((always_inline)) MJ_LanesF128<LANES> operator *(const MJ_LanesF128<LANES> &a, const MJ_LanesF128<LANES> &b)
+{
+    typename MJ_LanesF128<LANES>::vuint ad[5], bd[5];
+    MJ_LanesF128<LANES>::s_digits(ad, a);
+    MJ_LanesF128<LANES>::s_digits(bd, b);
+    return MJ_LanesF128<LANES>::s_mul(a, b, ad, bd);
+}
+
+template<int LANES>
+inline __attribute__((always_inline)) MJ_LanesF128<LANES> mj_sqr(const MJ_LanesF128<LANES> &a)
+{
+    typename MJ_LanesF128<LANES>::vuint ad[5];
+    MJ_LanesF128<LANES>::s_digits(ad, a);
+    return MJ_LanesF128<LANES>::s_sqr(a, ad);
+}
+
+/*
+ * Same steps as the generic one, sharing the digits of zx and zy. It has
+ * to be inlined, out of line mul32 could not be inlined for AVX targets.
+ */
+template<int LANES>
+inline __attribute__((always_inline))
+void mj_complex_sqr_with_norm(MJ_LanesF128<LANES> &sx, MJ_LanesF128<LANES> &sy, MJ_LanesF128<LANES> &fsq,
+                              const MJ_LanesF128<LANES> &zx, const MJ_LanesF128<LANES> &zy)
+{
+    typedef MJ_LanesF128<LANES> V;
+    typename V::vuint xd[5], yd[5];
+    V::s_digits(xd, zx);
+    V::s_digits(yd, zy);
+    V zx2 = V::s_sqr(zx, xd);
+    V zy2 = V::s_sqr(zy, yd);
+    sx = zx2 - zy2;
+    sy = V::s_mul(zx, zy, xd, yd);
+    sy = sy + sy;
+    fsq = zx2 + zy2;
+}
+
+template<int LANES>
+inline __attribute__((always_inline))
+void mj_complex_mul(MJ_LanesF128<LANES> &sx, MJ_LanesF128<LANES> &sy,
+                    const MJ_LanesF128<LANES> &ax, const MJ_LanesF128<LANES> &ay,
+                    const MJ_LanesF128<LANES> &bx, const MJ_LanesF128<LANES> &by)
+{
+    sx = ax * bx - ay * by;
+    sy = ax * by + bx * ay;
+}
+
+/*
+ * Lane-parallel mj_calc<T> for a type T of several words, V holds V::lanes
+ * values of T and provides its arithmetic, set1(), load(), store() and a
+ * ge() mask with the outcome of T's operator >=. Only the first stage runs
+ * in lanes: a point that reaches fsq_max continues in double by the same
+ * mj_calc_escape as the scalar version, so the results are bit-identical.
+ * Masks are in the sign bits, as in mj_calc_lanes_impl.
+ * All lanes step together for as many iterations as no lane needs to save
+ * its periodicity point or reaches max_iter, escapes and periodic points
+ * leave the loop early. Lanes run while at least V::min_active of them have
+ * a point, the others wait on 0 away from their periodicity point, and the
+ * last points are resumed by mj_calc_resume. Returns the number of periodic
+ * points. orbit is used as by mj_calc_lanes_impl.
+ */
+template<int P, typename V>
+static inline __attribute__((always_inline))
+long mj_calc_lanes_multi_impl(const typename V::scalar *cx, const typename V::scalar *cy,
+                              const typename V::scalar *zx, const typename V::scalar *zy,
+                              double *result, int n, int max_iter, MJ_Orbit<typename V::scalar> *orbit)
+{
+    typedef typename V::scalar T;
+    typedef MJ_Lanes<V::lanes> L;
+    typedef typename L::vmask vmask;
+    const int LANES = V::lanes;
+    const T fsq_max = 1.001 * pow(2.0, 2.0 / (P - 1));
+    const T tol = mj_period_tol(T(0)), neg_tol = -tol;
+    const V lfsq_max = V::set1(fsq_max), ltol = V::set1(tol), lneg_tol = V::set1(neg_tol);
+    T acx[LANES], acy[LANES], azx[LANES], azy[LANES], apx[LANES], apy[LANES];
+    int idx[LANES], ak[LANES], anext[LANES], window[LANES];
+    int next = 0, active = 0;
+    long nb_periodic = 0;
+
+    for (int l = 0; l < LANES; l++) {
+        if (n < V::min_active || next >= n) {
+            idx[l] = -1;
+            acx[l] = acy[l] = azx[l] = azy[l] = 0, apx[l] = apy[l] = 1;
+            ak[l] = 0, anext[l] = max_iter, window[l] = 1;
+            continue;
+        }
+        idx[l] = next++, active++;
+        acx[l] = cx[idx[l]], acy[l] = cy[idx[l]];
+        azx[l] = apx[l] = zx[idx[l]], azy[l] = apy[l] = zy[idx[l]];
+        ak[l] = anext[l] = 0, window[l] = 1;
+        if (orbit && orbit[idx[l]].k > 0) {
+            const MJ_Orbit<T>& o = orbit[idx[l]];
+            azx[l] = o.zx, azy[l] = o.zy, apx[l] = o.px, apy[l] = o.py;
+            ak[l] = o.k, anext[l] = o.next, window[l] = o.window;
+        }
+    }
+
+    while (active && active >= V::min_active) {
+        V lcx = V::load(acx), lcy = V::load(acy), lzx = V::load(azx), lzy = V::load(azy);
+        V lpx = V::load(apx), lpy = V::load(apy);
+        vmask escaped = (vmask){}, periodic = (vmask){};
+
+        /* iterations until the first lane reaches its saving point or max_iter - 1 */
+        int steps = max_iter;
+        for (int l = 0; l < LANES; l++) {
+            int limit = (anext[l] < max_iter - 1) ? anext[l] : max_iter - 1;
+            if (limit - ak[l] + 1 < steps)
+                steps = limit - ak[l] + 1;
+        }
+
+        int s;
+        for (s = 0; s < steps; ) {
+            V sx, sy, fsq;
+            mj_complex_pow<P>(sx, sy, lzx, lzy, &fsq);
+            escaped = V::ge(fsq, lfsq_max);
+            if (L::reduce_and(~escaped) >= 0)
+                break;
+
+            lzx = sx + lcx;
+            lzy = sy + lcy;
+            s++;
+
+            V dx = lzx - lpx, dy = lzy - lpy;
+            periodic = V::ge(dx, lneg_tol) & V::ge(ltol, dx) & V::ge(dy, lneg_tol) & V::ge(ltol, dy);
+            if (L::reduce_and(~periodic) >= 0)
+                break;
+        }
+
+        V::store(azx, lzx);
+        V::store(azy, lzy);
+
+        for (int l = 0; l < LANES; l++) {
+            if (idx[l] < 0)
+                continue;
+
+            /* s iterations done, ak[l] is the next one */
+            ak[l] += s;
+            double res = MJ_INFINITY;
+            if (escaped[l] < 0) {
+                res = mj_calc_escape<P>(acx[l], acy[l], azx[l], azy[l], ak[l], max_iter);
+                if (orbit)
+                    orbit[idx[l]].k = MJ_ORBIT_DONE;
+            } else if (periodic[l] < 0) {
+                nb_periodic++;
+                if (orbit)
+                    orbit[idx[l]].k = MJ_ORBIT_DONE;
+            } else {
+                if (ak[l] - 1 == anext[l]) {
+                    apx[l] = azx[l], apy[l] = azy[l];
+                    window[l] *= 2;
+                    anext[l] = ak[l] - 1 + window[l];
+                }
+                if (ak[l] < max_iter)
+                    continue;
+                if (orbit)
+                    mj_orbit_save(orbit + idx[l], azx[l], azy[l], apx[l], apy[l], ak[l], anext[l], window[l]);
+            }
+
+            result[idx[l]] = res;
+            if (next < n) {
+                idx[l] = next++;
+                acx[l] = cx[idx[l]], acy[l] = cy[idx[l]];
+                azx[l] = apx[l] = zx[idx[l]], azy[l] = apy[l] = zy[idx[l]];
+                ak[l] = anext[l] = 0, window[l] = 1;
+                if (orbit && orbit[idx[l]].k > 0) {
+                    const MJ_Orbit<T>& o = orbit[idx[l]];
+                    azx[l] = o.zx, azy[l] = o.zy, apx[l] = o.px, apy[l] = o.py;
+                    ak[l] = o.k, anext[l] = o.next, window[l] = o.window;
+                }
+            } else {
+                idx[l] = -1, active--;
+                acx[l] = acy[l] = azx[l] = azy[l] = 0, apx[l] = apy[l] = 1;
+                ak[l] = 0, anext[l] = max_iter, window[l] = 1;
+            }
+        }
+    }
+
+    for (int l = 0; l < LANES; l++)
+        if (idx[l] >= 0)
+            result[idx[l]] = mj_calc_resume<P>(acx[l], acy[l], azx[l], azy[l], apx[l], apy[l],
+                                               ak[l], anext[l], window[l], max_iter, &nb_periodic,
+                                               orbit ? orbit + idx[l] : NULL);
+    for ( ; next < n; next++)
+        result[next] = mj_calc<P>(cx[next], cy[next], zx[next], zy[next], max_iter, 0, &nb_periodic,
+                                  orbit ? orbit + next : NULL);
+
+    return nb_periodic;
+}
+
+template<int P, template<int> class V>
+__attribute__((target("avx512f,avx512dq,fma"), flatten))
+static long mj_calc_lanes_multi_avx512(const typename V<8>::scalar *cx, const typename V<8>::scalar *cy,
+                                       const typename V<8>::scalar *zx, const typename V<8>::scalar *zy,
+                                       double *result, int n, int max_iter, MJ_Orbit<typename V<8>::scalar> *orbit)
+{
+    return mj_calc_lanes_multi_impl<P, V<8>>(cx, cy, zx, zy, result, n, max_iter, orbit);
+}
+
+template<int P, template<int> class V>
+__attribute__((target("avx2,fma"), flatten))
+static long mj_calc_lanes_multi_avx2(const typename V<4>::scalar *cx, const typename V<4>::scalar *cy,
+                                     const typename V<4>::scalar *zx, const typename V<4>::scalar *zy,
+                                     double *result, int n, int max_iter, MJ_Orbit<typename V<4>::scalar> *orbit)
+{
+    return mj_calc_lanes_multi_impl<P, V<4>>(cx, cy, zx, zy, result, n, max_iter, orbit);
+}
+
+template<int P, template<int> class V>
+__attribute__((flatten))
+static long mj_calc_lanes_multi_sse2(const typename V<2>::scalar *cx, const typename V<2>::scalar *cy,
+                                     const typename V<2>::scalar *zx, const typename V<2>::scalar *zy,
+                                     double *result, int n, int max_iter, MJ_Orbit<typename V<2>::scalar> *orbit)
+{
+    return mj_calc_lanes_multi_impl<P, V<2>>(cx, cy, zx, zy, result, n, max_iter, orbit);
+}
+
+/*
+ * With vectors narrower than min_width bits the points go to mj_calc
+ * instead. The wider vectors are built with fma as well.
+ */
+template<int P, template<int> class V>
+inline long mj_calc_lanes_multi(const typename V<2>::scalar *cx, const typename V<2>::scalar *cy,
+                                const typename V<2>::scalar *zx, const typename V<2>::scalar *zy,
+                                double *result, int n, int max_iter, int min_width,
+                                MJ_Orbit<typename V<2>::scalar> *orbit)
+{
+    static const int fma = __builtin_cpu_supports("fma");
+    static const int cpu = fma && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") ? 512 :
+                           fma && __builtin_cpu_supports("avx2") ? 256 : 128;
+    if (cpu < min_width) {
+        long nb_periodic = 0;
+        for (int k = 0; k < n; k++)
+            result[k] = mj_calc<P>(cx[k], cy[k], zx[k], zy[k], max_iter, 0, &nb_periodic, orbit ? orbit + k : NULL);
+        return nb_periodic;
+    } else if (cpu == 512)
+        return mj_calc_lanes_multi_avx512<P, V>(cx, cy, zx, zy, result, n, max_iter, orbit);
+    else if (cpu == 256)
+        return mj_calc_lanes_multi_avx2<P, V>(cx, cy, zx, zy, result, n, max_iter, orbit);
+    else
+        return mj_calc_lanes_multi_sse2<P, V>(cx, cy, zx, zy, result, n, max_iter, orbit);
+}
+
+/* the distance estimate is not carried in lanes, those points go one by one */
+template<int P, template<int> class V>
+inline void mj_calc_points_lanes(const MJ_CalcFrame<P, typename V<2>::scalar>& frame,
+                                 const typename V<2>::scalar *cx, const typename V<2>::scalar *cy,
+                                 const typename V<2>::scalar *zx, const typename V<2>::scalar *zy,
+                                 double *result, int n, double *de, MJ_Orbit<typename V<2>::scalar> *orbit,
+                                 int min_width = 128)
+{
+    if (de) {
+        for (int k = 0; k < n; k++)
+            result[k] = frame.calc(cx[k], cy[k], zx[k], zy[k], de + k, orbit ? orbit + k : NULL);
+        return;
+    }
+    mj_count(&frame.nb_periodic, mj_calc_lanes_multi<P, V>(cx, cy, zx, zy, result, n, frame.max_iter, min_width,
+                                                           orbit));
+}
+
+template<int P>
+inline void mj_calc_points(const MJ_CalcFrame<P, MJ_DD>& frame, const MJ_DD *cx, const MJ_DD *cy,
+                           const MJ_DD *zx, const MJ_DD *zy, double *result, int n, double *de,
+                           MJ_Orbit<MJ_DD> *orbit)
+{
+    mj_calc_points_lanes<P, MJ_LanesDD>(frame, cx, cy, zx, zy, result, n, de, orbit);
+}
+
+/*
+ * Four lanes of 28-bit digit products do not keep up with the mulq code of
+ * MJ_F128, only eight of them are faster.
+ */
+template<int P>
+inline void mj_calc_points(const MJ_CalcFrame<P, MJ_F128>& frame, const MJ_F128 *cx, const MJ_F128 *cy,
+                           const MJ_F128 *zx, const MJ_F128 *zy, double *result, int n, double *de,
+                           MJ_Orbit<MJ_F128> *orbit)
+{
+    mj_calc_points_lanes<P, MJ_LanesF128>(frame, cx, cy, zx, zy, result, n, de, orbit, 512);
+}
+
+/* with double both branches of mj_calc_batch compute the same thing */
+template<int P>
+inline void mj_calc_batch(const MJ_CalcFrame<P, double>& frame, const double *zx, const double *zy,
+                          double *result, int n, double *de = NULL, MJ_Orbit<double> *orbit = NULL)
+{
+    const int BUF_SIZE = 512;
+    double bcx[BUF_SIZE], bcy[BUF_SIZE], bzx[BUF_SIZE], bzy[BUF_SIZE], bres[BUF_SIZE], bde[BUF_SIZE];
+    MJ_Orbit<double> *borbit = orbit ? new MJ_Orbit<double>[BUF_SIZE] : NULL;
+    int bidx[BUF_SIZE];
+    _Complex double tmp;
+
+    for (int off = 0; off < n; off += BUF_SIZE) {
+        int len = (n - off < BUF_SIZE) ? n - off : BUF_SIZE;
+        const double *_zx = zx + off, *_zy = zy + off;
+
+        switch (frame.julia_mode) {
+        case MJ_JULIA_MODE_MANDELBROT:
+            for (int k = 0; k < len; k++) {
+                bcx[k] = frame.cx + _zx[k], bcy[k] = frame.cy + _zy[k];
+                bzx[k] = bzy[k] = 0;
+            }
+            break;
+        case MJ_JULIA_MODE_JULIA_AT_0:
+            for (int k = 0; k < len; k++) {
+                bcx[k] = frame.cx, bcy[k] = frame.cy;
+                bzx[k] = _zx[k], bzy[k] = _zy[k];
+            }
+            break;
+        case MJ_JULIA_MODE_MANDELBROT_JULIA:
+            for (int k = 0; k < len; k++) {
+                tmp = cpow(_zx[k] + I * _zy[k], P);
+                bcx[k] = frame.cx + creal(tmp), bcy[k] = frame.cy + cimag(tmp);
+                bzx[k] = bzy[k] = 0;
+            }
+            break;
+        case MJ_JULIA_MODE_JULIA_AT_C:
+            for (int k = 0; k < len; k++) {
+                tmp = cpow(_zx[k] + I * _zy[k], 1.0 / P);
+                bcx[k] = frame.cx, bcy[k] = frame.cy;
+                bzx[k] = creal(tmp), bzy[k] = cimag(tmp);
+            }
+            break;
+        default:
+            throw "invalid julia mode";
+        }
+
+        /* leave out the interior points */
+        int m = 0;
+        for (int k = 0; k < len; k++) {
+            if (frame.is_interior(bcx[k], bcy[k])) {
+                result[off + k] = MJ_INFINITY;
+                if (de)
+                    de[off + k] = 0.0;
+                if (orbit)
+                    orbit[off + k].k = MJ_ORBIT_DONE;
+                continue;
+            }
+            bidx[m] = k;
+            bcx[m] = bcx[k], bcy[m] = bcy[k];
+            bzx[m] = bzx[k], bzy[m] = bzy[k];
+            if (orbit)
+                borbit[m] = orbit[off + k];
+            m++;
+        }
+
+        if (!de) {
+            mj_count(&frame.nb_periodic, mj_calc_lanes<P, false>(bcx, bcy, bzx, bzy, bres, m, frame.max_iter,
+                                                                 NULL, 0.0, 0.0, borbit));
+            for (int k = 0; k < m; k++) {
+                result[off + bidx[k]] = bres[k];
+                if (orbit)
+                    orbit[off + bidx[k]] = borbit[k];
+            }
+            continue;
+        }
+
+        mj_count(&frame.nb_periodic, mj_calc_lanes<P, true>(bcx, bcy, bzx, bzy, bres, m, frame.max_iter,
+                                                            bde, frame.deriv0, frame.deriv_add, borbit));
+        for (int k = 0; k < m; k++) {
+            int i = off + bidx[k];
+            result[i] = bres[k];
+            de[i] = (bde[k] > 0.0) ? bde[k] * mj_distance_scale<P>(frame.julia_mode, zx[i], zy[i]) : 0.0;
+            if (orbit)
+                orbit[i] = borbit[k];
+        }
+    }
+    delete[] borbit;
+}
+
+#endif
@@ -29,10 +29,19 @@
 
 #define MJ_INFINITY (65536.0*65536.0*65536.0)
 
-#ifndef MJ_MANDELBROT_POWER
-#define MJ_MANDELBROT_POWER 2
+/* range of powers instantiated for runtime selection */
+#define MJ_MIN_POWER 2
+#ifndef MJ_MAX_POWER
+#define MJ_MAX_POWER 16
 #endif
 
+/* the counters of a frame are shared by the render threads */
+inline void mj_count(long *counter, long n = 1)
+{
+    if (n)
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
 template<typename T>
 inline T mj_sqr(T v)
 {
@@ -46,111 +55,615 @@ inline void mj_complex_mul(T &sx, T &sy, const T &ax, const T &ay, const T &bx,
     sy = ax * by + bx * ay;
 }
 
+/*
+ * z^2 and |z|^2 in one step. Types with a cheaper way to get the three of
+ * them overload it, mj_complex_pow2 picks that up by overload resolution.
+ */
 template<typename T>
-inline void mj_complex_pow2(T &sx, T &sy, const T &zx, const T &zy, T *side_fsq = NULL)
+inline void mj_complex_sqr_with_norm(T &sx, T &sy, T &fsq, const T &zx, const T &zy)
 {
     T zx2 = mj_sqr(zx);
     T zy2 = mj_sqr(zy);
     sx = zx2 - zy2;
     sy = zx * zy;
     sy = sy + sy;
+    fsq = zx2 + zy2;
+}
+
+template<typename T>
+inline __attribute__((always_inline)) void mj_complex_pow2(T &sx, T &sy, const T &zx, const T &zy, T *side_fsq = NULL)
+{
+    T fsq;
+    mj_complex_sqr_with_norm(sx, sy, fsq, zx, zy);
     if (side_fsq)
-        *side_fsq = zx2 + zy2;
+        *side_fsq = fsq;
+}
+
+/*
+ * z^P by an addition chain built at compile time: z^P = (z^(P/2))^2 for even
+ * P and z^(P-1) * z for odd P. side_fsq gets |z|^2 from the first squaring.
+ * It and mj_complex_pow2 are always inlined, so lane types whose operations
+ * can only be inlined into functions built for their instruction set work.
+ */
+template<int P, typename T>
+inline __attribute__((always_inline)) void mj_complex_pow(T &sx, T &sy, const T &zx, const T &zy, T *side_fsq = NULL)
+{
+    static_assert(P >= 1, "power must be at least 1");
+    if constexpr (P == 1) {
+        sx = zx, sy = zy;
+        if (side_fsq)
+            *side_fsq = zx * zx + zy * zy;
+    } else if constexpr (P == 2) {
+        mj_complex_pow2(sx, sy, zx, zy, side_fsq);
+    } else if constexpr (P % 2) {
+        T tx, ty;
+        mj_complex_pow<P - 1>(tx, ty, zx, zy, side_fsq);
+        mj_complex_mul(sx, sy, tx, ty, zx, zy);
+    } else {
+        T tx, ty;
+        mj_complex_pow<P / 2>(tx, ty, zx, zy, side_fsq);
+        mj_complex_pow2(sx, sy, tx, ty);
+    }
+}
+
+/* second stage of mj_calc, z reached fsq_max at iteration k, continue in double */
+template<int P>
+inline double mj_calc_escape(double cx, double cy, double zx, double zy, int k, int max_iter)
+{
+    for (k-- ; k < max_iter + 1000; k++) {
+        double fsq, sx, sy;
+        mj_complex_pow<P>(sx, sy, zx, zy, &fsq);
+        zx = sx + cx;
+        zy = sy + cy;
+        if (fsq >= MJ_INFINITY)
+            return k - log2(log2(fsq)) / log2(P);
+    }
+
+    return MJ_INFINITY;
 }
 
-/* C-style template */
-#define MJ_DEF_COMPLEX_POW(n, m, odd)                                           \
-template<typename T>                                                            \
-inline void mj_complex_pow ## n (T &sx, T &sy, const T &zx, const T &zy,        \
-                                 T *side_fsq = NULL)                            \
-{                                                                               \
-    T tx, ty;                                                                   \
-    mj_complex_pow ## m (tx, ty, zx, zy, side_fsq);                             \
-    if (odd) mj_complex_mul(sx, sy, tx, ty, zx, zy);                            \
-    else mj_complex_pow2(sx, sy, tx, ty);                                       \
+/*
+ * Orbit points closer than this in both coordinates are treated as the
+ * same point by the periodicity detection of mj_calc, a few bits above the
+ * resolution of T. Types with their own resolution overload it.
+ */
+template<typename T>
+inline double mj_period_tol(T dummy)
+{
+    return 0x1.0p-48;
 }
 
-MJ_DEF_COMPLEX_POW(3, 2, 1)
-MJ_DEF_COMPLEX_POW(4, 2, 0)
-MJ_DEF_COMPLEX_POW(5, 4, 1)
-MJ_DEF_COMPLEX_POW(6, 3, 0)
-MJ_DEF_COMPLEX_POW(7, 6, 1)
-MJ_DEF_COMPLEX_POW(8, 4, 0)
-MJ_DEF_COMPLEX_POW(9, 8, 1)
+inline double mj_period_tol(long double dummy)
+{
+    return 0x1.0p-58;
+}
 
-#define MJ_TEMP_JOIN(a, b) a ## b
-#define MJ_COMPLEX_POW(sx, sy, zx, zy, fsq, p) \
-    MJ_TEMP_JOIN(mj_complex_pow, p) (sx, sy, zx, zy, fsq)
+/*
+ * The time of a point tried in double by -E, checked by mj_calc_checked,
+ * relative to computing it in T, measured on views where nearly every point
+ * is vouched. Types with their own cost overload it.
+ */
+template<typename T>
+inline double mj_double_cost(T dummy)
+{
+    return 0.5;
+}
+
+inline double mj_double_cost(long double dummy)
+{
+    return 0.8;
+}
+
+/*
+ * Where the orbit of a point stands when it ran out of iterations, so that a
+ * render with a larger max_iter can continue it: z at iteration k, the saved
+ * point p of the periodicity detection with its next iteration and window,
+ * and the derivative of mj_calc_de. k is 0 for a point that has to start
+ * over, MJ_ORBIT_DONE for one whose result does not depend on max_iter.
+ */
+#define MJ_ORBIT_DONE (-1)
+
+template<typename T>
+struct MJ_Orbit {
+    T       zx, zy, px, py;
+    double  drx, dry;
+    int     k, next, window;
+};
 
 template<typename T>
-double mj_calc(T cx, T cy, T zx, T zy, int max_iter)
+inline void mj_orbit_save(MJ_Orbit<T> *orbit, const T& zx, const T& zy, const T& px, const T& py,
+                          int k, int next, int window, double drx = 0.0, double dry = 0.0)
+{
+    orbit->zx = zx, orbit->zy = zy, orbit->px = px, orbit->py = py;
+    orbit->drx = drx, orbit->dry = dry;
+    orbit->k = k, orbit->next = next, orbit->window = window;
+}
+
+/*
+ * Brent's cycle detection: z is compared against a saved point p which is
+ * replaced at doubling intervals, an orbit that comes back to it has reached
+ * an attracting cycle and never escapes. Such points are counted in
+ * *nb_periodic. mj_calc_resume continues at iteration k with p saved for
+ * the iteration next, window iterations after the previous one. If orbit is
+ * not NULL, it gets where the point stopped.
+ */
+template<int P, typename T>
+double mj_calc_resume(T cx, T cy, T zx, T zy, T px, T py, int k, int next, int window,
+                      int max_iter, long *nb_periodic = NULL, MJ_Orbit<T> *orbit = NULL)
 {
     T fsq, sx, sy;
-    static const T fsq_max = 1.001 * pow(2.0, 2.0 / (MJ_MANDELBROT_POWER - 1));
+    static const T fsq_max = 1.001 * pow(2.0, 2.0 / (P - 1));
+    static const T tol = mj_period_tol(T(0)), neg_tol = -tol;
+    T dx, dy;
 
-    for (int k = 0; k < max_iter; k++) {
-        MJ_COMPLEX_POW(sx, sy, zx, zy, &fsq, MJ_MANDELBROT_POWER);
+    if (orbit)
+        orbit->k = MJ_ORBIT_DONE;
 
-        if (fsq >= fsq_max) {
-            double _cx = cx, _cy = cy, _zx = zx, _zy = zy;
-
-            for (k-- ; k < max_iter + 1000; k++) {
-                double _fsq, _sx, _sy;
-                MJ_COMPLEX_POW(_sx, _sy, _zx, _zy, &_fsq, MJ_MANDELBROT_POWER);
-                _zx = _sx + _cx;
-                _zy = _sy + _cy;
-                if (_fsq >= MJ_INFINITY)
-                    return k - log2(log2(_fsq)) / log2(MJ_MANDELBROT_POWER);
-            }
+    for ( ; k < max_iter; k++) {
+        mj_complex_pow<P>(sx, sy, zx, zy, &fsq);
+
+        if (fsq >= fsq_max)
+            return mj_calc_escape<P>(cx, cy, zx, zy, k, max_iter);
 
+        zx = sx + cx;
+        zy = sy + cy;
+
+        dx = zx - px, dy = zy - py;
+        if (dx >= neg_tol && tol >= dx && dy >= neg_tol && tol >= dy) {
+            if (nb_periodic)
+                (*nb_periodic)++;
             return MJ_INFINITY;
         }
 
+        if (k == next) {
+            px = zx, py = zy;
+            window *= 2;
+            next = k + window;
+        }
+    }
+
+    if (orbit)
+        mj_orbit_save(orbit, zx, zy, px, py, k, next, window);
+    return MJ_INFINITY;
+}
+
+/*
+ * z is the value at iteration start, 0 unless earlier iterations were
+ * skipped. An orbit with k > 0 is continued instead.
+ */
+template<int P, typename T>
+inline double mj_calc(T cx, T cy, T zx, T zy, int max_iter, int start = 0, long *nb_periodic = NULL,
+                      MJ_Orbit<T> *orbit = NULL)
+{
+    if (orbit && orbit->k > 0)
+        return mj_calc_resume<P>(cx, cy, orbit->zx, orbit->zy, orbit->px, orbit->py, orbit->k, orbit->next,
+                                 orbit->window, max_iter, nb_periodic, orbit);
+    return mj_calc_resume<P>(cx, cy, zx, zy, zx, zy, start, start, 1, max_iter, nb_periodic, orbit);
+}
+
+/*
+ * Distance estimation: the derivative d of z with respect to the point is
+ * carried along in double, d' = p z^(p-1) d + e, starting from d = 0, e = 1
+ * for c (mandelbrot modes) or d = 1, e = 0 for z0 (julia modes). The
+ * distance of an escaped point to the set is about |z| log|z| / |d|, taken
+ * one iteration after |z|^2 reached MJ_INFINITY. It is 0 for points that do
+ * not escape.
+ */
+template<int P, typename V>
+inline void mj_deriv_step(V &drx, V &dry, const V &zx, const V &zy, double e)
+{
+    V px, py, tx, ty;
+    mj_complex_pow<P - 1>(px, py, zx, zy);
+    mj_complex_mul(tx, ty, px, py, drx, dry);
+    drx = double(P) * tx + e;
+    dry = double(P) * ty;
+}
+
+inline double mj_distance(double zx, double zy, double drx, double dry)
+{
+    double fsq = zx * zx + zy * zy;
+    return 0.5 * log(fsq) * sqrt(fsq) / hypot(drx, dry);
+}
+
+/* the distance estimate in c or z0 scaled to the point offset (zx, zy) it was mapped from */
+template<int P>
+inline double mj_distance_scale(int julia_mode, double zx, double zy)
+{
+    if (julia_mode == MJ_JULIA_MODE_MANDELBROT_JULIA)
+        return 1.0 / (P * pow(hypot(zx, zy), P - 1));
+    if (julia_mode == MJ_JULIA_MODE_JULIA_AT_C)
+        return P * pow(hypot(zx, zy), 1.0 - 1.0 / P);
+    return 1.0;
+}
+
+template<int P>
+inline double mj_calc_escape_de(double cx, double cy, double zx, double zy, double drx, double dry, double e,
+                                int k, int max_iter, double *de)
+{
+    for (k-- ; k < max_iter + 1000; k++) {
+        double fsq, sx, sy;
+        mj_complex_pow<P>(sx, sy, zx, zy, &fsq);
+        mj_deriv_step<P>(drx, dry, zx, zy, e);
         zx = sx + cx;
         zy = sy + cy;
+        if (fsq >= MJ_INFINITY) {
+            *de = mj_distance(zx, zy, drx, dry);
+            return k - log2(log2(fsq)) / log2(P);
+        }
     }
 
+    *de = 0.0;
     return MJ_INFINITY;
 }
 
-template<typename T>
-double mj_calc_select(T cx, T cy, double _zx, double _zy, int max_iter, int julia_mode)
+/* mj_calc that also stores the distance estimate into *de, the z iteration and the orbit are the same */
+template<int P, typename T>
+double mj_calc_de(T cx, T cy, T zx, T zy, double drx, double dry, double e, int max_iter, double *de,
+                  int start = 0, long *nb_periodic = NULL, MJ_Orbit<T> *orbit = NULL)
+{
+    T fsq, sx, sy;
+    static const T fsq_max = 1.001 * pow(2.0, 2.0 / (P - 1));
+    static const T tol = mj_period_tol(T(0)), neg_tol = -tol;
+    T px = zx, py = zy, dx, dy;
+    int next = start, window = 1, k = start;
+
+    if (orbit && orbit->k > 0) {
+        zx = orbit->zx, zy = orbit->zy, px = orbit->px, py = orbit->py;
+        drx = orbit->drx, dry = orbit->dry;
+        k = orbit->k, next = orbit->next, window = orbit->window;
+    }
+    if (orbit)
+        orbit->k = MJ_ORBIT_DONE;
+
+    *de = 0.0;
+    for ( ; k < max_iter; k++) {
+        mj_complex_pow<P>(sx, sy, zx, zy, &fsq);
+
+        if (fsq >= fsq_max)
+            return mj_calc_escape_de<P>(cx, cy, zx, zy, drx, dry, e, k, max_iter, de);
+
+        mj_deriv_step<P>(drx, dry, double(zx), double(zy), e);
+        zx = sx + cx;
+        zy = sy + cy;
+
+        dx = zx - px, dy = zy - py;
+        if (dx >= neg_tol && tol >= dx && dy >= neg_tol && tol >= dy) {
+            if (nb_periodic)
+                (*nb_periodic)++;
+            return MJ_INFINITY;
+        }
+
+        if (k == next) {
+            px = zx, py = zy;
+            window *= 2;
+            next = k + window;
+        }
+    }
+
+    if (orbit)
+        mj_orbit_save(orbit, zx, zy, px, py, k, next, window, drx, dry);
+    return MJ_INFINITY;
+}
+
+/*
+ * mj_calc in double that also estimates how far z is from the orbit of T:
+ * an error dc in c moves z by about |dz/dc| dc, and the rounding of each
+ * step adds about as much as a few ulp more of c would. Returns false, and
+ * gives up, once the estimate exceeds MJ_CHECK_TOL. Below that, the escape
+ * and the smooth count from it match those of T to a small fraction.
+ */
+#define MJ_CHECK_TOL 0x1.0p-10
+
+template<int P>
+bool mj_calc_checked(double cx, double cy, double zx, double zy, double c_err, int max_iter,
+                     double *result, long *nb_periodic = NULL)
+{
+    double fsq, sx, sy;
+    static const double fsq_max = 1.001 * pow(2.0, 2.0 / (P - 1));
+    static const double tol = mj_period_tol(0.0);
+    const double max_deriv = mj_sqr(MJ_CHECK_TOL / (c_err + 0x1.0p-50));
+    double drx = 0.0, dry = 0.0;
+    double px = zx, py = zy;
+    int next = 0, window = 1;
+
+    *result = MJ_INFINITY;
+    for (int k = 0; k < max_iter; k++) {
+        mj_complex_pow<P>(sx, sy, zx, zy, &fsq);
+
+        if (fsq >= fsq_max) {
+            *result = mj_calc_escape<P>(cx, cy, zx, zy, k, max_iter);
+            return true;
+        }
+
+        mj_deriv_step<P>(drx, dry, zx, zy, 1.0);
+        if (drx * drx + dry * dry > max_deriv)
+            return false;
+
+        zx = sx + cx;
+        zy = sy + cy;
+
+        if (fabs(zx - px) <= tol && fabs(zy - py) <= tol) {
+            if (nb_periodic)
+                (*nb_periodic)++;
+            return true;
+        }
+
+        if (k == next) {
+            px = zx, py = zy;
+            window *= 2;
+            next = k + window;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Closed-form interior test for the mandelbrot parameter c, done in double.
+ * Power 2: the multiplier of the fixed point is 1 - sqrt(1 - 4c) (main
+ * cardioid) and the one of the 2-cycle is 4(c + 1) (period 2 bulb). Other
+ * powers: the fixed point is found by Newton iterations from 0 and its
+ * multiplier is p z^(p-1). An attracting cycle (|multiplier| < 1) attracts
+ * the orbit of 0, so c never escapes. The margin keeps the test well away
+ * from the boundary, where rounding c to double could matter.
+ */
+#define MJ_INTERIOR_MARGIN 1.0e-6
+
+template<int P>
+inline bool mj_is_interior(double cx, double cy)
 {
-    //return is_julia ? mj_calc(cx, cy, zx, zy, max_iter) : mj_calc(cx + zx, cy + zy, T(0), T(0), max_iter);
-    static const double fsq_max = 1.001 * pow(2.0, 2.0 / (MJ_MANDELBROT_POWER - 1));
+    const double limit = 1.0 - MJ_INTERIOR_MARGIN;
+    _Complex double c = cx + I * cy;
+
+    if (P == 2) {
+        if (cx > -0.75 && cx < 0.375 && cy > -0.65 && cy < 0.65 &&
+            cabs(1.0 - csqrt(1.0 - 4.0 * c)) < limit)
+            return true;
+        return mj_sqr(cx + 1.0) + mj_sqr(cy) < mj_sqr(0.25 * limit);
+    }
+
+    /* the main component lies within |c| <= r + r^p, r = p^(-1/(p-1)) */
+    static const double r = pow(P, -1.0 / (P - 1));
+    static const double r_max = r + pow(r, P);
+    if (mj_sqr(cx) + mj_sqr(cy) >= mj_sqr(r_max))
+        return false;
+
+    _Complex double z = 0.0, zp, f;
+    for (int k = 0; k < 16; k++) {
+        zp = 1.0;
+        for (int j = 1; j < P; j++)
+            zp *= z;
+        f = zp * z - z + c;
+        z -= f / (P * zp - 1.0);
+    }
+
+    zp = 1.0;
+    for (int j = 1; j < P; j++)
+        zp *= z;
+    f = zp * z - z + c;
+    return cabs(f) < 1.0e-12 && P * cabs(zp) < limit;
+}
+
+/* per-frame parameters of mj_calc_batch */
+template<int P, typename T>
+struct MJ_CalcFrame {
+    static const int power = P;
+    typedef T scalar;
+
+    T       cx, cy;
+    double  dcx, dcy;
+    double  fsq_max;
+    int     max_iter;
+    int     julia_mode;
+    /* initial derivative and its increment for mj_calc_de */
+    double  deriv0, deriv_add;
+    /* try points in double first, see try_double() */
+    int     escalate;
+    mutable long nb_periodic;
+    mutable long nb_interior;
+    mutable long nb_checked, nb_escalated;
+
+    MJ_CalcFrame(T cx, T cy, int max_iter, int julia_mode, int escalate = 0) :
+        cx(cx), cy(cy), dcx(cx), dcy(cy),
+        fsq_max(1.001 * pow(2.0, 2.0 / (P - 1))),
+        max_iter(max_iter), julia_mode(julia_mode), escalate(escalate), nb_periodic(0), nb_interior(0),
+        nb_checked(0), nb_escalated(0)
+    {
+        if (julia_mode != MJ_JULIA_MODE_MANDELBROT && julia_mode != MJ_JULIA_MODE_JULIA_AT_C &&
+            julia_mode != MJ_JULIA_MODE_JULIA_AT_0 && julia_mode != MJ_JULIA_MODE_MANDELBROT_JULIA)
+            throw "invalid julia mode";
+        int is_julia = (julia_mode == MJ_JULIA_MODE_JULIA_AT_0 || julia_mode == MJ_JULIA_MODE_JULIA_AT_C);
+        deriv0 = is_julia ? 1.0 : 0.0;
+        deriv_add = is_julia ? 0.0 : 1.0;
+    }
+
+    /* mj_calc from iteration 0 or orbit in T or double, with the distance estimate if de is not NULL */
+    template<typename U>
+    inline double calc(U _cx, U _cy, U _zx, U _zy, double *de, MJ_Orbit<U> *orbit = NULL) const
+    {
+        long periodic = 0;
+        double result = de ? mj_calc_de<P>(_cx, _cy, _zx, _zy, deriv0, 0.0, deriv_add, max_iter, de, 0, &periodic,
+                                           orbit) :
+                        mj_calc<P>(_cx, _cy, _zx, _zy, max_iter, 0, &periodic, orbit);
+        mj_count(&nb_periodic, periodic);
+        return result;
+    }
+
+    /* points that escape immediately do not need the precision of T */
+    inline bool is_outside(double _cx, double _cy, double _zx, double _zy) const
+    {
+        return _zx * _zx + _zy * _zy >= fsq_max || _cx * _cx + _cy * _cy >= fsq_max;
+    }
+
+    /*
+     * With escalate, a point is first computed in double by mj_calc_checked.
+     * Only when that cannot vouch for the result does it need T. c in double
+     * is the sum of dcx and an offset, off by at most an ulp of each part.
+     * The orbit in double is not kept, a point that runs out of iterations
+     * starts over in a later render.
+     */
+    inline bool try_double(double _cx, double _cy, double _zx, double _zy, double *result,
+                           MJ_Orbit<T> *orbit = NULL) const
+    {
+        if (!escalate)
+            return false;
+        double c_err = 0x1.0p-52 * (fabs(dcx) + fabs(dcy) + fabs(_cx) + fabs(_cy));
+        long periodic = 0;
+        bool done = mj_calc_checked<P>(_cx, _cy, _zx, _zy, c_err, max_iter, result, &periodic);
+        mj_count(&nb_periodic, periodic);
+        mj_count(&nb_checked);
+        if (!done)
+            mj_count(&nb_escalated);
+        if (done && orbit)
+            orbit->k = (*result == MJ_INFINITY && !periodic) ? 0 : MJ_ORBIT_DONE;
+        return done;
+    }
+
+    /* mandelbrot modes only, c given in double */
+    inline bool is_interior(double _cx, double _cy) const
+    {
+        if (julia_mode != MJ_JULIA_MODE_MANDELBROT && julia_mode != MJ_JULIA_MODE_MANDELBROT_JULIA)
+            return false;
+        if (!mj_is_interior<P>(_cx, _cy))
+            return false;
+        mj_count(&nb_interior);
+        return true;
+    }
+};
+
+/*
+ * Compute n points that need the precision of T, one after the other, from
+ * orbit where it has k > 0. Types with a lane-parallel implementation
+ * overload it for their frames.
+ */
+template<int P, typename T>
+inline void mj_calc_points(const MJ_CalcFrame<P, T>& frame, const T *cx, const T *cy, const T *zx, const T *zy,
+                           double *result, int n, double *de, MJ_Orbit<T> *orbit)
+{
+    for (int k = 0; k < n; k++)
+        result[k] = frame.calc(cx[k], cy[k], zx[k], zy[k], de ? de + k : NULL, orbit ? orbit + k : NULL);
+}
+
+/*
+ * Compute n points given in SoA layout, (zx[k], zy[k]) is the offset from the
+ * frame center, interpreted according to julia_mode. If de is not NULL, it
+ * gets the distance estimates in the units of the offsets. Points that need
+ * T are gathered and passed to mj_calc_points in groups. Without de, an
+ * escalating frame first tries them in double. If orbit is not NULL, points
+ * with an orbit at k > 0 are continued from it in T, and every orbit is
+ * updated.
+ */
+template<int P, typename T>
+void mj_calc_batch(const MJ_CalcFrame<P, T>& frame, const double *zx, const double *zy, double *result, int n,
+                   double *de = NULL, MJ_Orbit<T> *orbit = NULL)
+{
+    const int BUF_SIZE = 64;
+    const T T0 = T(0.0);
+    T bcx[BUF_SIZE], bcy[BUF_SIZE], bzx[BUF_SIZE], bzy[BUF_SIZE];
+    double bres[BUF_SIZE], bde[BUF_SIZE];
+    MJ_Orbit<T> borbit[BUF_SIZE];
+    int bidx[BUF_SIZE];
     _Complex double tmp;
-    double _cx = cx, _cy = cy;
-    switch (julia_mode) {
-    case MJ_JULIA_MODE_MANDELBROT:
-        cx = cx + T(_zx);
-        cy = cy + T(_zy);
-        _cx += _zx;
-        _cy += _zy;
-        _zx = _zy = 0;
-        break;
-    case MJ_JULIA_MODE_JULIA_AT_0:
-        break;
-    case MJ_JULIA_MODE_MANDELBROT_JULIA:
-        tmp = cpow(_zx + I * _zy, MJ_MANDELBROT_POWER);
-        cx = cx + T(creal(tmp));
-        cy = cy + T(cimag(tmp));
-        _cx += creal(tmp);
-        _cy += cimag(tmp);
-        _zx = _zy = 0;
-        break;
-    case MJ_JULIA_MODE_JULIA_AT_C:
-        tmp = cpow(_zx + I * _zy, 1.0 / MJ_MANDELBROT_POWER);
-        _zx = creal(tmp);
-        _zy = cimag(tmp);
-        break;
-    default:
-        throw "invalid julia mode";
+
+    if (de)
+        for (int k = 0; k < n; k++)
+            de[k] = 0.0;
+
+    for (int off = 0; off < n; off += BUF_SIZE) {
+        int end = (n - off < BUF_SIZE) ? n : off + BUF_SIZE;
+        int m = 0;
+
+        /* the points not continued are done unless they turn out otherwise */
+        for (int k = off; orbit && k < end; k++)
+            if (orbit[k].k <= 0)
+                orbit[k].k = MJ_ORBIT_DONE;
+
+        switch (frame.julia_mode) {
+        case MJ_JULIA_MODE_MANDELBROT:
+            for (int k = off; k < end; k++) {
+                double _cx = frame.dcx + zx[k], _cy = frame.dcy + zy[k];
+                int resume = orbit && orbit[k].k > 0;
+                if (!resume && frame.is_interior(_cx, _cy)) {
+                    result[k] = MJ_INFINITY;
+                } else if (!resume && frame.is_outside(_cx, _cy, 0.0, 0.0)) {
+                    result[k] = frame.calc(_cx, _cy, 0.0, 0.0, de ? de + k : NULL);
+                } else if (resume || de || !frame.try_double(_cx, _cy, 0.0, 0.0, result + k,
+                                                             orbit ? orbit + k : NULL)) {
+                    bcx[m] = frame.cx + T(zx[k]), bcy[m] = frame.cy + T(zy[k]);
+                    bzx[m] = bzy[m] = T0, bidx[m++] = k;
+                }
+            }
+            break;
+        case MJ_JULIA_MODE_JULIA_AT_0:
+            for (int k = off; k < end; k++) {
+                int resume = orbit && orbit[k].k > 0;
+                if (!resume && frame.is_outside(frame.dcx, frame.dcy, zx[k], zy[k])) {
+                    result[k] = frame.calc(frame.dcx, frame.dcy, zx[k], zy[k], de ? de + k : NULL);
+                } else if (resume || de || !frame.try_double(frame.dcx, frame.dcy, zx[k], zy[k], result + k,
+                                                             orbit ? orbit + k : NULL)) {
+                    bcx[m] = frame.cx, bcy[m] = frame.cy;
+                    bzx[m] = T(zx[k]), bzy[m] = T(zy[k]), bidx[m++] = k;
+                }
+            }
+            break;
+        case MJ_JULIA_MODE_MANDELBROT_JULIA:
+            for (int k = off; k < end; k++) {
+                tmp = cpow(zx[k] + I * zy[k], P);
+                double _cx = frame.dcx + creal(tmp), _cy = frame.dcy + cimag(tmp);
+                int resume = orbit && orbit[k].k > 0;
+                if (!resume && frame.is_interior(_cx, _cy)) {
+                    result[k] = MJ_INFINITY;
+                } else if (!resume && frame.is_outside(_cx, _cy, 0.0, 0.0)) {
+                    result[k] = frame.calc(_cx, _cy, 0.0, 0.0, de ? de + k : NULL);
+                } else if (resume || de || !frame.try_double(_cx, _cy, 0.0, 0.0, result + k,
+                                                             orbit ? orbit + k : NULL)) {
+                    bcx[m] = frame.cx + T(creal(tmp)), bcy[m] = frame.cy + T(cimag(tmp));
+                    bzx[m] = bzy[m] = T0, bidx[m++] = k;
+                }
+            }
+            break;
+        case MJ_JULIA_MODE_JULIA_AT_C:
+            for (int k = off; k < end; k++) {
+                tmp = cpow(zx[k] + I * zy[k], 1.0 / P);
+                double _zx = creal(tmp), _zy = cimag(tmp);
+                int resume = orbit && orbit[k].k > 0;
+                if (!resume && frame.is_outside(frame.dcx, frame.dcy, _zx, _zy)) {
+                    result[k] = frame.calc(frame.dcx, frame.dcy, _zx, _zy, de ? de + k : NULL);
+                } else if (resume || de || !frame.try_double(frame.dcx, frame.dcy, _zx, _zy, result + k,
+                                                             orbit ? orbit + k : NULL)) {
+                    bcx[m] = frame.cx, bcy[m] = frame.cy;
+                    bzx[m] = T(_zx), bzy[m] = T(_zy), bidx[m++] = k;
+                }
+            }
+            break;
+        default:
+            throw "invalid julia mode";
+        }
+
+        for (int j = 0; orbit && j < m; j++)
+            borbit[j] = orbit[bidx[j]];
+        mj_calc_points(frame, bcx, bcy, bzx, bzy, bres, m, de ? bde : NULL, orbit ? borbit : NULL);
+        for (int j = 0; j < m; j++) {
+            result[bidx[j]] = bres[j];
+            if (de)
+                de[bidx[j]] = bde[j];
+            if (orbit)
+                orbit[bidx[j]] = borbit[j];
+        }
     }
 
-    if (_zx * _zx + _zy * _zy >= fsq_max || _cx * _cx + _cy * _cy >= fsq_max)
-        return mj_calc(_cx, _cy, _zx, _zy, max_iter);
-    else
-        return mj_calc(cx, cy, T(_zx), T(_zy), max_iter);
+    if (de)
+        for (int k = 0; k < n; k++)
+            if (de[k] > 0.0)
+                de[k] *= mj_distance_scale<P>(frame.julia_mode, zx[k], zy[k]);
+}
+
+template<int P, typename T>
+double mj_calc_select(T cx, T cy, double _zx, double _zy, int max_iter, int julia_mode)
+{
+    double result;
+    mj_calc_batch(MJ_CalcFrame<P, T>(cx, cy, max_iter, julia_mode), &_zx, &_zy, &result, 1);
+    return result;
 }
 
 #endif
@@ -31,7 +31,7 @@ struct MJ_Color {
     }
 };
 
-MJ_Color mj_color_average(const MJ_Color color[], float status, int count)
+inline MJ_Color mj_color_average(const MJ_Color color[], float status, int count)
 {
     MJ_Color result = {{ 0, 0, 0, status }};
     for (int k = 0; k < count; k++)
@@ -155,7 +155,7 @@ private:
 
 };
 
-const MJ_Color MJ_ColorPalette::m_default_color[] = {
+inline const MJ_Color MJ_ColorPalette::m_default_color[] = {
     {{ 0.000000, 0.027451, 0.392157 }},
     {{ 0.000104, 0.028892, 0.402546 }},
     {{ 0.000414, 0.031159, 0.413131 }},
@@ -414,6 +414,6 @@ const MJ_Color MJ_ColorPalette::m_default_color[] = {
     {{ 0.000000, 0.026445, 0.381559 }}
 };
 
-const int MJ_ColorPalette::m_nb_default_color = sizeof(m_default_color) / sizeof(m_default_color[0]);
+inline const int MJ_ColorPalette::m_nb_default_color = sizeof(m_default_color) / sizeof(m_default_color[0]);
 
 #endif
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_DD_H
+#define MJ_DD_H 1
+
+#include <stdio.h>
+#include <math.h>
+#include <gmp.h>
+#include "mj-parseval.h"
+
+/*
+ * Error-free transformations and double-double arithmetic on hi + lo pairs.
+ * They are written for V = double and for vectors of doubles alike, so the
+ * same operation sequence runs in a scalar MJ_DD and in a lane of a vector.
+ */
+
+/* s + e = a + b exactly, if |a| >= |b| */
+template<typename V>
+inline void mj_dd_fast_two_sum(V &s, V &e, V a, V b)
+{
+    s = a + b;
+    e = b - (s - a);
+}
+
+/* s + e = a + b exactly */
+template<typename V>
+inline void mj_dd_two_sum(V &s, V &e, V a, V b)
+{
+    s = a + b;
+    V bb = s - a;
+    e = (a - (s - bb)) + (b - bb);
+}
+
+/*
+ * p + e = a * b exactly, by Dekker's product of the 26-bit halves of a and b.
+ * The vectors of mj-calc-simd.h built with fma have it from a fused multiply
+ * subtract.
+ */
+template<typename V>
+inline void mj_dd_two_prod(V &p, V &e, V a, V b)
+{
+    const double split = 0x1.0p27 + 1.0;
+    V ta = split * a, tb = split * b;
+    V ah = ta - (ta - a), bh = tb - (tb - b);
+    V al = a - ah, bl = b - bh;
+    p = a * b;
+    e = ((ah * bh - p) + ah * bl + al * bh) + al * bl;
+}
+
+#ifdef __FP_FAST_FMA
+/* the same exact error term, fma() is only a library call without hardware fma */
+inline void mj_dd_two_prod(double &p, double &e, double a, double b)
+{
+    p = a * b;
+    e = fma(a, b, -p);
+}
+#endif
+
+/*
+ * The low halves are summed without their rounding error, the result is
+ * off by a few ulp of the low half of the larger operand. Values in mj_calc
+ * stay below MJ_INFINITY, so this absolute error is what limits a zoom
+ * either way, and it takes half of the dependent operations of an exact sum.
+ */
+template<typename V>
+inline void mj_dd_add(V &rh, V &rl, V ah, V al, V bh, V bl)
+{
+    V s, e;
+    mj_dd_two_sum(s, e, ah, bh);
+    e += al + bl;
+    mj_dd_fast_two_sum(rh, rl, s, e);
+}
+
+template<typename V>
+inline void mj_dd_mul(V &rh, V &rl, V ah, V al, V bh, V bl)
+{
+    V p, e;
+    mj_dd_two_prod(p, e, ah, bh);
+    e += ah * bl + al * bh;
+    mj_dd_fast_two_sum(rh, rl, p, e);
+}
+
+template<typename V>
+inline void mj_dd_sqr(V &rh, V &rl, V ah, V al)
+{
+    V p, e;
+    mj_dd_two_prod(p, e, ah, ah);
+    e += 2.0 * ah * al;
+    mj_dd_fast_two_sum(rh, rl, p, e);
+}
+
+/*
+ * double-double, value = m_hi + m_lo with |m_lo| <= ulp(m_hi) / 2, about
+ * 106 bits of mantissa. It relies on round to nearest doubles, do not build
+ * it with -ffast-math or with floating point contraction.
+ */
+class MJ_DD {
+public:
+    inline MJ_DD(int value = 0)
+    {
+        m_hi = value, m_lo = 0.0;
+    }
+
+    inline MJ_DD(double value)
+    {
+        m_hi = value, m_lo = 0.0;
+    }
+
+    /* round toward -INF */
+    inline operator int() const
+    {
+        double f = floor(m_hi);
+        return int(f) - (f == m_hi && m_lo < 0.0);
+    }
+
+    inline operator double() const
+    {
+        return m_hi;
+    }
+
+    MJ_DD(const char *str)
+    {
+        mpf_t v;
+        char tail;
+        mpf_init2(v, 192);
+        if (gmp_sscanf(str, "%Ff %c", v, &tail) != 1)
+            throw "invalid MJ_DD string";
+
+        /* mpf_get_d truncates, the rest is taken from the remainder */
+        double hi = mpf_get_d(v);
+        mpf_t rest;
+        mpf_init2(rest, 192);
+        mpf_set_d(rest, hi);
+        mpf_sub(rest, v, rest);
+        mj_dd_fast_two_sum(m_hi, m_lo, hi, mpf_get_d(rest));
+
+        mpf_clear(rest);
+        mpf_clear(v);
+    }
+
+    void printval(FILE *fp) const
+    {
+        mpf_t v, lo;
+        mpf_init2(v, 192);
+        mpf_init2(lo, 192);
+        mpf_set_d(v, m_hi);
+        mpf_set_d(lo, m_lo);
+        mpf_add(v, v, lo);
+        gmp_fprintf(fp, "%.33Fe", v);
+        mpf_clear(lo);
+        mpf_clear(v);
+    }
+
+    friend MJ_DD operator +(const MJ_DD& a, const MJ_DD& b);
+    friend MJ_DD operator -(const MJ_DD& a, const MJ_DD& b);
+    friend MJ_DD operator -(const MJ_DD& a);
+    friend MJ_DD operator *(const MJ_DD& a, const MJ_DD& b);
+    friend MJ_DD mj_sqr(const MJ_DD& a);
+    friend bool operator >=(const MJ_DD& a, const MJ_DD& b);
+    friend bool operator ==(const MJ_DD& a, const MJ_DD& b);
+    template<int LANES> friend struct MJ_LanesDD;
+
+private:
+    double m_hi, m_lo;
+};
+
+inline MJ_DD operator +(const MJ_DD& a, const MJ_DD& b)
+{
+    MJ_DD r;
+    mj_dd_add(r.m_hi, r.m_lo, a.m_hi, a.m_lo, b.m_hi, b.m_lo);
+    return r;
+}
+
+inline MJ_DD operator -(const MJ_DD& a)
+{
+    MJ_DD r;
+    r.m_hi = -a.m_hi, r.m_lo = -a.m_lo;
+    return r;
+}
+
+inline MJ_DD operator -(const MJ_DD& a, const MJ_DD& b)
+{
+    MJ_DD r;
+    mj_dd_add(r.m_hi, r.m_lo, a.m_hi, a.m_lo, -b.m_hi, -b.m_lo);
+    return r;
+}
+
+inline MJ_DD operator *(const MJ_DD& a, const MJ_DD& b)
+{
+    MJ_DD r;
+    mj_dd_mul(r.m_hi, r.m_lo, a.m_hi, a.m_lo, b.m_hi, b.m_lo);
+    return r;
+}
+
+inline MJ_DD mj_sqr(const MJ_DD& a)
+{
+    MJ_DD r;
+    mj_dd_sqr(r.m_hi, r.m_lo, a.m_hi, a.m_lo);
+    return r;
+}
+
+inline bool operator >=(const MJ_DD& a, const MJ_DD& b)
+{
+    return a.m_hi > b.m_hi || (a.m_hi == b.m_hi && a.m_lo >= b.m_lo);
+}
+
+inline bool operator ==(const MJ_DD& a, const MJ_DD& b)
+{
+    return a.m_hi == b.m_hi && a.m_lo == b.m_lo;
+}
+
+inline MJ_DD mj_parseval(const char *str, MJ_DD dummy)
+{
+    return str;
+}
+
+inline void mj_printval(FILE *fp, MJ_DD v)
+{
+    v.printval(fp);
+}
+
+inline double mj_period_tol(MJ_DD dummy)
+{
+    return 0x1.0p-100;
+}
+
+inline double mj_double_cost(MJ_DD dummy)
+{
+    return 0.3;
+}
+
+#endif
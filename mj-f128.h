@@ -118,6 +118,7 @@ public:
     friend MJ_F128 mj_sqr(const MJ_F128& a);
     friend bool operator >=(const MJ_F128& a, const MJ_F128& b);
     friend bool operator ==(const MJ_F128& a, const MJ_F128& b);
+    template<int LANES> friend struct MJ_LanesF128;
 
 private:
     uint64_t m_value[2];
@@ -302,4 +303,9 @@ inline void mj_printval(FILE *fp, MJ_F128 v)
     v.printval(fp);
 }
 
+inline double mj_period_tol(MJ_F128 dummy)
+{
+    return 0x1.0p-112;
+}
+
 #endif
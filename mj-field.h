@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_FIELD_H
+#define MJ_FIELD_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "mj-surface.h"
+#include "mj-color.h"
+#include "mj-calc.h"
+#include "mj-png.h"
+#include "mj-thread-pool.h"
+
+/*
+ * Iteration field: the values the colors of an image are made of, written
+ * by -f so that -F colors it again with another palette, period or offset
+ * without computing anything. The file is in the byte order of the machine
+ * that wrote it, every part aligned to 8 bytes to be used mapped:
+ *
+ *   char    magic[8]                     "MJFIELD1"
+ *   int32   width, height                in samples, multisample per output pixel
+ *   int32   multisample
+ *   int32   reserved                     0
+ *   int64   nb_records
+ *   double  values[height][width]        smooth iteration, MJ_INFINITY inside
+ *   int32   records[height][width]       antialias record of the sample, -1 for none
+ *   int32   padding                      when width * height is odd
+ *   double  samples[nb_records][8]       the 8 antialias samples around it
+ *
+ * A sample is the color of its value, averaged with those of its 8 antialias
+ * samples when it has a record, as mj_antialias colors it.
+ */
+struct MJ_FieldHeader {
+    char    magic[8];
+    int32_t width, height;
+    int32_t multisample;
+    int32_t reserved;
+    int64_t nb_records;
+};
+
+static const char mj_field_magic[8] = {'M', 'J', 'F', 'I', 'E', 'L', 'D', '1'};
+
+/* the field of an image being rendered */
+class MJ_Field {
+public:
+    MJ_Field(int width, int height, int multisample) :
+        m_values(width, height), m_records(width, height), m_multisample(multisample)
+    {
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                m_records(x, y) = -1;
+    }
+
+    void set_value(int x, int y, double value)
+    {
+        m_values(x, y) = value;
+    }
+
+    void set_samples(int x, int y, const double *samples)
+    {
+        m_records(x, y) = int32_t(m_samples.size() / 8);
+        m_samples.insert(m_samples.end(), samples, samples + 8);
+    }
+
+    /* the samples not rendered from their sources, Plan is MJ_SymmetryPlan */
+    template<typename Plan>
+    void fill(const Plan& plan)
+    {
+        plan.fill(m_values);
+        plan.fill(m_records);
+    }
+
+    void write(const char *filename) const
+    {
+        MJ_FieldHeader header = {};
+        memcpy(header.magic, mj_field_magic, sizeof(header.magic));
+        header.width = m_values.width();
+        header.height = m_values.height();
+        header.multisample = m_multisample;
+        header.nb_records = m_samples.size() / 8;
+
+        FILE *fp = fopen(filename, "wb");
+        if (!fp)
+            throw "cannot open field file";
+
+        int is_ok = (fwrite(&header, sizeof(header), 1, fp) == 1);
+        for (int y = 0; is_ok && y < header.height; y++)
+            is_ok = (fwrite(&m_values(0, y), sizeof(double), header.width, fp) == size_t(header.width));
+        for (int y = 0; is_ok && y < header.height; y++)
+            is_ok = (fwrite(&m_records(0, y), sizeof(int32_t), header.width, fp) == size_t(header.width));
+        if (is_ok && (long(header.width) * header.height) % 2) {
+            int32_t padding = 0;
+            is_ok = (fwrite(&padding, sizeof(padding), 1, fp) == 1);
+        }
+        if (is_ok && !m_samples.empty())
+            is_ok = (fwrite(m_samples.data(), sizeof(double), m_samples.size(), fp) == m_samples.size());
+        if (fclose(fp) || !is_ok)
+            throw "cannot write field file";
+    }
+
+private:
+    MJ_Surface<double>  m_values;
+    MJ_Surface<int32_t> m_records;
+    std::vector<double> m_samples;
+    int                 m_multisample;
+
+    MJ_Field(const MJ_Field&);
+    MJ_Field& operator=(const MJ_Field&);
+};
+
+/* a field file mapped to be read */
+class MJ_FieldFile {
+public:
+    MJ_FieldFile(const char *filename) :
+        m_ptr(MAP_FAILED), m_size(0)
+    {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            throw "cannot open field file";
+
+        struct stat st;
+        if (fstat(fd, &st) || st.st_size < off_t(sizeof(MJ_FieldHeader))) {
+            close(fd);
+            throw "invalid field file";
+        }
+        m_size = st.st_size;
+        m_ptr = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (m_ptr == MAP_FAILED)
+            throw "cannot map field file";
+
+        const MJ_FieldHeader *header = (const MJ_FieldHeader *) m_ptr;
+        m_width = header->width;
+        m_height = header->height;
+        m_multisample = header->multisample;
+
+        long nb = long(m_width) * m_height;
+        if (memcmp(header->magic, mj_field_magic, sizeof(header->magic)) || m_multisample < 1 ||
+            m_multisample > 3 || m_width < m_multisample || m_height < m_multisample ||
+            m_width % m_multisample || m_height % m_multisample || header->nb_records < 0 ||
+            header->nb_records > nb || m_size != sizeof(MJ_FieldHeader) + nb * sizeof(double) +
+            (nb + nb % 2) * sizeof(int32_t) + header->nb_records * 8 * sizeof(double)) {
+            munmap(m_ptr, m_size);
+            throw "invalid field file";
+        }
+
+        m_values = (const double *) (header + 1);
+        m_records = (const int32_t *) (m_values + nb);
+        m_samples = (const double *) (m_records + nb + nb % 2);
+        m_nb_records = header->nb_records;
+    }
+
+    ~MJ_FieldFile()
+    {
+        munmap(m_ptr, m_size);
+    }
+
+    int width() const
+    {
+        return m_width;
+    }
+
+    int height() const
+    {
+        return m_height;
+    }
+
+    int multisample() const
+    {
+        return m_multisample;
+    }
+
+    MJ_Color color(int x, int y, MJ_ColorPalette const& palette, double period) const
+    {
+        long k = long(m_width) * y + x;
+        MJ_Color center = (m_values[k] == MJ_INFINITY) ? palette.infinity_color(0) :
+                          palette.color(m_values[k] / period, 0);
+        int32_t record = m_records[k];
+        if (record < 0 || record >= m_nb_records)
+            return center;
+
+        const double *res = m_samples + 8 * long(record);
+        MJ_Color buf[9];
+        for (int j = 0; j < 8; j++)
+            buf[j] = (res[j] == MJ_INFINITY) ? palette.infinity_color(1) : palette.color(res[j] / period, 1);
+        buf[8] = center;
+        return mj_color_average(buf, 1, 9);
+    }
+
+private:
+    void            *m_ptr;
+    size_t          m_size;
+    int             m_width, m_height, m_multisample;
+    long            m_nb_records;
+    const double    *m_values;
+    const int32_t   *m_records;
+    const double    *m_samples;
+
+    MJ_FieldFile(const MJ_FieldFile&);
+    MJ_FieldFile& operator=(const MJ_FieldFile&);
+};
+
+/* row y of a band of the field starting at row start */
+struct MJ_FieldRows {
+    MJ_Surface<MJ_Color> const& band;
+    MJ_FieldFile const&         field;
+    MJ_ColorPalette const&      palette;
+    double                      period;
+    int                         start;
+
+    void operator()(int y)
+    {
+        for (int x = 0; x < band.width(); x++)
+            band(x, y) = field.color(x, start + y, palette, period);
+    }
+};
+
+/* color the field into a png, a band of rows at a time on the threads of pool */
+template<typename T>
+inline void mj_output_field_png(MJ_FieldFile const& field, MJ_ColorPalette const& palette, double period,
+                                const char *filename, MJ_ThreadPool& pool)
+{
+    const int band_height = 64 * field.multisample();
+    int m = field.multisample();
+    MJ_PngWriter<T> png(filename, field.width() / m, field.height() / m);
+    MJ_Surface<MJ_Color> band(field.width(), band_height);
+    std::vector<MJ_Color> row(field.width() / m);
+
+    for (int start = 0; start < field.height(); start += band_height) {
+        int height = (field.height() - start < band_height) ? field.height() - start : band_height;
+        MJ_FieldRows body = { band, field, palette, period, start };
+        mj_parallel_for(pool, 0, height, body);
+        for (int y = 0; y < height; y += m) {
+            mj_downsample_row(band, y, m, row.data());
+            png.write_row(row.data());
+        }
+    }
+    png.finish();
+}
+
+#endif
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <gmp.h>
+#include <x86intrin.h>
 #include "mj-parseval.h"
 
 template<int BITS>
@@ -137,13 +138,132 @@ private:
     static const int LIMBS = BITS / 64;
 
     uint64_t m_value[LIMBS];
+
+    /* (t2:t1:t0) += a * b */
+    static inline __attribute__((always_inline))
+    void s_muladd(uint64_t &t0, uint64_t &t1, uint64_t &t2, uint64_t a, uint64_t b)
+    {
+        uint64_t lo, hi;
+#ifdef __BMI2__
+        asm("mulxq %3, %0, %1 \n"
+            :
+            "=r" (lo),
+            "=r" (hi)
+            :
+            "d"  (a),
+            "rm" (b));
+#else
+        asm("mulq %3 \n"
+            :
+            "=a" (lo),
+            "=d" (hi)
+            :
+            "0"  (a),
+            "rm" (b));
+#endif
+        s_add(t0, t1, t2, lo, hi, 0);
+    }
+
+    /* (t2:t1:t0) += (u2:u1:u0) */
+    static inline __attribute__((always_inline))
+    void s_add(uint64_t &t0, uint64_t &t1, uint64_t &t2, uint64_t u0, uint64_t u1, uint64_t u2)
+    {
+        asm("addq %3, %0 \n"
+            "adcq %4, %1 \n"
+            "adcq %5, %2 \n"
+            :
+            "+&r" (t0),
+            "+&r" (t1),
+            "+&r" (t2)
+            :
+            "rm" (u0),
+            "rm" (u1),
+            "rme" (u2));
+    }
+
+    /*
+     * Product scanning: column c of the product sums a[i] * b[c - i] in
+     * 192-bit accumulators, two of them to halve the carry chains. Squaring
+     * sums each cross product once and doubles the sum. Only the columns from
+     * LIMBS - 3 up are computed, the columns left out sum to less than
+     * LIMBS^2 / 2 units of limb LIMBS - 2. The result, limbs LIMBS - 1 and up
+     * rounded by the top bit of limb LIMBS - 2, is then the correctly rounded
+     * product unless the exact one is within LIMBS^2 / 2^65 ulp of a rounding
+     * boundary, and never more than 1 ulp away from it. The operands are
+     * multiplied as unsigned, a negative operand is then corrected by
+     * subtracting the other one shifted by one limb.
+     */
+    template<int IS_SQR>
+    static inline MJ_Fixed s_mul(const MJ_Fixed& a, const MJ_Fixed& b)
+    {
+        const int START = (LIMBS > 3) ? LIMBS - 3 : 0;
+        uint64_t sign_a = int64_t(a.m_value[LIMBS - 1]) >> 63;
+        uint64_t sign_b = int64_t(b.m_value[LIMBS - 1]) >> 63;
+        uint64_t t0 = 0, t1 = 0, t2 = 0, round = 0;
+        MJ_Fixed r;
+
+#pragma GCC unroll 32
+        for (int c = START; c <= 2 * LIMBS - 2; c++) {
+            const int low = (c < LIMBS) ? 0 : c - LIMBS + 1;
+            uint64_t u0 = 0, u1 = 0, u2 = 0;
+#pragma GCC unroll 32
+            for (int i = low; i <= c - low; i++) {
+                if (!IS_SQR) {
+                    if ((i - low) % 2)
+                        s_muladd(u0, u1, u2, a.m_value[i], b.m_value[c - i]);
+                    else
+                        s_muladd(t0, t1, t2, a.m_value[i], b.m_value[c - i]);
+                } else if (i < c - i) {
+                    s_muladd(u0, u1, u2, a.m_value[i], a.m_value[c - i]);
+                } else if (i == c - i) {
+                    s_muladd(t0, t1, t2, a.m_value[i], a.m_value[i]);
+                }
+            }
+            if (IS_SQR)
+                s_add(u0, u1, u2, u0, u1, u2);
+            s_add(t0, t1, t2, u0, u1, u2);
+
+            if (c == LIMBS - 2)
+                round = t0;
+            if (c >= LIMBS - 1)
+                r.m_value[c - LIMBS + 1] = t0;
+            t0 = t1, t1 = t2, t2 = 0;
+        }
+
+        __int128 acc = round >> 63;
+#pragma GCC unroll 32
+        for (int k = 0; k < LIMBS; k++) {
+            acc += r.m_value[k];
+            if (k > 0)
+                acc -= __int128(b.m_value[k - 1] & sign_a) + (a.m_value[k - 1] & sign_b);
+            r.m_value[k] = uint64_t(acc);
+            acc >>= 64;
+        }
+
+        return r;
+    }
+
+    /*
+     * Above 6 limbs, several inlined products in one loop thrash the
+     * instruction cache: at 8 limbs and up the call costs nothing measurable,
+     * at 6 limbs inlining is about 10% faster.
+     */
+    template<int IS_SQR>
+    static __attribute__((noinline)) MJ_Fixed s_mul_outline(const MJ_Fixed& a, const MJ_Fixed& b)
+    {
+        return s_mul<IS_SQR>(a, b);
+    }
 };
 
+/* unrolled carry chains, a call to mpn_add_n costs as much as the addition itself */
 template<int BITS>
 inline MJ_Fixed<BITS> operator +(const MJ_Fixed<BITS> &a, const MJ_Fixed<BITS> &b)
 {
     MJ_Fixed<BITS> r;
-    mpn_add_n(r.m_value, a.m_value, b.m_value, MJ_Fixed<BITS>::LIMBS);
+    unsigned char carry = 0;
+#pragma GCC unroll 32
+    for (int k = 0; k < MJ_Fixed<BITS>::LIMBS; k++)
+        carry = _addcarry_u64(carry, a.m_value[k], b.m_value[k], (unsigned long long *) &r.m_value[k]);
     return r;
 }
 
@@ -151,7 +271,10 @@ template<int BITS>
 inline MJ_Fixed<BITS> operator -(const MJ_Fixed<BITS> &a, const MJ_Fixed<BITS> &b)
 {
     MJ_Fixed<BITS> r;
-    mpn_sub_n(r.m_value, a.m_value, b.m_value, MJ_Fixed<BITS>::LIMBS);
+    unsigned char borrow = 0;
+#pragma GCC unroll 32
+    for (int k = 0; k < MJ_Fixed<BITS>::LIMBS; k++)
+        borrow = _subborrow_u64(borrow, a.m_value[k], b.m_value[k], (unsigned long long *) &r.m_value[k]);
     return r;
 }
 
@@ -159,72 +282,42 @@ template<int BITS>
 inline MJ_Fixed<BITS> operator -(const MJ_Fixed<BITS> &a)
 {
     MJ_Fixed<BITS> r;
-    mpn_neg(r.m_value, a.m_value, MJ_Fixed<BITS>::LIMBS);
+    unsigned char borrow = 0;
+#pragma GCC unroll 32
+    for (int k = 0; k < MJ_Fixed<BITS>::LIMBS; k++)
+        borrow = _subborrow_u64(borrow, 0, a.m_value[k], (unsigned long long *) &r.m_value[k]);
     return r;
 }
 
 template<int BITS>
 inline MJ_Fixed<BITS> operator *(const MJ_Fixed<BITS> &a, const MJ_Fixed<BITS> &b)
 {
-    static const int LIMBS = MJ_Fixed<BITS>::LIMBS;
-    MJ_Fixed<BITS> r;
-    uint64_t buf[LIMBS * 2];
-    int sign = 1;
-    if (int64_t(a.m_value[LIMBS - 1]) >= 0) {
-        if (int64_t(b.m_value[LIMBS - 1]) >= 0) {
-            mpn_mul_n(buf, a.m_value, b.m_value, LIMBS);
-        } else {
-            MJ_Fixed<BITS> tmp_b = -b;
-            sign *= -1;
-            mpn_mul_n(buf, a.m_value, tmp_b.m_value, LIMBS);
-        }
-    } else {
-        MJ_Fixed<BITS> tmp_a = -a;
-        sign *= -1;
-        if (int64_t(b.m_value[LIMBS - 1]) >= 0) {
-            mpn_mul_n(buf, tmp_a.m_value, b.m_value, LIMBS);
-        } else {
-            MJ_Fixed<BITS> tmp_b = -b;
-            sign *= -1;
-            mpn_mul_n(buf, tmp_a.m_value, tmp_b.m_value, LIMBS);
-        }
-    }
-
-    if (int64_t(buf[LIMBS - 2]) < 0)
-        mpn_add_1(buf + LIMBS - 1, buf + LIMBS - 1, LIMBS, 1);
-
-    if (sign >= 0) {
-        for (int k = 0; k < LIMBS; k++)
-            r.m_value[k] = buf[k + LIMBS - 1];
-    } else {
-        mpn_neg(r.m_value, buf + LIMBS - 1, LIMBS);
-    }
-
-    return r;
+    if (MJ_Fixed<BITS>::LIMBS > 6)
+        return MJ_Fixed<BITS>::template s_mul_outline<0>(a, b);
+    return MJ_Fixed<BITS>::template s_mul<0>(a, b);
 }
 
 template<int BITS>
 inline MJ_Fixed<BITS> mj_sqr(const MJ_Fixed<BITS> &a)
 {
-    static const int LIMBS = MJ_Fixed<BITS>::LIMBS;
-    MJ_Fixed<BITS> r;
-    uint64_t buf[LIMBS * 2];
-
-    if (int64_t(a.m_value[LIMBS -1]) >= 0) {
-        mpn_sqr(buf, a.m_value, LIMBS);
-    } else {
-        MJ_Fixed<BITS> tmp_a = -a;
-        mpn_sqr(buf, tmp_a.m_value, LIMBS);
-    }
-
-    if (int64_t(buf[LIMBS - 2]) < 0) {
-        mpn_add_1(r.m_value, buf + LIMBS - 1, LIMBS, 1);
-    } else {
-        for (int k = 0; k < LIMBS; k++)
-            r.m_value[k] = buf[k + LIMBS - 1];
-    }
+    if (MJ_Fixed<BITS>::LIMBS > 6)
+        return MJ_Fixed<BITS>::template s_mul_outline<1>(a, a);
+    return MJ_Fixed<BITS>::template s_mul<1>(a, a);
+}
 
-    return r;
+/*
+ * 2 zx zy = (zx + zy)^2 - (zx^2 + zy^2): three squarings, each about half
+ * the limb products of a multiplication, instead of two and a multiplication.
+ */
+template<int BITS>
+inline void mj_complex_sqr_with_norm(MJ_Fixed<BITS> &sx, MJ_Fixed<BITS> &sy, MJ_Fixed<BITS> &fsq,
+                                     const MJ_Fixed<BITS> &zx, const MJ_Fixed<BITS> &zy)
+{
+    MJ_Fixed<BITS> zx2 = mj_sqr(zx);
+    MJ_Fixed<BITS> zy2 = mj_sqr(zy);
+    sx = zx2 - zy2;
+    fsq = zx2 + zy2;
+    sy = mj_sqr(zx + zy) - fsq;
 }
 
 template<int BITS>
@@ -267,4 +360,16 @@ inline void mj_printval(FILE *fp, MJ_Fixed<BITS> v)
     v.printval(fp);
 }
 
+template<int BITS>
+inline double mj_period_tol(MJ_Fixed<BITS> dummy)
+{
+    return ldexp(1.0, 72 - BITS);
+}
+
+template<int BITS>
+inline double mj_double_cost(MJ_Fixed<BITS> dummy)
+{
+    return 25.0 / BITS;
+}
+
 #endif
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_FLOATEXP_H
+#define MJ_FLOATEXP_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <gmp.h>
+#include "mj-parseval.h"
+
+/*
+ * double mantissa with a separate 64-bit exponent, value = m_mant * 2^m_exp.
+ * m_mant is normalized to 0.5 <= |m_mant| < 1, zero has m_mant = 0 and
+ * m_exp = ZERO_EXP, so every value has a unique representation.
+ */
+class MJ_FloatExp {
+public:
+    inline MJ_FloatExp(int value = 0)
+    {
+        s_set(*this, value, 0);
+    }
+
+    inline MJ_FloatExp(double value)
+    {
+        s_set(*this, value, 0);
+    }
+
+    /* round toward -INF */
+    inline operator int() const
+    {
+        return floor(double(*this));
+    }
+
+    /* saturates to 0 or +-HUGE_VAL outside of the double range */
+    inline operator double() const
+    {
+        if (m_exp > 4096)
+            return m_mant * HUGE_VAL;
+        if (m_exp < -4096)
+            return m_mant * 0.0;
+        return ldexp(m_mant, int(m_exp));
+    }
+
+    MJ_FloatExp(const char *str)
+    {
+        mpf_t v;
+        char tail;
+        mpf_init2(v, 128);
+        if (gmp_sscanf(str, "%Ff %c", v, &tail) != 1)
+            throw "invalid MJ_FloatExp string";
+
+        long exp;
+        double mant = mpf_get_d_2exp(&exp, v);
+        s_set(*this, mant, exp);
+        mpf_clear(v);
+    }
+
+    void printval(FILE *fp) const
+    {
+        mpf_t v;
+        mpf_init2(v, 128);
+        mpf_set_d(v, m_mant);
+        if (m_mant != 0.0 && m_exp >= 0)
+            mpf_mul_2exp(v, v, m_exp);
+        if (m_mant != 0.0 && m_exp < 0)
+            mpf_div_2exp(v, v, -m_exp);
+        gmp_fprintf(fp, "%.17Fe", v);
+        mpf_clear(v);
+    }
+
+    friend MJ_FloatExp operator +(const MJ_FloatExp& a, const MJ_FloatExp& b);
+    friend MJ_FloatExp operator -(const MJ_FloatExp& a, const MJ_FloatExp& b);
+    friend MJ_FloatExp operator -(const MJ_FloatExp& a);
+    friend MJ_FloatExp operator *(const MJ_FloatExp& a, const MJ_FloatExp& b);
+    friend MJ_FloatExp operator /(const MJ_FloatExp& a, const MJ_FloatExp& b);
+    friend MJ_FloatExp mj_sqr(const MJ_FloatExp& a);
+    friend MJ_FloatExp mj_hypot(const MJ_FloatExp& a, const MJ_FloatExp& b);
+    friend MJ_FloatExp mj_ldexp(const MJ_FloatExp& a, int64_t exp);
+    friend double mj_frexp(const MJ_FloatExp& a, int64_t *exp);
+    friend bool operator >=(const MJ_FloatExp& a, const MJ_FloatExp& b);
+    friend bool operator ==(const MJ_FloatExp& a, const MJ_FloatExp& b);
+
+private:
+    /* far below any reachable exponent, but sums of two do not overflow */
+    static const int64_t ZERO_EXP = INT64_MIN / 4;
+
+    double  m_mant;
+    int64_t m_exp;
+
+    inline MJ_FloatExp(double mant, int64_t exp, int)
+    {
+        s_set(*this, mant, exp);
+    }
+
+    /* frexp() on the bits, it is the hot path of every operation */
+    static inline void s_set(MJ_FloatExp& r, double mant, int64_t exp)
+    {
+        uint64_t bits;
+        memcpy(&bits, &mant, sizeof(bits));
+        int biased = (bits >> 52) & 0x7ff;
+
+        if (mant == 0.0) {
+            r.m_mant = 0.0, r.m_exp = ZERO_EXP;
+            return;
+        }
+
+        if (biased == 0 || biased == 0x7ff) {
+            int e;
+            r.m_mant = frexp(mant, &e);
+            r.m_exp = (r.m_mant == 0.0) ? ZERO_EXP : exp + e;
+            return;
+        }
+
+        bits = (bits & ~(uint64_t(0x7ff) << 52)) | (uint64_t(1022) << 52);
+        memcpy(&r.m_mant, &bits, sizeof(bits));
+        r.m_exp = exp + biased - 1022;
+    }
+
+    static inline MJ_FloatExp s_add(const MJ_FloatExp& a, const MJ_FloatExp& b)
+    {
+        const MJ_FloatExp& big = (a.m_exp >= b.m_exp) ? a : b;
+        const MJ_FloatExp& small = (a.m_exp >= b.m_exp) ? b : a;
+        int64_t diff = big.m_exp - small.m_exp;
+        if (diff > 64)
+            return big;
+
+        /* 2^-diff, exact as diff <= 64 */
+        double scale;
+        uint64_t bits = uint64_t(1023 - diff) << 52;
+        memcpy(&scale, &bits, sizeof(bits));
+        return MJ_FloatExp(big.m_mant + small.m_mant * scale, big.m_exp, 0);
+    }
+};
+
+inline MJ_FloatExp operator +(const MJ_FloatExp& a, const MJ_FloatExp& b)
+{
+    return MJ_FloatExp::s_add(a, b);
+}
+
+inline MJ_FloatExp operator -(const MJ_FloatExp& a)
+{
+    MJ_FloatExp r = a;
+    r.m_mant = -r.m_mant;
+    return r;
+}
+
+inline MJ_FloatExp operator -(const MJ_FloatExp& a, const MJ_FloatExp& b)
+{
+    return MJ_FloatExp::s_add(a, -b);
+}
+
+inline MJ_FloatExp operator *(const MJ_FloatExp& a, const MJ_FloatExp& b)
+{
+    return MJ_FloatExp(a.m_mant * b.m_mant, a.m_exp + b.m_exp, 0);
+}
+
+inline MJ_FloatExp operator /(const MJ_FloatExp& a, const MJ_FloatExp& b)
+{
+    return MJ_FloatExp(a.m_mant / b.m_mant, a.m_exp - b.m_exp, 0);
+}
+
+inline MJ_FloatExp mj_sqr(const MJ_FloatExp& a)
+{
+    return MJ_FloatExp(a.m_mant * a.m_mant, a.m_exp + a.m_exp, 0);
+}
+
+/* sqrt(a^2 + b^2) on the mantissas scaled to the larger exponent */
+inline MJ_FloatExp mj_hypot(const MJ_FloatExp& a, const MJ_FloatExp& b)
+{
+    int64_t exp = (a.m_exp >= b.m_exp) ? a.m_exp : b.m_exp;
+    double x = (exp - a.m_exp > 1024) ? 0.0 : ldexp(a.m_mant, int(a.m_exp - exp));
+    double y = (exp - b.m_exp > 1024) ? 0.0 : ldexp(b.m_mant, int(b.m_exp - exp));
+    return MJ_FloatExp(hypot(x, y), exp, 0);
+}
+
+inline MJ_FloatExp mj_ldexp(const MJ_FloatExp& a, int64_t exp)
+{
+    return MJ_FloatExp(a.m_mant, a.m_exp + exp, 0);
+}
+
+/* the mantissa, 0.5 <= |m| < 1 or 0, with the exponent in *exp */
+inline double mj_frexp(const MJ_FloatExp& a, int64_t *exp)
+{
+    *exp = a.m_exp;
+    return a.m_mant;
+}
+
+inline bool operator >=(const MJ_FloatExp& a, const MJ_FloatExp& b)
+{
+    return (a - b).m_mant >= 0.0;
+}
+
+inline bool operator ==(const MJ_FloatExp& a, const MJ_FloatExp& b)
+{
+    return a.m_mant == b.m_mant && a.m_exp == b.m_exp;
+}
+
+inline MJ_FloatExp mj_parseval(const char *str, MJ_FloatExp dummy)
+{
+    return str;
+}
+
+inline void mj_printval(FILE *fp, MJ_FloatExp v)
+{
+    v.printval(fp);
+}
+
+#endif
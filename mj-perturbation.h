@@ -0,0 +1,708 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_PERTURBATION_H
+#define MJ_PERTURBATION_H 1
+
+#include <math.h>
+#include <complex.h>
+#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include "mj-calc.h"
+#include "mj-floatexp.h"
+
+/*
+ * Perturbation: a reference orbit Z is computed once in T, every point then
+ * only iterates its difference dz from the reference in D:
+ *   dz' = (Z + dz)^p - Z^p + dc
+ *
+ * D is double, or MJ_FloatExp for the types that resolve views past the
+ * range of double (see MJ_PerturbDelta). The offsets of the points of such a
+ * view are given scaled by 2^scale, they only meet the true scale in D, in T
+ * and in the distance estimates, which are given in the scaled units.
+ *
+ * Points are mapped first into "e" space, which is c (mandelbrot modes) or
+ * z0 (julia modes) relative to the frame center. A point whose delta loses
+ * precision (|Z + dz| << |Z|) or outlives its reference is glitched; it is
+ * retried with references at the center of its 64, 16 and 4 pixel cell and
+ * finally computed directly in T. References only depend on the cell, so
+ * the result of a point does not depend on the order of computation. The
+ * references kept hold at most MJ_PERTURB_MAX_POINTS orbit points, past it
+ * the least recently used ones are dropped and computed again if their cell
+ * is needed again.
+ */
+
+#define MJ_PERTURB_LEVELS 3
+#define MJ_PERTURB_MAX_POINTS (1 << 24)
+#define MJ_PERTURB_GLITCH 1.0e-6
+
+/* the type of the deltas of perturbation in T */
+template<typename T>
+struct MJ_PerturbDelta {
+    typedef double type;
+};
+
+inline bool mj_has_exponent(double dummy)
+{
+    return false;
+}
+
+inline bool mj_has_exponent(MJ_FloatExp dummy)
+{
+    return true;
+}
+
+inline double mj_hypot(double x, double y)
+{
+    return hypot(x, y);
+}
+
+/* x 2^exp in T, a negative exp in steps that stay in the range of double */
+template<typename T>
+inline T mj_perturb_ldexp(T x, int64_t exp)
+{
+    for ( ; exp < -512; exp += 512)
+        x = x * T(0x1.0p-512);
+    return x * T(ldexp(1.0, int(exp)));
+}
+
+/* (Z + dz)^p - Z^p, expanded as sum of C(p,k) Z^(p-k) dz^k in Horner form */
+template<int P, typename D>
+inline void mj_perturb_pow(D &sx, D &sy, double Zx, double Zy, const D &dzx, const D &dzy)
+{
+    if (P == 2) {
+        mj_complex_mul(sx, sy, D(2.0 * Zx) + dzx, D(2.0 * Zy) + dzy, dzx, dzy);
+        return;
+    }
+
+    double px[P], py[P];
+    px[0] = 1.0, py[0] = 0.0;
+    for (int k = 1; k < P; k++)
+        mj_complex_mul(px[k], py[k], px[k-1], py[k-1], Zx, Zy);
+
+    double binom = 1.0;
+    D hx = D(0.0), hy = D(0.0);
+    for (int k = P; k >= 1; k--) {
+        /* binom = C(p, k) */
+        D tx, ty;
+        mj_complex_mul(tx, ty, hx, hy, dzx, dzy);
+        hx = tx + D(binom * px[P - k]);
+        hy = ty + D(binom * py[P - k]);
+        binom = binom * k / (P - k + 1);
+    }
+
+    mj_complex_mul(sx, sy, hx, hy, dzx, dzy);
+}
+
+/* mj_deriv_step with the derivative in D */
+template<int P, typename D>
+inline void mj_perturb_deriv_step(D &drx, D &dry, double zx, double zy, double e)
+{
+    double px, py;
+    D tx, ty;
+    mj_complex_pow<P - 1>(px, py, zx, zy);
+    mj_complex_mul(tx, ty, D(px), D(py), drx, dry);
+    drx = D(double(P)) * tx + D(e);
+    dry = D(double(P)) * ty;
+}
+
+struct MJ_PerturbRef {
+    double  ex, ey;
+    double  *zx, *zy;
+    int     len, size;
+
+    MJ_PerturbRef() : zx(NULL), zy(NULL), len(0), size(0) { }
+    ~MJ_PerturbRef() { delete[] zx; }
+
+    /* the orbit is stored as doubles, grown on demand as most references escape early */
+    void set(int k, double x, double y)
+    {
+        if (k >= size) {
+            int new_size = size ? 2 * size : 256;
+            double *ptr = new double[2 * new_size];
+            for (int n = 0; n < k; n++)
+                ptr[n] = zx[n], ptr[new_size + n] = zy[n];
+            delete[] zx;
+            zx = ptr, zy = ptr + new_size, size = new_size;
+        }
+        zx[k] = x, zy[k] = y;
+    }
+};
+
+inline int mj_is_julia(int julia_mode)
+{
+    return julia_mode == MJ_JULIA_MODE_JULIA_AT_0 || julia_mode == MJ_JULIA_MODE_JULIA_AT_C;
+}
+
+/* map a point offset into e space */
+template<int P>
+inline void mj_perturb_to_e(int julia_mode, double zx, double zy, double &ex, double &ey)
+{
+    _Complex double tmp;
+    switch (julia_mode) {
+    case MJ_JULIA_MODE_MANDELBROT:
+    case MJ_JULIA_MODE_JULIA_AT_0:
+        ex = zx, ey = zy;
+        break;
+    case MJ_JULIA_MODE_MANDELBROT_JULIA:
+        tmp = cpow(zx + I * zy, P);
+        ex = creal(tmp), ey = cimag(tmp);
+        break;
+    case MJ_JULIA_MODE_JULIA_AT_C:
+        tmp = cpow(zx + I * zy, 1.0 / P);
+        ex = creal(tmp), ey = cimag(tmp);
+        break;
+    default:
+        throw "invalid julia mode";
+    }
+}
+
+/* radius in e space of the disk holding all points within radius of the frame center */
+template<int P>
+inline double mj_perturb_e_radius(int julia_mode, double radius)
+{
+    if (julia_mode == MJ_JULIA_MODE_MANDELBROT_JULIA)
+        return pow(radius, P);
+    if (julia_mode == MJ_JULIA_MODE_JULIA_AT_C)
+        return pow(radius, 1.0 / P);
+    return radius;
+}
+
+/* what e space is scaled by when the point offsets are scaled by 2^scale */
+template<int P>
+inline MJ_FloatExp mj_perturb_e_scale(int julia_mode, int scale)
+{
+    if (julia_mode == MJ_JULIA_MODE_MANDELBROT_JULIA)
+        return mj_ldexp(MJ_FloatExp(1.0), -int64_t(scale) * P);
+    if (julia_mode == MJ_JULIA_MODE_JULIA_AT_C)
+        return mj_ldexp(MJ_FloatExp(exp2(-(scale % P) / double(P))), -(scale / P));
+    return mj_ldexp(MJ_FloatExp(1.0), -scale);
+}
+
+/*
+ * reference orbit of the point at (ex, ey) in e space, computed in T. If
+ * scale is not NULL, e space is scaled by it.
+ */
+template<int P, typename T>
+void mj_perturb_orbit(const MJ_CalcFrame<P, T>& frame, MJ_PerturbRef& ref, double ex, double ey,
+                      const T *scale = NULL)
+{
+    T cx = frame.cx, cy = frame.cy, zx = T(0.0), zy = T(0.0);
+    T fsq, sx, sy;
+    const T fsq_max = frame.fsq_max;
+    T tx = scale ? T(ex) * *scale : T(ex), ty = scale ? T(ey) * *scale : T(ey);
+
+    if (mj_is_julia(frame.julia_mode))
+        zx = tx, zy = ty;
+    else
+        cx = cx + tx, cy = cy + ty;
+
+    ref.ex = ex, ref.ey = ey;
+
+    int k;
+    for (k = 0; k < frame.max_iter; k++) {
+        ref.set(k, zx, zy);
+        mj_complex_pow<P>(sx, sy, zx, zy, &fsq);
+        if (fsq >= fsq_max)
+            break;
+        zx = sx + cx;
+        zy = sy + cy;
+    }
+
+    ref.set(k, zx, zy);
+    ref.len = k;
+}
+
+/*
+ * Series approximation: near the reference, dz_n is a polynomial in the
+ * offset d of the point in e space. The coefficients are stored scaled by
+ * the powers of radius, so the series is evaluated at u = d / radius and
+ * b[i] u^(i+1) is the largest possible size of the term. Iterations are
+ * skipped while the last term stays negligible, the points stay well away
+ * from the reference and none of them can have escaped yet. The
+ * coefficients are in D, radius is in the units of the offsets and
+ * true_radius the radius they stand for.
+ */
+#define MJ_SERIES_MAX_TERMS 16
+#define MJ_SERIES_TOL (1.0 / 4294967296.0)
+
+template<typename D>
+struct MJ_Series {
+    D       bx[MJ_SERIES_MAX_TERMS], by[MJ_SERIES_MAX_TERMS];
+    double  radius;
+    D       true_radius;
+    int     terms;
+    int     skip;
+    int     at_end;     /* skip reached the end of the reference, a longer one may skip more */
+
+    MJ_Series() : radius(0.0), true_radius(0.0), terms(0), skip(0), at_end(0) { }
+
+    template<int P>
+    void compute(const MJ_PerturbRef& ref, int is_julia, int _terms, double _radius, const D& scale,
+                 double fsq_max)
+    {
+        D curx[MJ_SERIES_MAX_TERMS], cury[MJ_SERIES_MAX_TERMS];
+        D nextx[MJ_SERIES_MAX_TERMS], nexty[MJ_SERIES_MAX_TERMS];
+        D pwx[MJ_SERIES_MAX_TERMS], pwy[MJ_SERIES_MAX_TERMS];
+        D tmpx[MJ_SERIES_MAX_TERMS], tmpy[MJ_SERIES_MAX_TERMS];
+        _Complex double zp[P], w;
+        D tx, ty;
+
+        terms = _terms, radius = _radius, skip = 0, at_end = 0;
+        true_radius = D(radius) * scale;
+        if (terms < 2 || terms > MJ_SERIES_MAX_TERMS || !(radius > 0.0))
+            return;
+        if (is_julia && mj_sqr(true_radius) >= D(fsq_max))
+            return;
+
+        for (int i = 0; i < terms; i++)
+            curx[i] = cury[i] = D(0.0);
+        if (is_julia)
+            curx[0] = true_radius;
+
+        for (int n = 0; n < ref.len; n++) {
+            /* next = sum C(p,j) Z^(p-j) cur^j, truncated to terms */
+            zp[0] = 1.0;
+            for (int j = 1; j < P; j++)
+                zp[j] = zp[j-1] * (ref.zx[n] + I * ref.zy[n]);
+
+            double binom = P;
+            w = binom * zp[P - 1];
+            for (int i = 0; i < terms; i++) {
+                pwx[i] = curx[i], pwy[i] = cury[i];
+                mj_complex_mul(nextx[i], nexty[i], D(creal(w)), D(cimag(w)), curx[i], cury[i]);
+            }
+
+            for (int j = 2; j <= P && j <= terms; j++) {
+                for (int i = 0; i < terms; i++) {
+                    tmpx[i] = tmpy[i] = D(0.0);
+                    for (int l = 0; l < i; l++) {
+                        mj_complex_mul(tx, ty, pwx[l], pwy[l], curx[i - 1 - l], cury[i - 1 - l]);
+                        tmpx[i] = tmpx[i] + tx, tmpy[i] = tmpy[i] + ty;
+                    }
+                }
+                binom = binom * (P - j + 1) / j;
+                w = binom * zp[P - j];
+                for (int i = 0; i < terms; i++) {
+                    pwx[i] = tmpx[i], pwy[i] = tmpy[i];
+                    mj_complex_mul(tx, ty, D(creal(w)), D(cimag(w)), pwx[i], pwy[i]);
+                    nextx[i] = nextx[i] + tx, nexty[i] = nexty[i] + ty;
+                }
+            }
+
+            if (!is_julia)
+                nextx[0] = nextx[0] + true_radius;
+
+            D bound = D(0.0);
+            for (int i = 0; i < terms; i++)
+                bound = bound + mj_hypot(nextx[i], nexty[i]);
+
+            double zabs = hypot(ref.zx[n+1], ref.zy[n+1]);
+            if (!(D(MJ_SERIES_TOL) * mj_hypot(nextx[0], nexty[0]) >= mj_hypot(nextx[terms - 1], nexty[terms - 1])) ||
+                bound >= D(0.5 * zabs) || mj_sqr(D(zabs) + bound) >= D(fsq_max))
+                break;
+
+            for (int i = 0; i < terms; i++) {
+                curx[i] = bx[i] = nextx[i];
+                cury[i] = by[i] = nexty[i];
+            }
+            skip = n + 1;
+        }
+        at_end = (skip > 0 && skip == ref.len);
+    }
+
+    inline void eval(double ex, double ey, D &dzx, D &dzy) const
+    {
+        D ux = D(ex / radius), uy = D(ey / radius), sx, sy;
+        dzx = dzy = D(0.0);
+        for (int i = terms - 1; i >= 0; i--) {
+            sx = dzx + bx[i], sy = dzy + by[i];
+            mj_complex_mul(dzx, dzy, sx, sy, ux, uy);
+        }
+    }
+
+    /* derivative of the series with respect to the point, for distance estimation */
+    inline void eval_deriv(double ex, double ey, D &drx, D &dry) const
+    {
+        D ux = D(ex / radius), uy = D(ey / radius), sx, sy;
+        drx = dry = D(0.0);
+        for (int i = terms - 1; i >= 0; i--) {
+            mj_complex_mul(sx, sy, drx, dry, ux, uy);
+            drx = sx + D(double(i + 1)) * bx[i];
+            dry = sy + D(double(i + 1)) * by[i];
+        }
+        drx = drx / true_radius;
+        dry = dry / true_radius;
+    }
+
+    void report(FILE *fp) const
+    {
+        fprintf(fp, "Series approx   : %d iterations skipped with %d terms\n", skip, terms);
+    }
+};
+
+/* the point offsets are scaled by 2^scale, only with a D that has the exponent for it */
+template<int P, typename T, typename D = double>
+class MJ_PerturbFrame : public MJ_CalcFrame<P, T> {
+public:
+    typedef std::shared_ptr<const MJ_PerturbRef> RefPtr;
+
+    MJ_PerturbFrame(T cx, T cy, int max_iter, int julia_mode, double pixel_width,
+                    int series_terms = 0, double radius = 0.0, int scale = 0) :
+        MJ_CalcFrame<P, T>(cx, cy, max_iter, julia_mode), m_nb_glitch(0), m_nb_direct(0),
+        m_nb_refs(0), m_nb_points(0), m_pixel_width(pixel_width), m_is_julia(mj_is_julia(julia_mode)),
+        m_scale(scale)
+    {
+        if (scale && !mj_has_exponent(D(0.0)))
+            throw "the view is too deep for the deltas of perturbation";
+
+        MJ_FloatExp e_scale = mj_perturb_e_scale<P>(julia_mode, scale);
+        int64_t exp;
+        double mant = mj_frexp(e_scale, &exp);
+        m_e_scale = D(e_scale);
+        m_e_scale_d = double(e_scale);
+        m_e_scale_t = mj_perturb_ldexp(T(mant), exp);
+
+        mj_perturb_orbit(*this, m_ref, 0.0, 0.0);
+        series.template compute<P>(m_ref, m_is_julia, series_terms, mj_perturb_e_radius<P>(julia_mode, radius),
+                                   m_e_scale, this->fsq_max);
+    }
+
+    /*
+     * return false if the point is glitched with this reference. If de is not
+     * NULL, the derivative of z is carried along in D for the distance
+     * estimate in e space.
+     */
+    bool calc(const MJ_PerturbRef& ref, double ex, double ey, double &result, double *de = NULL) const
+    {
+        D dcx = D(0.0), dcy = D(0.0), dzx = D(0.0), dzy = D(0.0);
+        D drx = D(this->deriv0), dry = D(0.0);
+        double cx = this->dcx, cy = this->dcy;
+        int k = 0;
+        if (m_is_julia) {
+            dzx = D(ex - ref.ex) * m_e_scale, dzy = D(ey - ref.ey) * m_e_scale;
+        } else {
+            dcx = D(ex - ref.ex) * m_e_scale, dcy = D(ey - ref.ey) * m_e_scale;
+            cx += ex * m_e_scale_d, cy += ey * m_e_scale_d;
+        }
+
+        if (&ref == &m_ref && series.skip) {
+            series.eval(ex, ey, dzx, dzy);
+            if (de)
+                series.eval_deriv(ex, ey, drx, dry);
+            k = series.skip;
+        }
+
+        for ( ; ; k++) {
+            double Zx = ref.zx[k], Zy = ref.zy[k];
+            double zx = Zx + double(dzx), zy = Zy + double(dzy);
+            double fsq = zx * zx + zy * zy;
+
+            if (k >= this->max_iter) {
+                result = MJ_INFINITY;
+                if (de)
+                    *de = 0.0;
+                return true;
+            }
+
+            if (fsq >= this->fsq_max) {
+                if (de)
+                    result = mj_calc_escape_de<P>(cx, cy, zx, zy, double(drx * m_e_scale), double(dry * m_e_scale),
+                                                  this->deriv_add * m_e_scale_d, k, this->max_iter, de);
+                else
+                    result = mj_calc_escape<P>(cx, cy, zx, zy, k, this->max_iter);
+                return true;
+            }
+
+            if (k >= ref.len || fsq < MJ_PERTURB_GLITCH * (Zx * Zx + Zy * Zy))
+                return false;
+
+            if (de)
+                mj_perturb_deriv_step<P>(drx, dry, zx, zy, this->deriv_add);
+
+            D sx, sy;
+            mj_perturb_pow<P>(sx, sy, Zx, Zy, dzx, dzy);
+            dzx = sx + dcx;
+            dzy = sy + dcy;
+        }
+    }
+
+    /*
+     * reference at the center of the level cell containing (zx, zy). The
+     * orbit is computed outside of the lock, when two threads need the same
+     * cell the second result is dropped. A dropped reference lives on while a
+     * thread still uses it.
+     */
+    RefPtr cell_ref(int level, double zx, double zy) const
+    {
+        double cell = m_pixel_width * (64 >> (2 * level - 2));
+        double ix = floor(zx / cell), iy = floor(zy / cell);
+        RefKey key(level, std::pair<double, double>(ix, iy));
+        {
+            std::lock_guard<std::mutex> guard(m_refs_lock);
+            typename RefMap::iterator it = m_refs.find(key);
+            if (it != m_refs.end()) {
+                m_order.splice(m_order.begin(), m_order, it->second.order);
+                return it->second.ref;
+            }
+        }
+
+        double ex, ey;
+        mj_perturb_to_e<P>(this->julia_mode, (ix + 0.5) * cell, (iy + 0.5) * cell, ex, ey);
+        MJ_PerturbRef *orbit = new MJ_PerturbRef;
+        mj_perturb_orbit(*this, *orbit, ex, ey, m_scale ? &m_e_scale_t : NULL);
+        RefPtr ref(orbit);
+
+        std::lock_guard<std::mutex> guard(m_refs_lock);
+        typename RefMap::iterator it = m_refs.find(key);
+        if (it != m_refs.end()) {
+            m_order.splice(m_order.begin(), m_order, it->second.order);
+            return it->second.ref;
+        }
+
+        while (!m_refs.empty() && m_nb_points + orbit->size > MJ_PERTURB_MAX_POINTS) {
+            it = m_refs.find(m_order.back());
+            m_nb_points -= it->second.ref->size;
+            m_refs.erase(it);
+            m_order.pop_back();
+        }
+
+        m_order.push_front(key);
+        RefEntry entry = {ref, m_order.begin()};
+        m_refs.insert(typename RefMap::value_type(key, entry));
+        m_nb_points += orbit->size;
+        m_nb_refs++;
+        return ref;
+    }
+
+    const MJ_PerturbRef& ref() const
+    {
+        return m_ref;
+    }
+
+    /* mandelbrot modes only, c given in e space */
+    bool is_interior_e(double ex, double ey) const
+    {
+        return this->is_interior(this->dcx + ex * m_e_scale_d, this->dcy + ey * m_e_scale_d);
+    }
+
+    /*
+     * a point computed in T from its offset in e space, as the points of a
+     * scaled view cannot go to mj_calc_batch. Its distance estimate would
+     * overflow double, so there is none.
+     */
+    double calc_direct(double ex, double ey) const
+    {
+        T tx = T(ex) * m_e_scale_t, ty = T(ey) * m_e_scale_t;
+        if (m_is_julia)
+            return MJ_CalcFrame<P, T>::calc(this->cx, this->cy, tx, ty, NULL);
+        return MJ_CalcFrame<P, T>::calc(this->cx + tx, this->cy + ty, T(0.0), T(0.0), NULL);
+    }
+
+    int is_scaled() const
+    {
+        return m_scale != 0;
+    }
+
+    void report(FILE *fp) const
+    {
+        if (series.terms)
+            series.report(fp);
+        fprintf(fp, "Perturbation    : %ld references, %ld glitched, %ld direct\n",
+                m_nb_refs + 1, m_nb_glitch, m_nb_direct);
+    }
+
+    MJ_Series<D> series;
+    mutable long m_nb_glitch;
+    mutable long m_nb_direct;
+
+private:
+    typedef std::pair<int, std::pair<double, double> > RefKey;
+
+    /* order lists the keys from the most recently used */
+    struct RefEntry {
+        RefPtr                              ref;
+        typename std::list<RefKey>::iterator order;
+    };
+
+    typedef std::map<RefKey, RefEntry> RefMap;
+
+    MJ_PerturbRef   m_ref;
+    mutable RefMap  m_refs;
+    mutable std::list<RefKey> m_order;
+    mutable std::mutex m_refs_lock;
+    mutable long    m_nb_refs;
+    mutable long    m_nb_points;
+    double          m_pixel_width;
+    int             m_is_julia;
+    int             m_scale;
+    /* what e space is scaled by */
+    D               m_e_scale;
+    double          m_e_scale_d;
+    T               m_e_scale_t;
+
+    MJ_PerturbFrame(const MJ_PerturbFrame&);
+    MJ_PerturbFrame& operator=(const MJ_PerturbFrame&);
+
+};
+
+/*
+ * The points are not continued, as the references depend on max_iter. The
+ * main reference of a larger max_iter is the same up to where this one ends,
+ * so a point that escaped against it keeps its result unless the series
+ * skip ran into that end: such points and the interior ones are done, the
+ * glitched and those out of iterations start over.
+ */
+template<int P, typename T, typename D>
+void mj_calc_batch(const MJ_PerturbFrame<P, T, D>& frame, const double *zx, const double *zy, double *result, int n,
+                   double *de = NULL, MJ_Orbit<T> *orbit = NULL)
+{
+    for (int k = 0; orbit && k < n; k++)
+        orbit[k].k = 0;
+
+    for (int k = 0; k < n; k++) {
+        double ex, ey;
+        double *_de = de ? de + k : NULL;
+        mj_perturb_to_e<P>(frame.julia_mode, zx[k], zy[k], ex, ey);
+        if (frame.is_interior_e(ex, ey)) {
+            result[k] = MJ_INFINITY;
+            if (_de)
+                *_de = 0.0;
+            if (orbit)
+                orbit[k].k = MJ_ORBIT_DONE;
+            continue;
+        }
+
+        int done = frame.calc(frame.ref(), ex, ey, result[k], _de);
+        if (done && orbit && result[k] < MJ_INFINITY && !frame.series.at_end)
+            orbit[k].k = MJ_ORBIT_DONE;
+        if (!done) {
+            mj_count(&frame.m_nb_glitch);
+            for (int level = 1; !done && level <= MJ_PERTURB_LEVELS; level++) {
+                typename MJ_PerturbFrame<P, T, D>::RefPtr ref = frame.cell_ref(level, zx[k], zy[k]);
+                done = ref && frame.calc(*ref, ex, ey, result[k], _de);
+            }
+        }
+
+        if (!done && frame.is_scaled()) {
+            mj_count(&frame.m_nb_direct);
+            result[k] = frame.calc_direct(ex, ey);
+            if (_de)
+                *_de = 0.0;
+        } else if (!done) {
+            mj_count(&frame.m_nb_direct);
+            mj_calc_batch(static_cast<const MJ_CalcFrame<P, T>&>(frame), zx + k, zy + k, result + k, 1, _de);
+        } else if (_de && *_de > 0.0) {
+            *_de *= mj_distance_scale<P>(frame.julia_mode, zx[k], zy[k]);
+        }
+    }
+}
+
+/* series approximation without perturbation, the remaining iterations are computed in T */
+template<int P, typename T>
+class MJ_SeriesFrame : public MJ_CalcFrame<P, T> {
+public:
+    MJ_SeriesFrame(T cx, T cy, int max_iter, int julia_mode, int series_terms, double radius) :
+        MJ_CalcFrame<P, T>(cx, cy, max_iter, julia_mode)
+    {
+        MJ_PerturbRef ref;
+        mj_perturb_orbit(*this, ref, 0.0, 0.0);
+        series.template compute<P>(ref, mj_is_julia(julia_mode), series_terms,
+                                   mj_perturb_e_radius<P>(julia_mode, radius), 1.0, this->fsq_max);
+
+        /* the reference at the skipped iteration is needed in full precision */
+        T fsq, sx, sy;
+        zx = zy = T(0.0);
+        for (int k = 0; k < series.skip; k++) {
+            mj_complex_pow<P>(sx, sy, zx, zy, &fsq);
+            zx = sx + cx;
+            zy = sy + cy;
+        }
+    }
+
+    void report(FILE *fp) const
+    {
+        series.report(fp);
+    }
+
+    MJ_Series<double>   series;
+    T                   zx, zy;
+};
+
+/*
+ * The points iterated from the skip are continued as those of MJ_CalcFrame,
+ * unless the skip ran into the end of the reference: a larger max_iter may
+ * then skip more, and their orbits say to start over.
+ */
+template<int P, typename T>
+void mj_calc_batch(const MJ_SeriesFrame<P, T>& frame, const double *zx, const double *zy, double *result, int n,
+                   double *de = NULL, MJ_Orbit<T> *orbit = NULL)
+{
+    if (!frame.series.skip) {
+        mj_calc_batch(static_cast<const MJ_CalcFrame<P, T>&>(frame), zx, zy, result, n, de, orbit);
+        return;
+    }
+
+    int is_julia = mj_is_julia(frame.julia_mode);
+    for (int k = 0; k < n; k++) {
+        double ex, ey, dzx, dzy, drx, dry;
+        mj_perturb_to_e<P>(frame.julia_mode, zx[k], zy[k], ex, ey);
+        if (frame.is_interior(frame.dcx + ex, frame.dcy + ey)) {
+            result[k] = MJ_INFINITY;
+            if (de)
+                de[k] = 0.0;
+            if (orbit)
+                orbit[k].k = MJ_ORBIT_DONE;
+            continue;
+        }
+
+        if (is_julia ? frame.is_outside(frame.dcx, frame.dcy, ex, ey) :
+            frame.is_outside(frame.dcx + ex, frame.dcy + ey, 0.0, 0.0)) {
+            mj_calc_batch(static_cast<const MJ_CalcFrame<P, T>&>(frame), zx + k, zy + k, result + k, 1,
+                          de ? de + k : NULL, orbit ? orbit + k : NULL);
+            continue;
+        }
+
+        MJ_Orbit<T> *_orbit = NULL;
+        if (orbit && frame.series.at_end)
+            orbit[k].k = 0;
+        else if (orbit)
+            _orbit = orbit + k;
+
+        frame.series.eval(ex, ey, dzx, dzy);
+        T _cx = is_julia ? frame.cx : frame.cx + T(ex);
+        T _cy = is_julia ? frame.cy : frame.cy + T(ey);
+        long periodic = 0;
+        if (!de) {
+            result[k] = mj_calc<P>(_cx, _cy, frame.zx + T(dzx), frame.zy + T(dzy),
+                                   frame.max_iter, frame.series.skip, &periodic, _orbit);
+            mj_count(&frame.nb_periodic, periodic);
+            continue;
+        }
+
+        frame.series.eval_deriv(ex, ey, drx, dry);
+        result[k] = mj_calc_de<P>(_cx, _cy, frame.zx + T(dzx), frame.zy + T(dzy), drx, dry, frame.deriv_add,
+                                  frame.max_iter, de + k, frame.series.skip, &periodic, _orbit);
+        mj_count(&frame.nb_periodic, periodic);
+        if (de[k] > 0.0)
+            de[k] *= mj_distance_scale<P>(frame.julia_mode, zx[k], zy[k]);
+    }
+}
+
+#endif
@@ -24,80 +24,134 @@
 #include "mj-surface.h"
 #include "mj-color.h"
 
-template<typename T>
-void mj_output_png(MJ_Surface<MJ_Color> const& surface, const char *filename, int multisample)
+/* average the multisample x multisample blocks of rows y to y + multisample - 1 into row */
+inline void mj_downsample_row(MJ_Surface<MJ_Color> const& surface, int y, int multisample, MJ_Color *row)
 {
-    float multiplier = 0.0f;
-    FILE *fp = NULL;
-    png_structp png_ptr = NULL;
-    png_infop info_ptr = NULL;
-    T *line = NULL;
+    for (int x = 0; x < surface.width(); x += multisample, row++) {
+        MJ_Color cbuf[16];
+        for (int idx = 0, dy = 0; dy < multisample; dy++)
+            for (int dx = 0; dx < multisample; dx++, idx++)
+                cbuf[idx] = surface(x + dx, y + dy);
+        *row = mj_color_average(cbuf, 1.0f, multisample*multisample);
+    }
+}
 
-    try {
-        if (typeid(T) == typeid(uint8_t))
-            multiplier = 255.0f;
+/* PNG written a row at a time, T is uint8_t or uint16_t */
+template<typename T>
+class MJ_PngWriter {
+public:
+    MJ_PngWriter(const char *filename, int width, int height) :
+        m_fp(NULL), m_png_ptr(NULL), m_info_ptr(NULL), m_line(NULL), m_width(width)
+    {
+        try {
+            m_multiplier = 0.0f;
+            if (typeid(T) == typeid(uint8_t))
+                m_multiplier = 255.0f;
+
+            if (typeid(T) == typeid(uint16_t))
+                m_multiplier = 65536.0f;
 
-        if (typeid(T) == typeid(uint16_t))
-            multiplier = 65536.0f;
+            if (m_multiplier == 0.0f)
+                throw "invalid type of mj_output_png";
 
-        if (multiplier == 0.0f)
-            throw "invalid type of mj_output_png";
+            m_fp = fopen(filename, "wb");
+            if (!m_fp)
+                throw "mj_output_png cannot open file";
 
-        fp = fopen(filename, "wb");
-        if (!fp)
-            throw "mj_output_png cannot open file";
+            m_png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            if (!m_png_ptr)
+                throw "png error of mj_output_png";
 
-        png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-        if (!png_ptr)
-            throw "png error of mj_output_png";
+            m_info_ptr = png_create_info_struct(m_png_ptr);
+            if (!m_info_ptr)
+                throw "png error of mj_output_png";
 
-        info_ptr = png_create_info_struct(png_ptr);
-        if (!info_ptr)
-            throw "png error of mj_output_png";
+            if (setjmp(png_jmpbuf(m_png_ptr)))
+                throw "png errot of mj_output_png";
+
+            png_init_io(m_png_ptr, m_fp);
+            png_set_filter(m_png_ptr, 0, PNG_ALL_FILTERS);
+            png_set_IHDR(m_png_ptr, m_info_ptr, width, height, 8 * sizeof(T),
+                         PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                         PNG_FILTER_TYPE_DEFAULT);
+            png_set_gAMA(m_png_ptr, m_info_ptr, 0.45455);
+            png_write_info(m_png_ptr, m_info_ptr);
+            png_set_swap(m_png_ptr);
+            m_line = new T[width * 3];
+        } catch (...) {
+            cleanup();
+            throw;
+        }
+    }
+
+    ~MJ_PngWriter()
+    {
+        cleanup();
+    }
+
+    void write_row(const MJ_Color *row)
+    {
+        T *cur = m_line;
+        for (int x = 0; x < m_width; x++, cur += 3) {
+            cur[0] = lrintf(m_multiplier * row[x].v[0]);
+            cur[1] = lrintf(m_multiplier * row[x].v[1]);
+            cur[2] = lrintf(m_multiplier * row[x].v[2]);
+        }
 
-        if (setjmp(png_jmpbuf(png_ptr)))
+        if (setjmp(png_jmpbuf(m_png_ptr)))
             throw "png errot of mj_output_png";
+        png_write_row(m_png_ptr, (png_bytep) m_line);
+    }
+
+    /* after the last row */
+    void finish()
+    {
+        if (setjmp(png_jmpbuf(m_png_ptr)))
+            throw "png errot of mj_output_png";
+        png_write_end(m_png_ptr, NULL);
+        cleanup();
+    }
+
+private:
+    void cleanup()
+    {
+        delete[] m_line, m_line = NULL;
+        if (m_info_ptr)
+            png_destroy_info_struct(m_png_ptr, &m_info_ptr);
+        if (m_png_ptr)
+            png_destroy_write_struct(&m_png_ptr, NULL);
+        if (m_fp)
+            fclose(m_fp), m_fp = NULL;
+    }
+
+    FILE        *m_fp;
+    png_structp m_png_ptr;
+    png_infop   m_info_ptr;
+    T           *m_line;
+    int         m_width;
+    float       m_multiplier;
 
-        png_init_io(png_ptr, fp);
-        png_set_filter(png_ptr, 0, PNG_ALL_FILTERS);
-        png_set_IHDR(png_ptr, info_ptr, surface.width() / multisample, surface.height() / multisample, 8 * sizeof(T),
-                     PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-                     PNG_FILTER_TYPE_DEFAULT);
-        png_set_gAMA(png_ptr, info_ptr, 0.45455);
-        png_write_info(png_ptr, info_ptr);
-        png_set_swap(png_ptr);
-        line = new T[surface.width() * 3 / multisample];
+    MJ_PngWriter(const MJ_PngWriter&);
+    MJ_PngWriter& operator=(const MJ_PngWriter&);
+};
 
+template<typename T>
+void mj_output_png(MJ_Surface<MJ_Color> const& surface, const char *filename, int multisample)
+{
+    MJ_PngWriter<T> png(filename, surface.width() / multisample, surface.height() / multisample);
+    MJ_Color *row = new MJ_Color[surface.width() / multisample];
+
+    try {
         for (int y = 0; y < surface.height(); y += multisample) {
-            T *cur = line;
-            for (int x = 0; x < surface.width(); x += multisample, cur += 3) {
-                MJ_Color cbuf[16];
-                for (int idx = 0, dy = 0; dy < multisample; dy++)
-                    for (int dx = 0; dx < multisample; dx++, idx++)
-                        cbuf[idx] = surface(x + dx, y + dy);
-                MJ_Color color = mj_color_average(cbuf, 1.0f, multisample*multisample);
-
-                cur[0] = lrintf(multiplier * color.v[0]);
-                cur[1] = lrintf(multiplier * color.v[1]);
-                cur[2] = lrintf(multiplier * color.v[2]);
-            }
-            png_write_row(png_ptr, (png_bytep) line);
+            mj_downsample_row(surface, y, multisample, row);
+            png.write_row(row);
         }
-
-        png_write_end(png_ptr, NULL);
-        delete[] line, line = NULL;
-        png_destroy_info_struct(png_ptr, &info_ptr);
-        png_destroy_write_struct(&png_ptr, NULL);
-        fclose(fp), fp = NULL;
+        png.finish();
     } catch (...) {
-        if (info_ptr)
-            png_destroy_info_struct(png_ptr, &info_ptr);
-        if (png_ptr)
-            png_destroy_write_struct(&png_ptr, NULL);
-        if (fp)
-            fclose(fp), fp = NULL;
+        delete[] row;
         throw;
     }
+    delete[] row;
 }
 
 #endif
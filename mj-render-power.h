@@ -0,0 +1,732 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_RENDER_POWER_H
+#define MJ_RENDER_POWER_H 1
+
+#include "mj-render.h"
+
+/*
+ * The render and the preview of every power for a type T, explicitly
+ * instantiated for each T by one of the mj-render-q*.cc files.
+ */
+
+template<typename T>
+static char *mj_printval_str(T v)
+{
+    char *str = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&str, &size);
+    if (!fp)
+        throw "open_memstream failed";
+    mj_printval(fp, v);
+    fclose(fp);
+    return str;
+}
+
+static void mj_preview_show(SDL_Window *window, MJ_Surface<MJ_Color> const& csurface)
+{
+    SDL_Surface *surface = SDL_GetWindowSurface(window);
+    uint32_t *line = (uint32_t *) surface->pixels;
+    int line_width = surface->pitch / sizeof(*line);
+    for (int y = 0; y < csurface.height(); y++, line += line_width)
+        for (int x  = 0; x < csurface.width(); x++)
+            line[x] = SDL_MapRGB(surface->format, lrintf(csurface(x,y).v[0] * 255.0f),
+                                 lrintf(csurface(x,y).v[1] * 255.0f), lrintf(csurface(x,y).v[2] * 255.0f));
+    SDL_UpdateWindowSurface(window);
+}
+
+/*
+ * The coarse levels of the render of rectangle k of the plan in the preview
+ * window, the pixels of its part of the image take the color of the level
+ * point above left of their source.
+ */
+class MJ_PreviewLevels : public MJ_RenderProgress {
+public:
+    MJ_PreviewLevels(SDL_Window *window, MJ_Surface<MJ_Color> const& csurface, MJ_ColorPalette const& color,
+                     double color_period, const MJ_SymmetryPlan& plan, int k) :
+        m_window(window), m_csurface(csurface), m_color(color), m_color_period(color_period),
+        m_plan(plan), m_rect(plan.rect(k))
+    {
+    }
+
+    void level(const MJ_Surface<double>& surface, int stride)
+    {
+        for (int y = 0; y < m_csurface.height(); y++) {
+            for (int x = 0; x < m_csurface.width(); x++) {
+                int sx, sy;
+                m_plan.source(x, y, sx, sy);
+                if (!m_rect.contains(sx, sy))
+                    continue;
+                double v = surface((sx - m_rect.x + 1) / stride * stride, (sy - m_rect.y + 1) / stride * stride);
+                m_csurface(x, y) = (v == MJ_INFINITY) ? m_color.infinity_color(0) :
+                                   m_color.color(v / m_color_period, 0);
+            }
+        }
+        mj_preview_show(m_window, m_csurface);
+        SDL_PumpEvents();
+        fprintf(stderr, " 1/%d", stride);
+        fflush(stderr);
+    }
+
+private:
+    SDL_Window                      *m_window;
+    MJ_Surface<MJ_Color> const&     m_csurface;
+    MJ_ColorPalette const&          m_color;
+    double                          m_color_period;
+    const MJ_SymmetryPlan&          m_plan;
+    const MJ_SymmetryRect&          m_rect;
+};
+
+/* the pixels rendered around a tile on each side, for the antialias at its sides */
+struct MJ_Halo {
+    int left, top, right, bottom;
+};
+
+/*
+ * csurface is the part at (offset_x, offset_y) of an image of full_width x full_height,
+ * field when not NULL gets the values its colors are made of at the same place.
+ * The points filled and guessed are added to nb_filled and nb_guessed. With
+ * clip, it is rendered as that part of a larger rectangle of the image.
+ * With halo, csurface has it around a tile, returns whether the tile is
+ * supersampled as in the image, or the rectangle with clip.
+ */
+template<typename Frame>
+static bool mj_render_frame(MJ_Surface<MJ_Color> const& csurface, MJ_ColorPalette const& color, const Frame& frame,
+                            double pixel_width, double antialias_threshold, double de_threshold,
+                            double de_fill, double guess, double color_period,
+                            MJ_ThreadPool& pool, int offset_x, int offset_y, int full_width, int full_height,
+                            MJ_RenderProgress *progress, MJ_RenderCache<typename Frame::scalar> *cache,
+                            MJ_Field *field, long *nb_filled, long *nb_guessed, const MJ_Halo *halo = NULL,
+                            const MJ_RenderClip *clip = NULL)
+{
+    MJ_Surface<double> dsurface(csurface.width() + 2, csurface.height() + 2);
+    MJ_Surface<double> *esurface = NULL;
+    double center_x = 0.5 * (full_width - 1) + 1 - offset_x;
+    double center_y = 0.5 * (full_height - 1) + 1 - offset_y;
+    double last_time, current_time;
+
+    last_time = mj_gettimeofday();
+    fprintf(stderr, "Rendering       :");
+    fflush(stderr);
+
+    if (de_threshold > 0.0 || de_fill > 0.0)
+        esurface = new MJ_Surface<double>(dsurface.width(), dsurface.height());
+
+    long nb_part_guessed = 0;
+    *nb_filled += mj_adaptive_render(pool, dsurface, frame, center_x, center_y, pixel_width, esurface, de_fill,
+                                     guess, &nb_part_guessed, progress, cache, offset_x, offset_y, clip);
+    *nb_guessed += nb_part_guessed;
+
+    current_time = mj_gettimeofday();
+    fprintf(stderr, " complete in %8.3f seconds.\n", current_time - last_time);
+    last_time = current_time;
+
+    std::vector<double> *samples = NULL;
+    if (field) {
+        for (int y = 0; y < csurface.height(); y++)
+            for (int x = 0; x < csurface.width(); x++)
+                field->set_value(offset_x + x, offset_y + y, dsurface(x + 1, y + 1));
+        samples = new std::vector<double>[dsurface.height()];
+    }
+
+    for (int pass = 0; ; pass++) {
+        fprintf(stderr, "Antialiasing    :");
+        fflush(stderr);
+
+        int modified = mj_antialias(pool, csurface, dsurface, color, frame, center_x, center_y, pixel_width,
+                                    antialias_threshold, color_period, pass,
+                                    (de_threshold > 0.0) ? esurface : NULL, de_threshold, samples);
+
+        current_time = mj_gettimeofday();
+        fprintf(stderr, " complete in %8.3f seconds.\n", current_time - last_time);
+        last_time = current_time;
+
+        if (!modified)
+            break;
+    }
+
+    if (field) {
+        for (int y = 1; y < dsurface.height() - 1; y++)
+            for (size_t k = 0; k < samples[y].size(); k += 9)
+                field->set_samples(offset_x + int(samples[y][k]) - 1, offset_y + y - 1, &samples[y][k + 1]);
+        delete[] samples;
+    }
+    delete esurface;
+
+    if (!halo)
+        return true;
+    int x = clip ? clip->x : offset_x, y = clip ? clip->y : offset_y;
+    int width = clip ? clip->width - 2 : full_width, height = clip ? clip->height - 2 : full_height;
+    int fixed = (x == 0 ? MJ_SIDE_LEFT : 0) | (y == 0 ? MJ_SIDE_TOP : 0) |
+                (x + csurface.width() == width ? MJ_SIDE_RIGHT : 0) |
+                (y + csurface.height() == height ? MJ_SIDE_BOTTOM : 0);
+    return mj_antialias_is_settled(csurface, dsurface, fixed, halo->left, halo->top,
+                                   csurface.width() - halo->left - halo->right,
+                                   csurface.height() - halo->top - halo->bottom);
+}
+
+/*
+ * A tile of the image at (offset_x, offset_y) rendered as the image renders
+ * it: the pixels are copies of those of the rectangles of plan, the parts of
+ * each rectangle they come from are rendered clipped from it, lines keeping
+ * the points outside for the next tiles. The pixels copied by each map of
+ * plan come from a part of their own, a band like the tile, so a strip of
+ * rows renders about its own pixels and not the box around all its sources.
+ * The pixels supersampled at the sides of a part depend on the interior
+ * pixels halved around it: a halo is rendered with it to decide them, twice
+ * as wide again while they chain out of it. The pixels of the parts rendered,
+ * halos included, are added to nb_rendered and the parts to nb_parts.
+ */
+template<typename Frame>
+static void mj_render_tile(MJ_Surface<MJ_Color> const& tsurface, MJ_ColorPalette const& color, const Frame& frame,
+                           double pixel_width, double antialias_threshold, double de_threshold,
+                           double de_fill, double guess, double color_period, const MJ_SymmetryPlan& plan,
+                           MJ_ThreadPool& pool, int offset_x, int offset_y, int full_width, int full_height,
+                           MJ_RenderLines& lines, long *nb_filled, long *nb_guessed, long *nb_rendered,
+                           int *nb_parts)
+{
+    for (int k = 0; k < plan.nb_rects(); k++) {
+        const MJ_SymmetryRect& rect = plan.rect(k);
+        /* left, top, right and bottom of the sources of each map */
+        int nb_maps = k ? 1 : plan.nb_maps() + 1;
+        std::vector<int> parts;
+        for (int j = 0; j < nb_maps; j++) {
+            int part[4] = {rect.x + rect.width, rect.y + rect.height, -1, -1};
+            parts.insert(parts.end(), part, part + 4);
+        }
+        for (int y = 0; y < tsurface.height(); y++) {
+            for (int x = 0; x < tsurface.width(); x++) {
+                int sx, sy;
+                int j = plan.source(offset_x + x, offset_y + y, sx, sy);
+                if (rect.contains(sx, sy)) {
+                    int *part = &parts[4 * j];
+                    part[0] = std::min(part[0], sx), part[1] = std::min(part[1], sy);
+                    part[2] = std::max(part[2], sx), part[3] = std::max(part[3], sy);
+                }
+            }
+        }
+
+        for (int j = 0; j < nb_maps; j++) {
+            int left = parts[4 * j], top = parts[4 * j + 1], right = parts[4 * j + 2], bottom = parts[4 * j + 3];
+            if (right < 0)
+                continue;
+
+            for (int width = 4; ; width *= 2) {
+                MJ_Halo halo = {
+                    std::min(width, left - rect.x), std::min(width, top - rect.y),
+                    std::min(width, rect.x + rect.width - 1 - right),
+                    std::min(width, rect.y + rect.height - 1 - bottom)
+                };
+                int x0 = left - halo.left, y0 = top - halo.top;
+                MJ_Surface<MJ_Color> hsurface(right + halo.right - x0 + 1, bottom + halo.bottom - y0 + 1);
+                MJ_RenderClip clip = {x0 - rect.x, y0 - rect.y, rect.width + 2, rect.height + 2, k, &lines};
+                *nb_rendered += long(hsurface.width()) * hsurface.height();
+                ++*nb_parts;
+                bool is_settled = mj_render_frame(hsurface, color, frame, pixel_width, antialias_threshold,
+                                                  de_threshold, de_fill, guess, color_period, pool, x0, y0,
+                                                  full_width, full_height, NULL, NULL, NULL, nb_filled,
+                                                  nb_guessed, &halo, &clip);
+                if (!is_settled) {
+                    fprintf(stderr, "Halo            : %d pixels are too few, rendering the tile again\n", width);
+                    continue;
+                }
+
+                for (int y = 0; y < tsurface.height(); y++) {
+                    for (int x = 0; x < tsurface.width(); x++) {
+                        int sx, sy;
+                        if (plan.source(offset_x + x, offset_y + y, sx, sy) == j && rect.contains(sx, sy))
+                            tsurface(x, y) = hsurface(sx - x0, sy - y0);
+                    }
+                }
+                break;
+            }
+        }
+    }
+}
+
+/* the counts of the render of frame, once for all the parts of the image */
+template<typename Frame>
+static void mj_render_report(const Frame& frame, double de_fill, double guess, long nb_filled, long nb_guessed)
+{
+    fprintf(stderr, "Interior test   : %ld points skipped\n", frame.nb_interior);
+    fprintf(stderr, "Periodicity     : %ld points stopped early\n", frame.nb_periodic);
+    if (de_fill > 0.0)
+        fprintf(stderr, "Distance fill   : %ld points interpolated\n", nb_filled);
+    if (guess > 0.0)
+        fprintf(stderr, "Guessing        : %ld points interpolated\n", nb_guessed);
+    if (frame.nb_checked)
+        fprintf(stderr, "Escalation      : %ld of %ld points recomputed in T (%.1f%%)\n",
+                frame.nb_escalated, frame.nb_checked, 100.0 * frame.nb_escalated / frame.nb_checked);
+}
+
+/*
+ * The whole image into csurface, or every tile of tiles: those the
+ * coordinator asks a shard worker for or the strips of -H. In one image, the
+ * rectangles of the plan are rendered and the rest is copied by symmetry.
+ * Tiles render the parts of the rectangles they copy, as mj_render_tile.
+ */
+template<typename Frame>
+static void mj_render_frames(MJ_Surface<MJ_Color> const& csurface, MJ_ColorPalette const& color, const Frame& frame,
+                             double pixel_width, double antialias_threshold, double de_threshold,
+                             double de_fill, double guess, double color_period, const MJ_SymmetryPlan& plan,
+                             MJ_ThreadPool& pool, MJ_TileSource *tiles, MJ_Field *field, SDL_Window *window,
+                             MJ_RenderCache<typename Frame::scalar> *cache)
+{
+    long nb_filled = 0, nb_guessed = 0;
+
+    if (!tiles) {
+        for (int k = 0; k < plan.nb_rects(); k++) {
+            const MJ_SymmetryRect& rect = plan.rect(k);
+            MJ_PreviewLevels levels(window, csurface, color, color_period, plan, k);
+            if (rect.width == csurface.width() && rect.height == csurface.height()) {
+                mj_render_frame(csurface, color, frame, pixel_width, antialias_threshold, de_threshold, de_fill,
+                                guess, color_period, pool, 0, 0, csurface.width(), csurface.height(),
+                                window ? &levels : NULL, cache, field, &nb_filled, &nb_guessed);
+                continue;
+            }
+
+            MJ_Surface<MJ_Color> tsurface(rect.width, rect.height);
+            mj_render_frame(tsurface, color, frame, pixel_width, antialias_threshold, de_threshold, de_fill,
+                            guess, color_period, pool, rect.x, rect.y, csurface.width(), csurface.height(),
+                            window ? &levels : NULL, cache, field, &nb_filled, &nb_guessed);
+            for (int y = 0; y < rect.height; y++)
+                for (int x = 0; x < rect.width; x++)
+                    csurface(rect.x + x, rect.y + y) = tsurface(x, y);
+        }
+        if (plan.nb_rendered() < long(csurface.width()) * csurface.height()) {
+            fprintf(stderr, "Symmetry        : %ld of %ld pixels rendered in %d parts\n", plan.nb_rendered(),
+                    long(csurface.width()) * csurface.height(), plan.nb_rects());
+            plan.fill(csurface);
+            if (field)
+                field->fill(plan);
+        }
+        mj_render_report(frame, de_fill, guess, nb_filled, nb_guessed);
+        return;
+    }
+
+    int m = tiles->multisample();
+    MJ_RenderLines lines;
+    MJ_ShardTile tile;
+    long nb_pixels = 0, nb_rendered = 0;
+    int nb_parts = 0;
+    while (tiles->next_tile(tile)) {
+        MJ_Surface<MJ_Color> tsurface(tile.width * m, tile.height * m);
+        fprintf(stderr, "Tile            : %d at %d, %d\n", tile.index, tile.x, tile.y);
+        mj_render_tile(tsurface, color, frame, pixel_width, antialias_threshold, de_threshold, de_fill, guess,
+                       color_period, plan, pool, tile.x * m, tile.y * m, tiles->width() * m, tiles->height() * m,
+                       lines, &nb_filled, &nb_guessed, &nb_rendered, &nb_parts);
+        tiles->write_tile(tile, tsurface);
+        nb_pixels += long(tsurface.width()) * tsurface.height();
+    }
+    /* the parts of the tiles with their halos, against the pixels of the tiles */
+    if (plan.nb_rendered() < long(tiles->width()) * tiles->height() * m * m)
+        fprintf(stderr, "Symmetry        : %ld of %ld pixels rendered in %d parts\n", nb_rendered, nb_pixels,
+                nb_parts);
+    mj_render_report(frame, de_fill, guess, nb_filled, nb_guessed);
+}
+
+/*
+ * -E is given up on a view too deep for double, where the points tried in
+ * double and computed again in T would cost more than computing them all in
+ * T, a try costing mj_double_cost of T. The points of a grid over the view
+ * stand for those the render computes around them: the pixel, and its 8
+ * antialias samples where it differs from the next pixels by the antialias
+ * threshold. Those are near the boundary, where points escalate the most.
+ * It is decided on the grid, not by the points rendered first, so that the
+ * image does not depend on the order, and the grid is left out of the counts
+ * reported.
+ */
+template<int P, typename T>
+static void mj_escalate_probe(MJ_CalcFrame<P, T>& frame, int width, int height, double pixel_width,
+                              double antialias_threshold)
+{
+    const int N = 16;
+    double total = 0.0, escalated = 0.0;
+
+    for (int j = 0; j < N; j++) {
+        for (int k = 0; k < N; k++) {
+            double x = ((k + 0.5) / N - 0.5) * width * pixel_width;
+            double y = (0.5 - (j + 0.5) / N) * height * pixel_width;
+            double zx[3] = {x, x + pixel_width, x}, zy[3] = {y, y, y - pixel_width};
+            double result[3];
+            long nb_escalated = frame.nb_escalated;
+            mj_calc_batch(frame, zx, zy, result, 3);
+            double weight = (fabs(result[1] - result[0]) >= antialias_threshold ||
+                             fabs(result[2] - result[0]) >= antialias_threshold) ? 9.0 : 1.0;
+            total += weight;
+            escalated += weight * (frame.nb_escalated - nb_escalated) / 3.0;
+        }
+    }
+
+    if (escalated > (1.0 - mj_double_cost(T(0))) * total) {
+        frame.escalate = 0;
+        fprintf(stderr, "Escalation      : given up, %.1f%% of the probe recomputed in T, too deep for double\n",
+                100.0 * escalated / total);
+    }
+    frame.nb_periodic = frame.nb_interior = frame.nb_checked = frame.nb_escalated = 0;
+}
+
+template<int P, typename T>
+static void mj_render(MJ_Surface<MJ_Color> const& csurface, MJ_ColorPalette const& color, T cx, T cy, double pixel_width,
+                      int scale, double antialias_threshold, double de_threshold, double de_fill, double guess,
+                      double color_period, int max_iter, int julia_mode, int perturbation, int series_terms,
+                      int escalate, int approx_symmetry, MJ_ThreadPool& pool, MJ_TileSource *tiles,
+                      MJ_Field *field, SDL_Window *window, MJ_RenderCache<T> *cache)
+{
+    int width = tiles ? tiles->width() * tiles->multisample() : csurface.width();
+    int height = tiles ? tiles->height() * tiles->multisample() : csurface.height();
+    /* farthest point computed, including the border and antialias samples */
+    double radius = pixel_width * hypot(0.5 * width + 1.5, 0.5 * height + 1.5);
+
+    /*
+     * The set is symmetric under (P - 1)-fold turns about 0, its julia sets
+     * at 0 under P-fold turns and those of a real c in the real axis. The
+     * views of the julia modes are centered on 0. The points of the pixels
+     * are only exact copies about the center of the view, where 0 is exactly
+     * in the mandelbrot modes. With approx_symmetry, an axis of the set
+     * within 1/256 of a pixel of the grid is used as well, the copies off
+     * by as much. A scaled view only has the axes through its center.
+     */
+    int turns = 1, is_mirror = (cy == T(0));
+    double symmetry_x = 0.5 * (width - 1), symmetry_y = 0.5 * (height - 1);
+    if (julia_mode == MJ_JULIA_MODE_MANDELBROT) {
+        turns = ((P - 1) % 4 == 0) ? 4 : ((P - 1) % 2 == 0) ? 2 : 1;
+        if (!approx_symmetry && !(cx == T(0) && cy == T(0)))
+            turns = 1;
+        is_mirror = approx_symmetry || cy == T(0);
+        symmetry_x -= scale ? ((cx == T(0)) ? 0.0 : HUGE_VAL) : double(cx) / pixel_width;
+        symmetry_y += scale ? ((cy == T(0)) ? 0.0 : HUGE_VAL) : double(cy) / pixel_width;
+    } else if (julia_mode == MJ_JULIA_MODE_JULIA_AT_0 || julia_mode == MJ_JULIA_MODE_MANDELBROT_JULIA) {
+        turns = (P % 4 == 0) ? 4 : (P % 2 == 0) ? 2 : 1;
+    }
+    MJ_SymmetryPlan plan(width, height, symmetry_x, symmetry_y, is_mirror, turns,
+                         approx_symmetry ? 1.0 / 256.0 : 0.0);
+
+    if (scale && !perturbation)
+        throw "the view is too deep without perturbation";
+
+    if (!perturbation && !series_terms) {
+        MJ_CalcFrame<P, T> frame(cx, cy, max_iter, julia_mode, escalate);
+        if (escalate)
+            mj_escalate_probe(frame, width, height, pixel_width, antialias_threshold);
+        mj_render_frames(csurface, color, frame, pixel_width, antialias_threshold, de_threshold, de_fill, guess,
+                         color_period, plan, pool, tiles, field, window, cache);
+        return;
+    }
+
+    double last_time = mj_gettimeofday();
+    fprintf(stderr, "Reference orbit :");
+    fflush(stderr);
+
+    if (!perturbation) {
+        MJ_SeriesFrame<P, T> frame(cx, cy, max_iter, julia_mode, series_terms, radius);
+
+        fprintf(stderr, " complete in %8.3f seconds.\n", mj_gettimeofday() - last_time);
+        mj_render_frames(csurface, color, frame, pixel_width, antialias_threshold, de_threshold, de_fill, guess,
+                         color_period, plan, pool, tiles, field, window, cache);
+        frame.report(stderr);
+        return;
+    }
+
+    MJ_PerturbFrame<P, T, typename MJ_PerturbDelta<T>::type> frame(cx, cy, max_iter, julia_mode, pixel_width,
+                                                                   series_terms, radius, scale);
+
+    fprintf(stderr, " complete in %8.3f seconds.\n", mj_gettimeofday() - last_time);
+    mj_render_frames(csurface, color, frame, pixel_width, antialias_threshold, de_threshold, de_fill, guess,
+                     color_period, plan, pool, tiles, field, window, cache);
+    frame.report(stderr);
+}
+
+/*
+ * Whether a center moved from from to to by shift leaves the points within
+ * 1/256 of a pixel of the grid they are kept on, the bits -q auto asks for
+ * below a pixel. T rounds the move and the points around to.
+ */
+template<typename T>
+static int mj_is_aligned(T from, T to, double shift, double pixel_width)
+{
+    double tolerance = pixel_width / 256.0;
+    return fabs(double(to - from) - shift) <= tolerance &&
+           fabs(double((to + T(tolerance)) - to) - tolerance) <= 0.5 * tolerance;
+}
+
+template<int P, typename T>
+static void mj_preview(MJ_Surface<MJ_Color> const& csurface, MJ_ColorPalette const& color, T cx, T cy, double pixel_width,
+                       double antialias_threshold, double de_threshold, double de_fill, double guess,
+                       double color_period, int max_iter, int julia_mode, int perturbation, int series_terms,
+                       int escalate, int approx_symmetry, MJ_ThreadPool& pool, MJ_PreviewState *state)
+{
+    if (!state->window) {
+        if (SDL_Init(SDL_INIT_VIDEO) == (-1))
+            throw SDL_GetError();
+
+        state->window = SDL_CreateWindow("mj-render-preview", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                         csurface.width(), csurface.height(), 0);
+        if (!state->window)
+            throw SDL_GetError();
+    }
+
+    int& is_locked = state->is_locked;
+    SDL_Window *window = state->window;
+    SDL_Surface *surface = SDL_GetWindowSurface(window);
+
+    /* the points of the view, raising max_iter continues them and moves keep those still on the grid */
+    MJ_RenderCache<T> cache(csurface.width() + 2, csurface.height() + 2);
+
+    for ( ; ; ) {
+        const char *julia_mode_name = "unknown";
+        switch (julia_mode) {
+        case MJ_JULIA_MODE_MANDELBROT:
+            julia_mode_name = is_locked ? "mandelbrot (locked)" : "mandelbrot (unlocked)";
+            break;
+        case MJ_JULIA_MODE_JULIA_AT_C:
+            julia_mode_name = "julia at c";
+            break;
+        case MJ_JULIA_MODE_JULIA_AT_0:
+            julia_mode_name = "julia at 0";
+            break;
+        case MJ_JULIA_MODE_MANDELBROT_JULIA:
+            julia_mode_name = "mandelbrot julia";
+            break;
+        }
+
+        SDL_FillRect(surface, 0, 0);
+        SDL_UpdateWindowSurface(window);
+        fprintf(stderr, "===============================================\n");
+        mj_render<P>(csurface, color, cx, cy, pixel_width, 0, antialias_threshold, de_threshold, de_fill, guess,
+                     color_period, max_iter, julia_mode, perturbation, series_terms, escalate, approx_symmetry,
+                     pool, NULL, NULL, window, &cache);
+        fprintf(stderr, "type = %s\n", julia_mode_name);
+        fprintf(stderr, "x    = "); mj_printval(stderr, cx); fprintf(stderr, "\n");
+        fprintf(stderr, "y    = "); mj_printval(stderr, cy); fprintf(stderr, "\n");
+        fprintf(stderr, "w    = %d\n", csurface.width());
+        fprintf(stderr, "h    = %d\n", csurface.height());
+        fprintf(stderr, "v    = %.13e\n", pixel_width * csurface.width());
+        fprintf(stderr, "t    = %.6f\n", antialias_threshold);
+        fprintf(stderr, "d    = %.6f\n", de_threshold);
+        fprintf(stderr, "e    = %.6f\n", de_fill);
+        fprintf(stderr, "g    = %.6f\n", guess);
+        fprintf(stderr, "p    = %.6f\n", color_period);
+        fprintf(stderr, "i    = %d\n", max_iter);
+        if (state->is_auto)
+            fprintf(stderr, "q    = auto (%d bits)\n", state->bits);
+        fprintf(stderr, "===============================================\n");
+
+        mj_preview_show(window, csurface);
+
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+            ;
+        for (int event_processed = 0 ; !event_processed; ) {
+            SDL_Delay(50);
+            SDL_UpdateWindowSurface(window);
+            while (!event_processed && SDL_PollEvent(&event)) {
+                double mul = 0.0;
+                if (event.type == SDL_QUIT) {
+                    SDL_Quit();
+                    state->bits = 0;
+                    return;
+                }
+                if (event.type != SDL_KEYUP)
+                    continue;
+
+                switch (event.key.keysym.sym) {
+                case SDLK_1:
+                    mul = 16.0;
+                    break;
+                case SDLK_2:
+                    mul = 4.0;
+                    break;
+                case SDLK_3:
+                    mul = 2.0;
+                    break;
+                case SDLK_4:
+                    mul = sqrt(2.0);
+                    break;
+                case SDLK_5:
+                    mul = 1.0;
+                    break;
+                case SDLK_6:
+                    mul = 1.0/sqrt(sqrt(2.0));
+                    break;
+                case SDLK_7:
+                    mul = 1.0/sqrt(2.0);
+                    break;
+                case SDLK_8:
+                    mul = 1.0/2.0;
+                    break;
+                case SDLK_9:
+                    mul = 1.0/4.0;
+                    break;
+                case SDLK_0:
+                    mul = 1.0/16.0;
+                    break;
+                case SDLK_a:
+                    mul = -1.0;
+                    break;
+                case SDLK_s:
+                    mul = -2.0;
+                    break;
+                case SDLK_d:
+                    mul = -3.0;
+                    break;
+                case SDLK_f:
+                    mul = -4.0;
+                    break;
+                case SDLK_g:
+                    mul = -5.0;
+                    break;
+                case SDLK_h:
+                    mul = -6.0;
+                    break;
+                case SDLK_m:
+                    mul = MJ_JULIA_MODE_MANDELBROT - 100.0;
+                    break;
+                case SDLK_j:
+                    mul = MJ_JULIA_MODE_JULIA_AT_0 - 100.0;
+                    break;
+                case SDLK_k:
+                    mul = MJ_JULIA_MODE_JULIA_AT_C - 100.0;
+                    break;
+                case SDLK_n:
+                    mul = MJ_JULIA_MODE_MANDELBROT_JULIA - 100.0;
+                    break;
+                case SDLK_l:
+                    mul = -1000.0;
+                    break;
+                case SDLK_ESCAPE:
+                    SDL_Quit();
+                    state->bits = 0;
+                    return;
+                }
+
+                if (mul != 0.0)
+                    event_processed = 1;
+
+                if (mul > 0.0) {
+                    double shift_x = 0.0, shift_y = 0.0;
+                    int is_aligned = 1;
+                    if (julia_mode == MJ_JULIA_MODE_MANDELBROT && mul <= 1.0 && !is_locked) {
+                        int mx, my;
+                        SDL_GetMouseState(&mx, &my);
+                        /* the point of the pixel under the mouse stays a point, a side of even size has none */
+                        shift_x = mx - csurface.width()/2 + ((csurface.width() % 2) ? 0.0 : 0.5 - 0.5 * mul);
+                        shift_y = my - csurface.height()/2 + ((csurface.height() % 2) ? 0.0 : 0.5 - 0.5 * mul);
+                        T x = cx + T(shift_x * pixel_width), y = cy - T(shift_y * pixel_width);
+                        is_aligned = mj_is_aligned(cx, x, shift_x * pixel_width, mul * pixel_width) &&
+                                     mj_is_aligned(cy, y, -shift_y * pixel_width, mul * pixel_width);
+                        cx = x, cy = y;
+                    }
+                    if (is_aligned)
+                        cache.move(0.5 * (csurface.width() - 1) + 1, 0.5 * (csurface.height() - 1) + 1,
+                                   shift_x, shift_y, mul);
+                    else
+                        cache.reset();
+                    pixel_width *= mul;
+                }
+
+                if (mul == -1.0)
+                    max_iter = (max_iter > 8*1024*1024) ? 16*1024*1024 : 2*max_iter;
+
+                if (mul == -2.0)
+                    max_iter = (max_iter < 512) ? 256 : max_iter/2;
+
+                if (mul == -3.0)
+                    color_period = (color_period > 8192.0) ? 16384.0 : 2.0*color_period;
+
+                if (mul == -4.0)
+                    color_period = (color_period < 2.0) ? 1.0 : 0.5*color_period;
+
+                if (mul == -5.0)
+                    antialias_threshold = (antialias_threshold > 4096.0) ? 8192.0 : 2.0*antialias_threshold;
+
+                if (mul == -6.0)
+                    antialias_threshold = (antialias_threshold < 0.125) ? 0.06125 : 0.5*antialias_threshold;
+
+                if (mul == -1000.0)
+                    is_locked = !is_locked;
+
+                if (mul == MJ_JULIA_MODE_MANDELBROT - 100.0 || mul == MJ_JULIA_MODE_JULIA_AT_0 - 100.0 ||
+                    mul == MJ_JULIA_MODE_JULIA_AT_C - 100.0 || mul == MJ_JULIA_MODE_MANDELBROT_JULIA - 100.0) {
+                    int new_mode = int(mul + 100.0);
+                    if ((new_mode == MJ_JULIA_MODE_MANDELBROT || new_mode == MJ_JULIA_MODE_JULIA_AT_C) &&
+                        (julia_mode == MJ_JULIA_MODE_JULIA_AT_0 || julia_mode == MJ_JULIA_MODE_MANDELBROT_JULIA))
+                        pixel_width = pow(pixel_width * 0.25 * csurface.width(), P) / (0.25 * csurface.width());
+                    if ((julia_mode == MJ_JULIA_MODE_MANDELBROT || julia_mode == MJ_JULIA_MODE_JULIA_AT_C) &&
+                        (new_mode == MJ_JULIA_MODE_JULIA_AT_0 || new_mode == MJ_JULIA_MODE_MANDELBROT_JULIA))
+                        pixel_width = pow(pixel_width * 0.25 * csurface.width(), 1.0/P) / (0.25 * csurface.width());
+                    julia_mode = new_mode;
+                    cache.reset();
+                }
+            }
+        }
+
+        if (state->is_auto) {
+            int bits = mj_auto_bits(pixel_width, 0, fmax(fabs(double(cx)), fabs(double(cy))), max_iter);
+            if (bits != state->bits) {
+                free(state->cx_str);
+                free(state->cy_str);
+                state->cx_str = mj_printval_str(cx);
+                state->cy_str = mj_printval_str(cy);
+                state->bits = bits;
+                state->pixel_width = pixel_width;
+                state->antialias_threshold = antialias_threshold;
+                state->color_period = color_period;
+                state->max_iter = max_iter;
+                state->julia_mode = julia_mode;
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * every power from MJ_MIN_POWER to MJ_MAX_POWER is instantiated, the runtime power selects one,
+ * preview is NULL to render, tiles is not NULL in a shard worker or with -H,
+ * field is not NULL with -f
+ */
+template<typename T, int P>
+void mj_power_select(int power, MJ_PreviewState *preview, MJ_Surface<MJ_Color> const& csurface,
+                     MJ_ColorPalette const& color, T cx, T cy, double pixel_width, int scale,
+                     double antialias_threshold, double de_threshold, double de_fill, double guess,
+                     double color_period, int max_iter, int julia_mode, int perturbation,
+                     int series_terms, int escalate, int approx_symmetry, MJ_ThreadPool& pool,
+                     MJ_TileSource *tiles, MJ_Field *field)
+{
+    if (power != P) {
+        if constexpr (P > MJ_MIN_POWER)
+            mj_power_select<T, P - 1>(power, preview, csurface, color, cx, cy, pixel_width, scale,
+                                      antialias_threshold, de_threshold, de_fill, guess, color_period,
+                                      max_iter, julia_mode, perturbation, series_terms, escalate,
+                                      approx_symmetry, pool, tiles, field);
+        else
+            throw "unreached";
+        return;
+    }
+
+    if (preview)
+        mj_preview<P>(csurface, color, cx, cy, pixel_width, antialias_threshold, de_threshold, de_fill, guess,
+                      color_period, max_iter, julia_mode, perturbation, series_terms, escalate, approx_symmetry,
+                      pool, preview);
+    else
+        mj_render<P, T>(csurface, color, cx, cy, pixel_width, scale, antialias_threshold, de_threshold, de_fill, guess,
+                        color_period, max_iter, julia_mode, perturbation, series_terms, escalate, approx_symmetry,
+                        pool, tiles, field, NULL, NULL);
+}
+
+#endif
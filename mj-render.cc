@@ -15,263 +15,47 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <math.h>
-#include <string.h>
-#include <sys/time.h>
-#include <SDL2/SDL.h>
-#include "mj-calc.h"
-#include "mj-adaptive-render.h"
-#include "mj-antialias.h"
-#include "mj-parseval.h"
-#include "mj-color.h"
-#include "mj-f128.h"
-#include "mj-fixed.h"
-#include "mj-png.h"
-
-inline double mj_gettimeofday()
-{
-    timeval tbuf;
-    gettimeofday(&tbuf, NULL);
-    return tbuf.tv_sec + 1e-6 * tbuf.tv_usec;
-}
+#include "mj-render.h"
 
-template<typename T>
-static void mj_render(MJ_Surface<MJ_Color> const& csurface, MJ_ColorPalette const& color, T cx, T cy, double pixel_width,
-                      double antialias_threshold, double color_period, int max_iter, int julia_mode)
+/*
+ * The width of a pixel of a view, parsed in long double to reach past the
+ * range of double. Below the 2^-960 that the other fixed types resolve, it
+ * is scaled by 2^scale into the range of double, and the offsets of the
+ * points with it: only perturbation in MJ_FloatExp takes such a view.
+ */
+static double mj_pixel_width(const char *view_str, int width, int *scale)
 {
-    int is_sym = (julia_mode == MJ_JULIA_MODE_JULIA_AT_0 || julia_mode == MJ_JULIA_MODE_MANDELBROT_JULIA);
-    is_sym = is_sym && (MJ_MANDELBROT_POWER % 2 == 0);
-    int is_mirror = (cy == T(0));
-    MJ_Surface<double> dsurface(csurface.width() + 2,
-                                (is_sym || is_mirror) ? (csurface.height() + 1) / 2 + 2 :
-                                csurface.height()+ 2);
-    double center_x = 0.5 * (csurface.width() - 1) + 1;
-    double center_y = 0.5 * (csurface.height() - 1) + 1;
-    double last_time, current_time;
-
-    last_time = mj_gettimeofday();
-    fprintf(stderr, "Rendering       :");
-    fflush(stderr);
-
-    mj_adaptive_render(dsurface, cx, cy, center_x, center_y, pixel_width, max_iter, julia_mode);
-
-    current_time = mj_gettimeofday();
-    fprintf(stderr, " complete in %8.3f seconds.\n", current_time - last_time);
-    last_time = current_time;
-
-    for (int pass = 0; ; pass++) {
-        fprintf(stderr, "Antialiasing    :");
-        fflush(stderr);
-
-        int modified = mj_antialias(csurface, dsurface, color, cx, cy, center_x, center_y, pixel_width,
-                                    antialias_threshold, color_period, pass, max_iter, julia_mode);
-
-        current_time = mj_gettimeofday();
-        fprintf(stderr, " complete in %8.3f seconds.\n", current_time - last_time);
-        last_time = current_time;
-
-        if (!modified)
-            break;
-    }
-
-    if (is_sym || is_mirror) {
-        for (int y0 = 0, y1 = csurface.height() - 1; y0 < y1; y0++, y1--)
-            for (int x = 0; x < csurface.width(); x++)
-                csurface(x, y1) = csurface(is_sym ? (csurface.width() - 1 - x) : x, y0);
-    }
+    long double view = mj_parseval<long double>(view_str, 1.0e-580L, 10000.0L);
+    *scale = 0;
+    if (view / width >= 0x1.0p-960L)
+        return mj_parseval<double>(view_str) / width;
+    *scale = -ilogbl(view / width);
+    return ldexpl(view / width, *scale);
 }
 
-template<typename T>
-static void mj_preview(MJ_Surface<MJ_Color> const& csurface, MJ_ColorPalette const& color, T cx, T cy, double pixel_width,
-                       double antialias_threshold, double color_period, int max_iter, int julia_mode)
+/*
+ * -q auto: the cheapest type that resolves 8 bits below a pixel, plus half
+ * a bit per doubling of max_iter for the rounding errors collected along the
+ * orbit. Orbit values stay below 2 until they escape, floating types count
+ * their fraction bits from there or from a larger center. The types are in
+ * the order of their measured cost.
+ */
+int mj_auto_bits(double pixel_width, int scale, double center, int max_iter)
 {
-    if (SDL_Init(SDL_INIT_VIDEO) == (-1))
-        throw SDL_GetError();
-
-    int is_locked = 0;
-    SDL_Window *window = SDL_CreateWindow("mj-render-preview", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-                                          csurface.width(), csurface.height(), 0);
-    if (!window)
-        throw SDL_GetError();
-
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
-
-    for ( ; ; ) {
-        const char *julia_mode_name = "unknown";
-        switch (julia_mode) {
-        case MJ_JULIA_MODE_MANDELBROT:
-            julia_mode_name = is_locked ? "mandelbrot (locked)" : "mandelbrot (unlocked)";
-            break;
-        case MJ_JULIA_MODE_JULIA_AT_C:
-            julia_mode_name = "julia at c";
-            break;
-        case MJ_JULIA_MODE_JULIA_AT_0:
-            julia_mode_name = "julia at 0";
-            break;
-        case MJ_JULIA_MODE_MANDELBROT_JULIA:
-            julia_mode_name = "mandelbrot julia";
-            break;
-        }
-
-        SDL_FillRect(surface, 0, 0);
-        SDL_UpdateWindowSurface(window);
-        fprintf(stderr, "===============================================\n");
-        mj_render(csurface, color, cx, cy, pixel_width, antialias_threshold,
-                  color_period, max_iter, julia_mode);
-        fprintf(stderr, "type = %s\n", julia_mode_name);
-        fprintf(stderr, "x    = "); mj_printval(stderr, cx); fprintf(stderr, "\n");
-        fprintf(stderr, "y    = "); mj_printval(stderr, cy); fprintf(stderr, "\n");
-        fprintf(stderr, "w    = %d\n", csurface.width());
-        fprintf(stderr, "h    = %d\n", csurface.height());
-        fprintf(stderr, "v    = %.13e\n", pixel_width * csurface.width());
-        fprintf(stderr, "t    = %.6f\n", antialias_threshold);
-        fprintf(stderr, "p    = %.6f\n", color_period);
-        fprintf(stderr, "i    = %d\n", max_iter);
-        fprintf(stderr, "===============================================\n");
-
-        uint32_t *line = (uint32_t *) surface->pixels;
-        int line_width = surface->pitch / sizeof(*line);
-        for (int y = 0; y < csurface.height(); y++, line += line_width)
-            for (int x  = 0; x < csurface.width(); x++)
-                line[x] = SDL_MapRGB(surface->format, lrintf(csurface(x,y).v[0] * 255.0f),
-                                     lrintf(csurface(x,y).v[1] * 255.0f), lrintf(csurface(x,y).v[2] * 255.0f));
-
-        SDL_Event event;
-        while (SDL_PollEvent(&event))
-            ;
-        for (int event_processed = 0 ; !event_processed; ) {
-            SDL_Delay(50);
-            SDL_UpdateWindowSurface(window);
-            while (!event_processed && SDL_PollEvent(&event)) {
-                double mul = 0.0;
-                if (event.type == SDL_QUIT) {
-                    SDL_Quit();
-                    return;
-                }
-                if (event.type != SDL_KEYUP)
-                    continue;
-
-                switch (event.key.keysym.sym) {
-                case SDLK_1:
-                    mul = 16.0;
-                    break;
-                case SDLK_2:
-                    mul = 4.0;
-                    break;
-                case SDLK_3:
-                    mul = 2.0;
-                    break;
-                case SDLK_4:
-                    mul = sqrt(2.0);
-                    break;
-                case SDLK_5:
-                    mul = 1.0;
-                    break;
-                case SDLK_6:
-                    mul = 1.0/sqrt(sqrt(2.0));
-                    break;
-                case SDLK_7:
-                    mul = 1.0/sqrt(2.0);
-                    break;
-                case SDLK_8:
-                    mul = 1.0/2.0;
-                    break;
-                case SDLK_9:
-                    mul = 1.0/4.0;
-                    break;
-                case SDLK_0:
-                    mul = 1.0/16.0;
-                    break;
-                case SDLK_a:
-                    mul = -1.0;
-                    break;
-                case SDLK_s:
-                    mul = -2.0;
-                    break;
-                case SDLK_d:
-                    mul = -3.0;
-                    break;
-                case SDLK_f:
-                    mul = -4.0;
-                    break;
-                case SDLK_g:
-                    mul = -5.0;
-                    break;
-                case SDLK_h:
-                    mul = -6.0;
-                    break;
-                case SDLK_m:
-                    mul = MJ_JULIA_MODE_MANDELBROT - 100.0;
-                    break;
-                case SDLK_j:
-                    mul = MJ_JULIA_MODE_JULIA_AT_0 - 100.0;
-                    break;
-                case SDLK_k:
-                    mul = MJ_JULIA_MODE_JULIA_AT_C - 100.0;
-                    break;
-                case SDLK_n:
-                    mul = MJ_JULIA_MODE_MANDELBROT_JULIA - 100.0;
-                    break;
-                case SDLK_l:
-                    mul = -1000.0;
-                    break;
-                case SDLK_ESCAPE:
-                    SDL_Quit();
-                    return;
-                }
-
-                if (mul != 0.0)
-                    event_processed = 1;
-
-                if (mul > 0.0) {
-                    if (julia_mode == MJ_JULIA_MODE_MANDELBROT && mul <= 1.0 && !is_locked) {
-                        int mx, my;
-                        SDL_GetMouseState(&mx, &my);
-                        mx = mx - csurface.width()/2;
-                        my = csurface.height()/2 - my;
-                        cx = cx + T(mx * pixel_width);
-                        cy = cy + T(my * pixel_width);
-                    }
-                    pixel_width *= mul;
-                }
-
-                if (mul == -1.0)
-                    max_iter = (max_iter > 8*1024*1024) ? 16*1024*1024 : 2*max_iter;
-
-                if (mul == -2.0)
-                    max_iter = (max_iter < 512) ? 256 : max_iter/2;
-
-                if (mul == -3.0)
-                    color_period = (color_period > 8192.0) ? 16384.0 : 2.0*color_period;
-
-                if (mul == -4.0)
-                    color_period = (color_period < 2.0) ? 1.0 : 0.5*color_period;
-
-                if (mul == -5.0)
-                    antialias_threshold = (antialias_threshold > 4096.0) ? 8192.0 : 2.0*antialias_threshold;
-
-                if (mul == -6.0)
-                    antialias_threshold = (antialias_threshold < 0.125) ? 0.06125 : 0.5*antialias_threshold;
-
-                if (mul == -1000.0)
-                    is_locked = !is_locked;
-
-                if (mul == MJ_JULIA_MODE_MANDELBROT - 100.0 || mul == MJ_JULIA_MODE_JULIA_AT_0 - 100.0 ||
-                    mul == MJ_JULIA_MODE_JULIA_AT_C - 100.0 || mul == MJ_JULIA_MODE_MANDELBROT_JULIA - 100.0) {
-                    int new_mode = int(mul + 100.0);
-                    if ((new_mode == MJ_JULIA_MODE_MANDELBROT || new_mode == MJ_JULIA_MODE_JULIA_AT_C) &&
-                        (julia_mode == MJ_JULIA_MODE_JULIA_AT_0 || julia_mode == MJ_JULIA_MODE_MANDELBROT_JULIA))
-                        pixel_width = pow(pixel_width * 0.25 * csurface.width(), MJ_MANDELBROT_POWER) / (0.25 * csurface.width());
-                    if ((julia_mode == MJ_JULIA_MODE_MANDELBROT || julia_mode == MJ_JULIA_MODE_JULIA_AT_C) &&
-                        (new_mode == MJ_JULIA_MODE_JULIA_AT_0 || new_mode == MJ_JULIA_MODE_MANDELBROT_JULIA))
-                        pixel_width = pow(pixel_width * 0.25 * csurface.width(), 1.0/MJ_MANDELBROT_POWER) / (0.25 * csurface.width());
-                    julia_mode = new_mode;
-                }
-            }
-        }
+    static const struct { int bits, mantissa, fraction; } list[] = {
+        { 64, 53, 0 }, { 80, 64, 0 }, { 106, 106, 0 }, { 128, 0, 120 }, { 256, 0, 192 },
+        { 384, 0, 320 }, { 512, 0, 448 }, { 768, 0, 704 }, { 1024, 0, 960 }, { 2048, 0, 1984 }
+    };
+    const int count = sizeof(list) / sizeof(list[0]);
+    double need = 8.0 - log2(pixel_width) + scale + 0.5 * log2(max_iter);
+    double exponent = ceil(log2(fmax(fabs(center), 2.0)));
+
+    for (int k = 0; k < count; k++) {
+        double have = list[k].mantissa ? list[k].mantissa - 1 - exponent : list[k].fraction;
+        if (have >= need)
+            return list[k].bits;
     }
+    return list[count - 1].bits;
 }
 
 static void print_help()
@@ -285,15 +69,35 @@ static void print_help()
     "  -w width\n"
     "  -h height\n"
     "  -i iteration\n"
-    "  -v width view\n"
+    "  -v width view (down to 1e-580, the views past 1024 bits need -q p2048)\n"
     "  -x center x\n"
     "  -y center y\n"
     "  -p color period\n"
     "  -t antialias threshold\n"
+    "  -d antialias by distance estimate below this many pixels (0 to use -t)\n"
+    "  -e interpolate boxes farther from the set than this many diagonals (0 to disable, >= 1)\n"
+    "  -g guess boxes whose border and samples are within this many iterations (0 to disable)\n"
     "  -m global multisample antialias\n"
     "  -r radius of julia set (also switch to render julia-at-0)\n"
     "  -a angle of julia set (also switch to render julia-at-0)\n"
-    "  -q computation bits (64, 80, 128, 256, 384, 512, 768, 1024)\n"
+    "  -q computation bits (64, 80, 106, 128, 256, 384, 512, 768, 1024, 2048)\n"
+    "     or floatexp for double with extended exponent, no more precise than 64\n"
+    "     or auto for the cheapest one that resolves the view\n"
+    "     prefix with p (e.g. p256) to use perturbation for deep zoom\n"
+    "     106 is a pair of doubles, 128 and up are fixed point\n"
+    "  -s series approximation terms (0 to disable, 2 to 16)\n"
+    "  -E compute points in double first, only those it cannot vouch for in -q (0, 1)\n"
+    "  -Y also copy by the symmetries about a center within 1/256 pixel of the grid (0, 1)\n"
+    "  -T threads per process (0 for the processors, divided among the workers of -W)\n"
+    "  -W render tiles in this many worker processes and merge them (0 to disable)\n"
+    "  -S tile size of -W in output pixels\n"
+    "  -X start each worker of -W by this shell command on its stdin and stdout instead of forking\n"
+    "  -M be a worker of -W on stdin and stdout for the tiles of this manifest (<output>.tiles),\n"
+    "     with the options of the view and without -o -w -h -m\n"
+    "  -f also write the iteration field to this file, for -F\n"
+    "  -F color the iteration field of this file written by -f, with -c -C -p -b -T, instead of rendering\n"
+    "  -H render strips of this many output rows, each written to the png as the next renders (0 to disable)\n"
+    "  -P power of z (2 to 16)\n"
     "  -b png bits (8, 16)\n"
     "  -j julia mode (julia-at-c, julia-at-0, mandelbrot-julia)\n");
 }
@@ -305,18 +109,34 @@ int main(int argc, char **argv)
         const char *cy_str = "0";
         int width = 640, height = 480;
         int max_iter = 1024;
-        double width_view = 4.0;
+        const char *view_str = "4";
         double color_period = 64.0;
         double radius = 0.0;
         double angle = 0.0;
         double antialias_threshold = 3.0;
+        double de_threshold = 0.0;
+        double de_fill = 0.0;
+        double guess = 0.0;
         int julia_mode = MJ_JULIA_MODE_MANDELBROT;
         int computation_bits = 64;
+        int perturbation = 0;
+        int series_terms = 0;
+        int escalate = 0;
+        int approx_symmetry = 0;
+        int nb_threads = 0;
+        int nb_workers = 0;
+        const char *worker_command = NULL;
+        const char *manifest_filename = NULL;
+        int tile_size = 256;
+        int strip_height = 0;
+        int power = 2;
         int png_bits = 8;
         int multisample = 1;
         double color_offset = 0.0;
         const char *filename = NULL;
         const char *palette_filename = NULL;
+        const char *field_filename = NULL;
+        const char *recolor_filename = NULL;
 
         if ((argc - 1) % 2)
             throw "invalid argument";
@@ -335,7 +155,7 @@ int main(int argc, char **argv)
                 max_iter = mj_parseval<int>(argv[k+1], 16, 1024*1024*16);
                 break;
             case 'v':
-                width_view = mj_parseval<double>(argv[k+1], 1.0e-100, 10000.0);
+                view_str = argv[k+1];
                 break;
             case 'x':
                 cx_str = argv[k+1];
@@ -349,6 +169,17 @@ int main(int argc, char **argv)
             case 't':
                 antialias_threshold = mj_parseval<double>(argv[k+1], 0.0, 1.0e100);
                 break;
+            case 'd':
+                de_threshold = mj_parseval<double>(argv[k+1], 0.0, 100.0);
+                break;
+            case 'e':
+                de_fill = mj_parseval<double>(argv[k+1], 0.0, 100.0);
+                if (de_fill > 0.0 && de_fill < 1.0)
+                    throw "invalid distance fill factor";
+                break;
+            case 'g':
+                guess = mj_parseval<double>(argv[k+1], 0.0, 1.0e100);
+                break;
             case 'r':
                 radius = mj_parseval<double>(argv[k+1], -10000.0, 10000.0);
                 if (julia_mode == MJ_JULIA_MODE_MANDELBROT)
@@ -363,7 +194,46 @@ int main(int argc, char **argv)
                 filename = argv[k+1];
                 break;
             case 'q':
-                computation_bits = mj_parseval<int>(argv[k+1], (const int[]){64, 80, 128, 256, 384, 512, 768, 1024}, 8);
+                perturbation = (argv[k+1][0] == 'p');
+                /* the reference needs the precision, not the exponent */
+                if (!strcmp(argv[k+1], "floatexp"))
+                    computation_bits = MJ_BITS_FLOATEXP;
+                else if (!strcmp(argv[k+1] + perturbation, "auto"))
+                    computation_bits = MJ_BITS_AUTO;
+                else
+                    computation_bits = mj_parseval<int>(argv[k+1] + perturbation, (const int[]){64, 80, 106, 128, 256, 384, 512, 768, 1024, 2048}, 10);
+                break;
+            case 's':
+                series_terms = mj_parseval<int>(argv[k+1], 0, MJ_SERIES_MAX_TERMS);
+                if (series_terms == 1)
+                    throw "invalid series approximation terms";
+                break;
+            case 'E':
+                escalate = mj_parseval<int>(argv[k+1], 0, 1);
+                break;
+            case 'Y':
+                approx_symmetry = mj_parseval<int>(argv[k+1], 0, 1);
+                break;
+            case 'T':
+                nb_threads = mj_parseval<int>(argv[k+1], 0, 1024);
+                break;
+            case 'W':
+                nb_workers = mj_parseval<int>(argv[k+1], 0, 1024);
+                break;
+            case 'S':
+                tile_size = mj_parseval<int>(argv[k+1], 16, 8192);
+                break;
+            case 'X':
+                worker_command = argv[k+1];
+                break;
+            case 'M':
+                manifest_filename = argv[k+1];
+                break;
+            case 'H':
+                strip_height = mj_parseval<int>(argv[k+1], 0, 8192);
+                break;
+            case 'P':
+                power = mj_parseval<int>(argv[k+1], MJ_MIN_POWER, MJ_MAX_POWER);
                 break;
             case 'b':
                 png_bits = mj_parseval<int>(argv[k+1], (const int[]){8, 16}, 2);
@@ -374,6 +244,12 @@ int main(int argc, char **argv)
             case 'c':
                 palette_filename = argv[k+1];
                 break;
+            case 'f':
+                field_filename = argv[k+1];
+                break;
+            case 'F':
+                recolor_filename = argv[k+1];
+                break;
             case 'C':
                 color_offset = mj_parseval<double>(argv[k+1], 0.0, 1.0);
                 break;
@@ -396,32 +272,152 @@ int main(int argc, char **argv)
             }
         }
 
-        if (!filename)
+        if (!filename && !manifest_filename)
             throw "no output file specified";
+        if (filename && manifest_filename)
+            throw "a shard worker writes the tiles of its manifest, not an output file";
+        if (manifest_filename && (nb_workers || strip_height || field_filename || recolor_filename))
+            throw "a shard worker renders only tiles";
+        if (worker_command && !nb_workers)
+            throw "no shard workers to start";
 
         double jx = radius * cos(angle);
         double jy = radius * sin(angle);
-        int is_preview = !strcmp(filename, "preview");
+        int is_preview = filename && !strcmp(filename, "preview");
+        if (is_preview && nb_workers)
+            throw "no output file for the shard workers";
+        if (is_preview && strip_height)
+            throw "no output file for the strips";
+        if (nb_workers && strip_height)
+            throw "strips and shard workers are exclusive";
+        if (is_preview && (field_filename || recolor_filename))
+            throw "no output file for the field";
+        if (field_filename && (nb_workers || strip_height || recolor_filename))
+            throw "the field is written only by a whole render";
+
+        /* -F renders nothing, the colors are made from the mapped field */
+        if (recolor_filename) {
+            double last_time = mj_gettimeofday();
+            fprintf(stderr, "Coloring        :");
+            fflush(stderr);
+
+            MJ_ColorPalette color(palette_filename, color_offset);
+            MJ_FieldFile field(recolor_filename);
+            MJ_ThreadPool pool(nb_threads ? nb_threads : int(std::thread::hardware_concurrency()));
+            if (png_bits == 8)
+                mj_output_field_png<uint8_t>(field, color, color_period, filename, pool);
+            else
+                mj_output_field_png<uint16_t>(field, color, color_period, filename, pool);
+
+            fprintf(stderr, " complete in %8.3f seconds.\n", mj_gettimeofday() - last_time);
+            return EXIT_SUCCESS;
+        }
+
+        MJ_Shard *shard = NULL;
+        MJ_TileSource *tiles = NULL;
+
+        /* a worker started by -X or by hand, the image and its tiles are those of the manifest */
+        if (manifest_filename) {
+            shard = new MJ_Shard(manifest_filename);
+            width = shard->width();
+            height = shard->height();
+            multisample = shard->multisample();
+            tiles = shard;
+        }
 
         width = is_preview ? width : width * multisample;
         height = is_preview ? height : height * multisample;
 
         MJ_ColorPalette color(palette_filename, color_offset);
-        MJ_Surface<MJ_Color> csurface(width, height);
+        int scale;
+        double pixel_width = mj_pixel_width(view_str, width, &scale);
+        if (is_preview && scale)
+            throw "the preview does not reach views this deep";
+        MJ_PreviewState preview = {};
+
+        /* the coordinator only merges, the workers render tiles and never hold the whole image */
+        if (nb_workers) {
+            shard = new MJ_Shard(filename, width / multisample, height / multisample, tile_size, multisample);
+            try {
+                shard->start(nb_workers, worker_command);
+            } catch (...) {
+                shard->abort();
+                delete shard;
+                throw;
+            }
+            if (!shard->is_worker()) {
+                double last_time = mj_gettimeofday();
+                try {
+                    shard->coordinate();
+
+                    double current_time = mj_gettimeofday();
+                    fprintf(stderr, "Total Rendering : complete in %8.3f seconds.\n", current_time - last_time);
+                    last_time = current_time;
+                    fprintf(stderr, "Merging         :");
+                    fflush(stderr);
+
+                    if (png_bits == 8)
+                        shard->merge<uint8_t>();
+                    else
+                        shard->merge<uint16_t>();
+                } catch (...) {
+                    fprintf(stderr, "\n");
+                    shard->abort();
+                    delete shard;
+                    throw;
+                }
+                shard->cleanup();
+                delete shard;
 
-#define MJ_PREVIEW_SELECT(type)                                                 \
-    mj_preview(csurface, color, mj_parseval(cx_str, (type)0) + (type)jx,        \
-               mj_parseval(cy_str, (type)0) + (type)jy, width_view / width,     \
-               antialias_threshold, color_period, max_iter, julia_mode)
+                fprintf(stderr, " complete in %8.3f seconds.\n", mj_gettimeofday() - last_time);
+                return EXIT_SUCCESS;
+            }
+            if (!nb_threads)
+                nb_threads = (std::thread::hardware_concurrency() + nb_workers - 1) / nb_workers;
+            tiles = shard;
+        }
 
-        if (is_preview) {
-            switch (computation_bits) {
+        /* strips are written as they finish, the image is never held either */
+        if (strip_height) {
+            if (png_bits == 8)
+                tiles = new MJ_PngStrips<uint8_t>(filename, width / multisample, height / multisample,
+                                                  strip_height, multisample);
+            else
+                tiles = new MJ_PngStrips<uint16_t>(filename, width / multisample, height / multisample,
+                                                   strip_height, multisample);
+        }
+
+        MJ_Surface<MJ_Color> csurface(tiles ? 0 : width, tiles ? 0 : height);
+        MJ_Field *field = field_filename ? new MJ_Field(width, height, multisample) : NULL;
+        MJ_ThreadPool pool(nb_threads ? nb_threads : int(std::thread::hardware_concurrency()));
+
+        preview.is_auto = (computation_bits == MJ_BITS_AUTO);
+        if (preview.is_auto) {
+            double center = fmax(fabs(mj_parseval<double>(cx_str) + jx), fabs(mj_parseval<double>(cy_str) + jy));
+            computation_bits = mj_auto_bits(pixel_width, scale, center, max_iter);
+        }
+
+#define MJ_PREVIEW_SELECT(type)                                                 \
+    mj_power_select<type>(power, &preview, csurface, color,                     \
+                          mj_parseval(cx_str, (type)0) + (type)jx,              \
+                          mj_parseval(cy_str, (type)0) + (type)jy,              \
+                          pixel_width, scale, antialias_threshold,              \
+                          de_threshold, de_fill, guess, color_period,           \
+                          max_iter, julia_mode, perturbation, series_terms,     \
+                          escalate, approx_symmetry, pool, tiles, field)
+
+        /* with -q auto the preview returns to switch types, the view goes on from its state */
+        for (preview.bits = computation_bits; is_preview && preview.bits; ) {
+            switch (preview.bits) {
             case 64:
                 MJ_PREVIEW_SELECT(double);
                 break;
             case 80:
                 MJ_PREVIEW_SELECT(long double);
                 break;
+            case 106:
+                MJ_PREVIEW_SELECT(MJ_DD);
+                break;
             case 128:
                 MJ_PREVIEW_SELECT(MJ_F128);
                 break;
@@ -440,19 +436,47 @@ int main(int argc, char **argv)
             case 1024:
                 MJ_PREVIEW_SELECT(MJ_Fixed<1024>);
                 break;
+            case 2048:
+                MJ_PREVIEW_SELECT(MJ_Fixed<2048>);
+                break;
+            case MJ_BITS_FLOATEXP:
+                MJ_PREVIEW_SELECT(MJ_FloatExp);
+                break;
             default:
                 throw "unreached";
             }
+            if (!preview.bits)
+                break;
+
+            cx_str = preview.cx_str, cy_str = preview.cy_str;
+            jx = jy = 0.0;
+            pixel_width = preview.pixel_width;
+            antialias_threshold = preview.antialias_threshold;
+            color_period = preview.color_period;
+            max_iter = preview.max_iter;
+            julia_mode = preview.julia_mode;
+        }
+
+        if (is_preview) {
+            free(preview.cx_str);
+            free(preview.cy_str);
             return EXIT_SUCCESS;
         }
 
+        if (preview.is_auto)
+            fprintf(stderr, "Computation     : %d bits chosen by -q auto\n", computation_bits);
+
         double last_time, current_time;
         last_time = mj_gettimeofday();
 
 #define MJ_RENDER_SELECT(type)                                                  \
-    mj_render(csurface, color, mj_parseval(cx_str, (type)0) + (type)jx,         \
-              mj_parseval(cy_str, (type)0) + (type)jy, width_view / width,      \
-              antialias_threshold, color_period, max_iter, julia_mode)
+    mj_power_select<type>(power, NULL, csurface, color,                         \
+                          mj_parseval(cx_str, (type)0) + (type)jx,              \
+                          mj_parseval(cy_str, (type)0) + (type)jy,              \
+                          pixel_width, scale, antialias_threshold,              \
+                          de_threshold, de_fill, guess, color_period,           \
+                          max_iter, julia_mode, perturbation, series_terms,     \
+                          escalate, approx_symmetry, pool, tiles, field)
 
         switch (computation_bits) {
         case 64:
@@ -461,6 +485,9 @@ int main(int argc, char **argv)
         case 80:
             MJ_RENDER_SELECT(long double);
             break;
+        case 106:
+            MJ_RENDER_SELECT(MJ_DD);
+            break;
         case 128:
             MJ_RENDER_SELECT(MJ_F128);
             break;
@@ -479,6 +506,12 @@ int main(int argc, char **argv)
         case 1024:
             MJ_RENDER_SELECT(MJ_Fixed<1024>);
             break;
+        case 2048:
+            MJ_RENDER_SELECT(MJ_Fixed<2048>);
+            break;
+        case MJ_BITS_FLOATEXP:
+            MJ_RENDER_SELECT(MJ_FloatExp);
+            break;
         default:
             throw "unreached";
         }
@@ -488,9 +521,33 @@ int main(int argc, char **argv)
         fprintf(stderr, "Total Rendering : complete in %8.3f seconds.\n", current_time - last_time);
         last_time = current_time;
 
+        if (shard) {
+            delete shard;
+            return EXIT_SUCCESS;
+        }
+
+        if (field) {
+            fprintf(stderr, "Writing field   :");
+            fflush(stderr);
+            field->write(field_filename);
+            delete field;
+            current_time = mj_gettimeofday();
+            fprintf(stderr, " complete in %8.3f seconds.\n", current_time - last_time);
+            last_time = current_time;
+        }
+
         fprintf(stderr, "Outputting      :");
         fflush(stderr);
 
+        /* the strips still being written */
+        if (tiles) {
+            tiles->finish();
+            delete tiles;
+            current_time = mj_gettimeofday();
+            fprintf(stderr, " complete in %8.3f seconds.\n", current_time - last_time);
+            return EXIT_SUCCESS;
+        }
+
         switch (png_bits) {
         case 8:
             mj_output_png<uint8_t>(csurface, filename, multisample);
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_RENDER_H
+#define MJ_RENDER_H 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+#include <SDL2/SDL.h>
+#include "mj-calc.h"
+#include "mj-calc-simd.h"
+#include "mj-adaptive-render.h"
+#include "mj-antialias.h"
+#include "mj-parseval.h"
+#include "mj-color.h"
+#include "mj-f128.h"
+#include "mj-dd.h"
+#include "mj-fixed.h"
+#include "mj-floatexp.h"
+#include "mj-perturbation.h"
+#include "mj-png.h"
+#include "mj-thread-pool.h"
+#include "mj-shard.h"
+#include "mj-strips.h"
+#include "mj-field.h"
+#include "mj-symmetry.h"
+
+/* -q floatexp and -q auto, not a number of bits */
+#define MJ_BITS_FLOATEXP (-1)
+#define MJ_BITS_AUTO     (-2)
+
+/* the fixed type past the range of double, its deltas of perturbation need the exponent */
+template<>
+struct MJ_PerturbDelta<MJ_Fixed<2048> > {
+    typedef MJ_FloatExp type;
+};
+
+/* -q auto, the bits of the cheapest type that resolves the view */
+int mj_auto_bits(double pixel_width, int scale, double center, int max_iter);
+
+/* the preview state that is carried over when -q auto moves to another type */
+struct MJ_PreviewState {
+    SDL_Window *window;
+    int bits, is_auto, is_locked;
+    char *cx_str, *cy_str;
+    double pixel_width, antialias_threshold, color_period;
+    int max_iter, julia_mode;
+};
+
+inline double mj_gettimeofday()
+{
+    timeval tbuf;
+    gettimeofday(&tbuf, NULL);
+    return tbuf.tv_sec + 1e-6 * tbuf.tv_usec;
+}
+
+/*
+ * The render or preview of type T at power (see mj-render-power.h), each T
+ * instantiated in a file of its own, mj-render-q*.cc, so they build in
+ * parallel.
+ */
+template<typename T, int P = MJ_MAX_POWER>
+void mj_power_select(int power, MJ_PreviewState *preview, MJ_Surface<MJ_Color> const& csurface,
+                     MJ_ColorPalette const& color, T cx, T cy, double pixel_width, int scale,
+                     double antialias_threshold, double de_threshold, double de_fill, double guess,
+                     double color_period, int max_iter, int julia_mode, int perturbation,
+                     int series_terms, int escalate, int approx_symmetry, MJ_ThreadPool& pool,
+                     MJ_TileSource *tiles, MJ_Field *field);
+
+/* mj_power_select of type, for its explicit instantiation */
+#define MJ_POWER_SELECT(type)                                                               \
+    void mj_power_select<type, MJ_MAX_POWER>(                                               \
+        int power, MJ_PreviewState *preview, MJ_Surface<MJ_Color> const& csurface,         \
+        MJ_ColorPalette const& color, type cx, type cy, double pixel_width, int scale,     \
+        double antialias_threshold, double de_threshold, double de_fill, double guess,     \
+        double color_period, int max_iter, int julia_mode, int perturbation,               \
+        int series_terms, int escalate, int approx_symmetry, MJ_ThreadPool& pool,          \
+        MJ_TileSource *tiles, MJ_Field *field)
+
+extern template MJ_POWER_SELECT(double);
+extern template MJ_POWER_SELECT(long double);
+extern template MJ_POWER_SELECT(MJ_DD);
+extern template MJ_POWER_SELECT(MJ_F128);
+extern template MJ_POWER_SELECT(MJ_Fixed<256>);
+extern template MJ_POWER_SELECT(MJ_Fixed<384>);
+extern template MJ_POWER_SELECT(MJ_Fixed<512>);
+extern template MJ_POWER_SELECT(MJ_Fixed<768>);
+extern template MJ_POWER_SELECT(MJ_Fixed<1024>);
+extern template MJ_POWER_SELECT(MJ_Fixed<2048>);
+extern template MJ_POWER_SELECT(MJ_FloatExp);
+
+#endif
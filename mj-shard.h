@@ -0,0 +1,477 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_SHARD_H
+#define MJ_SHARD_H 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+#include <string>
+#include "mj-surface.h"
+#include "mj-color.h"
+#include "mj-png.h"
+
+/*
+ * Shard mode: the image is cut into tiles listed in a manifest next to the
+ * output, worker processes render them and the coordinator merges them into
+ * the PNG. A tile is rendered as a view of its own with the frame center of
+ * the whole image, so its points are the same as in one render. Its border
+ * of one pixel, computed first by mj_adaptive_render anyway, is the halo the
+ * antialias decisions at the tile edge look at.
+ *
+ * Workers get their tiles over a line protocol on a pair of pipes:
+ *   coordinator: tile <index>
+ *   worker:      done <index>
+ * and find the tile in the manifest, after a line "MJ_TILES <width>
+ * <height> <multisample>" a line per tile of
+ *   <index> <x> <y> <width> <height> <path>
+ * in output pixels, the path last up to the end of the line so that it can
+ * hold spaces. The end of the input tells a worker to stop. A worker is
+ * mj-render with the options of the view and -M <manifest>, speaking the
+ * protocol on its stdin and stdout, or a process forked by the coordinator,
+ * which reads the manifest the same way. With a command, the coordinator
+ * starts each worker by it on the pipes instead of forking, so ssh running
+ * such a worker on another machine that shares the manifest and the tile
+ * files puts it there. A failed render stops the workers, copies their logs
+ * to stderr and leaves none of its files.
+ *
+ * A tile file is "MJ_TILE <width> <height>\n" followed by the downsampled
+ * colors, row by row.
+ */
+
+struct MJ_ShardTile {
+    int         index;
+    int         x, y, width, height;
+    std::string path;
+};
+
+/* the tiles one process renders one at a time instead of the whole image */
+class MJ_TileSource {
+public:
+    virtual ~MJ_TileSource() {}
+
+    /* the image, in output pixels */
+    virtual int width() const = 0;
+    virtual int height() const = 0;
+    virtual int multisample() const = 0;
+
+    /* the next tile, false when there are no more */
+    virtual bool next_tile(MJ_ShardTile& tile) = 0;
+
+    /* take the rendered tile, surface has multisample pixels per output pixel */
+    virtual void write_tile(const MJ_ShardTile& tile, MJ_Surface<MJ_Color> const& surface) = 0;
+
+    /* after the last tile */
+    virtual void finish()
+    {
+    }
+};
+
+class MJ_Shard : public MJ_TileSource {
+public:
+    /* tiles of tile_size output pixels over width x height output pixels */
+    MJ_Shard(const char *filename, int width, int height, int tile_size, int multisample) :
+        m_filename(filename), m_width(width), m_height(height), m_tile_size(tile_size),
+        m_multisample(multisample), m_in(NULL), m_out(NULL)
+    {
+        for (int y = 0; y < height; y += tile_size) {
+            for (int x = 0; x < width; x += tile_size) {
+                MJ_ShardTile tile;
+                tile.index = int(m_tiles.size());
+                tile.x = x, tile.y = y;
+                tile.width = (width - x < tile_size) ? width - x : tile_size;
+                tile.height = (height - y < tile_size) ? height - y : tile_size;
+                tile.path = m_filename + ".tile-" + std::to_string(tile.index);
+                m_tiles.push_back(tile);
+            }
+        }
+    }
+
+    /* worker on stdin and stdout, the image and its tiles from manifest */
+    MJ_Shard(const char *manifest) :
+        m_tile_size(0), m_in(NULL), m_out(NULL)
+    {
+        load(manifest);
+        m_in = fdopen(dup(0), "r");
+        m_out = fdopen(dup(1), "w");
+        if (!m_in || !m_out)
+            throw "cannot open shard pipes";
+    }
+
+    ~MJ_Shard()
+    {
+        if (m_in)
+            fclose(m_in);
+        if (m_out)
+            fclose(m_out);
+    }
+
+    int width() const
+    {
+        return m_width;
+    }
+
+    int height() const
+    {
+        return m_height;
+    }
+
+    int multisample() const
+    {
+        return m_multisample;
+    }
+
+    int is_worker() const
+    {
+        return m_in != NULL;
+    }
+
+    /*
+     * Write the manifest and fork the workers, or start them by the shell
+     * command when it is not NULL. Returns in the coordinator with the
+     * workers running, and in every forked worker set up to take tiles.
+     */
+    void start(int nb_workers, const char *command = NULL)
+    {
+        std::string manifest = m_filename + ".tiles";
+        FILE *fp = fopen(manifest.c_str(), "w");
+        if (!fp)
+            throw "cannot write shard manifest";
+        fprintf(fp, "MJ_TILES %d %d %d\n", m_width, m_height, m_multisample);
+        for (size_t k = 0; k < m_tiles.size(); k++)
+            fprintf(fp, "%d %d %d %d %d %s\n", m_tiles[k].index, m_tiles[k].x, m_tiles[k].y,
+                    m_tiles[k].width, m_tiles[k].height, m_tiles[k].path.c_str());
+        if (fclose(fp))
+            throw "cannot write shard manifest";
+
+        signal(SIGPIPE, SIG_IGN);
+        fflush(NULL);
+        for (int k = 0; k < nb_workers; k++) {
+            int to_worker[2], from_worker[2];
+            if (pipe(to_worker) || pipe(from_worker))
+                throw "cannot create shard pipes";
+
+            pid_t pid = fork();
+            if (pid < 0)
+                throw "cannot fork shard worker";
+
+            if (!pid) {
+                for (size_t j = 0; j < m_workers.size(); j++)
+                    close(m_workers[j].in), close(m_workers[j].out);
+                m_workers.clear();
+                close(to_worker[1]), close(from_worker[0]);
+
+                int fd = open(log_path(k).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd >= 0)
+                    dup2(fd, 2), close(fd);
+
+                if (command) {
+                    dup2(to_worker[0], 0), close(to_worker[0]);
+                    dup2(from_worker[1], 1), close(from_worker[1]);
+                    execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+                    fprintf(stderr, "Error: cannot start shard worker command\n");
+                    _exit(EXIT_FAILURE);
+                }
+
+                try {
+                    load(manifest.c_str());
+                } catch (const char *msg) {
+                    fprintf(stderr, "Error: %s\n", msg);
+                    _exit(EXIT_FAILURE);
+                }
+                m_in = fdopen(to_worker[0], "r");
+                m_out = fdopen(from_worker[1], "w");
+                if (!m_in || !m_out) {
+                    fprintf(stderr, "Error: cannot open shard pipes\n");
+                    _exit(EXIT_FAILURE);
+                }
+                return;
+            }
+
+            close(to_worker[0]), close(from_worker[1]);
+            Worker worker = {pid, from_worker[0], to_worker[1], -1, std::string()};
+            m_workers.push_back(worker);
+        }
+    }
+
+    /* worker: the next tile of the manifest, false when the coordinator has no more */
+    bool next_tile(MJ_ShardTile& tile)
+    {
+        char line[64];
+        int index;
+        if (!fgets(line, sizeof(line), m_in))
+            return false;
+        if (sscanf(line, "tile %d", &index) != 1 || index < 0 || index >= int(m_tiles.size()))
+            throw "invalid shard request";
+        tile = m_tiles[index];
+        return true;
+    }
+
+    /* worker: store the rendered tile, surface has multisample pixels per output pixel */
+    void write_tile(const MJ_ShardTile& tile, MJ_Surface<MJ_Color> const& surface)
+    {
+        std::string tmp = tile.path + ".tmp";
+        FILE *fp = fopen(tmp.c_str(), "wb");
+        if (!fp)
+            throw "cannot write shard tile";
+
+        MJ_Color *row = new MJ_Color[tile.width];
+        int ok = fprintf(fp, "MJ_TILE %d %d\n", tile.width, tile.height) > 0;
+        for (int y = 0; ok && y < surface.height(); y += m_multisample) {
+            mj_downsample_row(surface, y, m_multisample, row);
+            ok = fwrite(row, sizeof(MJ_Color), tile.width, fp) == size_t(tile.width);
+        }
+        delete[] row;
+
+        if (fclose(fp) || !ok || rename(tmp.c_str(), tile.path.c_str()))
+            throw "cannot write shard tile";
+
+        fprintf(m_out, "done %d\n", tile.index);
+        fflush(m_out);
+    }
+
+    /* coordinator: hand out the tiles one at a time per worker until all are done */
+    void coordinate()
+    {
+        size_t next = 0, nb_done = 0;
+        std::vector<pollfd> fds(m_workers.size());
+
+        for (size_t k = 0; k < m_workers.size(); k++)
+            assign(m_workers[k], next);
+
+        while (nb_done < m_tiles.size()) {
+            for (size_t k = 0; k < m_workers.size(); k++) {
+                fds[k].fd = (m_workers[k].tile >= 0) ? m_workers[k].in : -1;
+                fds[k].events = POLLIN;
+                fds[k].revents = 0;
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+                throw "shard poll failed";
+
+            for (size_t k = 0; k < m_workers.size(); k++) {
+                if (!fds[k].revents)
+                    continue;
+                Worker& worker = m_workers[k];
+                int index;
+                if (!read_line(worker) || sscanf(worker.buf.c_str(), "done %d", &index) != 1 ||
+                    index != worker.tile)
+                    throw "shard worker failed";
+                worker.buf.clear();
+                worker.tile = -1;
+                fprintf(stderr, "\rShards          : %zu of %zu tiles", ++nb_done, m_tiles.size());
+                fflush(stderr);
+                assign(worker, next);
+            }
+        }
+        fprintf(stderr, "\n");
+
+        for (size_t k = 0; k < m_workers.size(); k++) {
+            int status;
+            Worker& worker = m_workers[k];
+            close(worker.out), worker.out = -1;
+            close(worker.in), worker.in = -1;
+            pid_t pid = worker.pid;
+            worker.pid = -1;
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+                throw "shard worker failed";
+        }
+    }
+
+    /* coordinator: the PNG from the tile files, a row of tiles at a time; T as in mj_output_png */
+    template<typename T>
+    void merge()
+    {
+        MJ_PngWriter<T> png(m_filename.c_str(), m_width, m_height);
+        std::vector<FILE *> files;
+        MJ_Color *row = new MJ_Color[m_width];
+
+        try {
+            for (size_t first = 0; first < m_tiles.size(); ) {
+                size_t last = first;
+                while (last < m_tiles.size() && m_tiles[last].y == m_tiles[first].y)
+                    last++;
+
+                for (size_t k = first; k < last; k++) {
+                    int w, h;
+                    files.push_back(fopen(m_tiles[k].path.c_str(), "rb"));
+                    if (!files.back() || fscanf(files.back(), "MJ_TILE %d %d", &w, &h) != 2 ||
+                        fgetc(files.back()) != '\n' || w != m_tiles[k].width || h != m_tiles[k].height)
+                        throw "invalid shard tile";
+                }
+
+                for (int y = 0; y < m_tiles[first].height; y++) {
+                    for (size_t k = first; k < last; k++)
+                        if (fread(row + m_tiles[k].x, sizeof(MJ_Color), m_tiles[k].width, files[k - first]) !=
+                            size_t(m_tiles[k].width))
+                            throw "invalid shard tile";
+                    png.write_row(row);
+                }
+
+                for (size_t k = 0; k < files.size(); k++)
+                    fclose(files[k]);
+                files.clear();
+                first = last;
+            }
+            png.finish();
+        } catch (...) {
+            for (size_t k = 0; k < files.size(); k++)
+                if (files[k])
+                    fclose(files[k]);
+            delete[] row;
+            throw;
+        }
+        delete[] row;
+    }
+
+    /* coordinator: remove the manifest, the tiles and the worker logs */
+    void cleanup()
+    {
+        for (size_t k = 0; k < m_tiles.size(); k++) {
+            unlink(m_tiles[k].path.c_str());
+            unlink((m_tiles[k].path + ".tmp").c_str());
+        }
+        for (size_t k = 0; k < m_workers.size(); k++)
+            unlink(log_path(k).c_str());
+        unlink((m_filename + ".tiles").c_str());
+    }
+
+    /* coordinator: after a failure, stop the workers, copy their logs to stderr and remove every file */
+    void abort()
+    {
+        for (size_t k = 0; k < m_workers.size(); k++) {
+            Worker& worker = m_workers[k];
+            if (worker.out >= 0)
+                close(worker.out), worker.out = -1;
+            if (worker.in >= 0)
+                close(worker.in), worker.in = -1;
+            if (worker.pid > 0) {
+                kill(worker.pid, SIGTERM);
+                waitpid(worker.pid, NULL, 0);
+                worker.pid = -1;
+            }
+        }
+
+        for (size_t k = 0; k < m_workers.size(); k++) {
+            FILE *fp = fopen(log_path(k).c_str(), "r");
+            if (!fp)
+                continue;
+            char line[1024];
+            fprintf(stderr, "Worker %zu log:\n", k);
+            while (fgets(line, sizeof(line), fp))
+                fputs(line, stderr);
+            fclose(fp);
+        }
+
+        cleanup();
+        unlink(m_filename.c_str());
+    }
+
+private:
+    struct Worker {
+        pid_t       pid;
+        int         in, out;
+        int         tile;
+        std::string buf;
+    };
+
+    /* the image and the tiles of the manifest written by start() */
+    void load(const char *manifest)
+    {
+        FILE *fp = fopen(manifest, "r");
+        if (!fp)
+            throw "cannot read shard manifest";
+
+        std::vector<MJ_ShardTile> tiles;
+        std::vector<char> line(PATH_MAX + 64);
+        int ok = fgets(&line[0], int(line.size()), fp) &&
+                 sscanf(&line[0], "MJ_TILES %d %d %d", &m_width, &m_height, &m_multisample) == 3 &&
+                 m_width > 0 && m_height > 0 && m_multisample >= 1 && m_multisample <= 3;
+        while (ok && fgets(&line[0], int(line.size()), fp)) {
+            MJ_ShardTile tile;
+            int len = int(strlen(&line[0])), pos = 0;
+            ok = line[len - 1] == '\n' &&
+                 sscanf(&line[0], "%d %d %d %d %d%n", &tile.index, &tile.x, &tile.y, &tile.width, &tile.height,
+                        &pos) == 5 && line[pos] == ' ' && tile.index == int(tiles.size()) &&
+                 tile.x >= 0 && tile.y >= 0 && tile.width > 0 && tile.height > 0 &&
+                 tile.x + tile.width <= m_width && tile.y + tile.height <= m_height;
+            if (ok) {
+                tile.path.assign(&line[pos + 1], len - pos - 2);
+                tiles.push_back(tile);
+            }
+        }
+        fclose(fp);
+
+        if (!ok || tiles.empty())
+            throw "invalid shard manifest";
+        m_tiles = tiles;
+    }
+
+    void assign(Worker& worker, size_t& next)
+    {
+        if (next >= m_tiles.size())
+            return;
+        const MJ_ShardTile& tile = m_tiles[next++];
+        char line[64];
+        int len = snprintf(line, sizeof(line), "tile %d\n", tile.index);
+        if (write(worker.out, line, len) != len)
+            throw "shard worker failed";
+        worker.tile = tile.index;
+    }
+
+    std::string log_path(size_t k) const
+    {
+        return m_filename + ".worker-" + std::to_string(k) + ".log";
+    }
+
+    /* false on the end of the input before a whole line */
+    static bool read_line(Worker& worker)
+    {
+        for ( ; ; ) {
+            char c;
+            ssize_t n = read(worker.in, &c, 1);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            if (c == '\n')
+                return true;
+            worker.buf += c;
+        }
+    }
+
+    std::string                 m_filename;
+    int                         m_width, m_height;
+    int                         m_tile_size;
+    int                         m_multisample;
+    std::vector<MJ_ShardTile>   m_tiles;
+    std::vector<Worker>         m_workers;
+    FILE                        *m_in, *m_out;
+
+    MJ_Shard(const MJ_Shard&);
+    MJ_Shard& operator=(const MJ_Shard&);
+};
+
+#endif
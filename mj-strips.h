@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_STRIPS_H
+#define MJ_STRIPS_H 1
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "mj-surface.h"
+#include "mj-color.h"
+#include "mj-png.h"
+#include "mj-shard.h"
+
+/*
+ * Strips: the image is rendered as tiles of whole rows from the top, each
+ * with the border of one pixel of any tile around it. A finished strip is
+ * downsampled and handed to a thread that writes it to the PNG while the
+ * next one renders, so the image is never in memory: the strip rendering,
+ * the one being written and at most one waiting for it.
+ * T is uint8_t or uint16_t.
+ */
+template<typename T>
+class MJ_PngStrips : public MJ_TileSource {
+public:
+    MJ_PngStrips(const char *filename, int width, int height, int strip_height, int multisample) :
+        m_png(filename, width, height), m_width(width), m_height(height), m_strip_height(strip_height),
+        m_multisample(multisample), m_next_index(0), m_next_y(0), m_rows(NULL), m_is_stopped(0), m_error(NULL)
+    {
+        m_thread = std::thread(&MJ_PngStrips::writer, this);
+    }
+
+    ~MJ_PngStrips()
+    {
+        stop();
+        delete[] m_rows;
+    }
+
+    int width() const
+    {
+        return m_width;
+    }
+
+    int height() const
+    {
+        return m_height;
+    }
+
+    int multisample() const
+    {
+        return m_multisample;
+    }
+
+    bool next_tile(MJ_ShardTile& tile)
+    {
+        if (m_next_y >= m_height)
+            return false;
+        tile.index = m_next_index++;
+        tile.x = 0;
+        tile.y = m_next_y;
+        tile.width = m_width;
+        tile.height = (m_height - m_next_y < m_strip_height) ? m_height - m_next_y : m_strip_height;
+        tile.path.clear();
+        m_next_y += tile.height;
+        return true;
+    }
+
+    /* strips come in order, waits while the one before is still waiting */
+    void write_tile(const MJ_ShardTile& tile, MJ_Surface<MJ_Color> const& surface)
+    {
+        MJ_Color *rows = new MJ_Color[long(m_width) * tile.height];
+        for (int y = 0; y < tile.height; y++)
+            mj_downsample_row(surface, y * m_multisample, m_multisample, rows + long(m_width) * y);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_rows && !m_error)
+            m_cond.wait(lock);
+        if (m_error) {
+            delete[] rows;
+            throw m_error;
+        }
+        m_rows = rows;
+        m_nb_rows = tile.height;
+        m_cond.notify_all();
+    }
+
+    /* after the last strip, waits for the writer */
+    void finish()
+    {
+        stop();
+        if (m_error)
+            throw m_error;
+        m_png.finish();
+    }
+
+private:
+    void writer()
+    {
+        for (;;) {
+            MJ_Color *rows;
+            int nb_rows;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (!m_rows && !m_is_stopped)
+                    m_cond.wait(lock);
+                if (!m_rows)
+                    return;
+                rows = m_rows, nb_rows = m_nb_rows;
+                m_rows = NULL;
+                m_cond.notify_all();
+            }
+
+            const char *error = NULL;
+            try {
+                for (int y = 0; y < nb_rows; y++)
+                    m_png.write_row(rows + long(m_width) * y);
+            } catch (const char *e) {
+                error = e;
+            }
+            delete[] rows;
+
+            if (error) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_error = error;
+                m_cond.notify_all();
+                return;
+            }
+        }
+    }
+
+    void stop()
+    {
+        if (!m_thread.joinable())
+            return;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_is_stopped = 1;
+            m_cond.notify_all();
+        }
+        m_thread.join();
+    }
+
+    MJ_PngWriter<T>         m_png;
+    int                     m_width, m_height, m_strip_height, m_multisample;
+    int                     m_next_index, m_next_y;
+
+    /* the strip waiting for the writer */
+    MJ_Color                *m_rows;
+    int                     m_nb_rows;
+    int                     m_is_stopped;
+    const char              *m_error;
+    std::mutex              m_mutex;
+    std::condition_variable m_cond;
+    std::thread             m_thread;
+
+    MJ_PngStrips(const MJ_PngStrips&);
+    MJ_PngStrips& operator=(const MJ_PngStrips&);
+};
+
+#endif
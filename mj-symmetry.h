@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_SYMMETRY_H
+#define MJ_SYMMETRY_H 1
+
+#include <math.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include "mj-surface.h"
+
+/* a part of the image rendered by itself, in pixels */
+struct MJ_SymmetryRect {
+    int x, y, width, height;
+
+    bool contains(int px, int py) const
+    {
+        return px >= x && px < x + width && py >= y && py < y + height;
+    }
+};
+
+/*
+ * Symmetry planner: the rectangles of the image to render, the other pixels
+ * are copies of a symmetric pixel of the first one. The symmetries used are
+ * those of the set that map the pixels onto pixels: the mirror in the real
+ * axis, the half turn and the quarter turn, about a center on a pixel or
+ * between pixels. The first rectangle is the half or quarter of the image
+ * around the center that leaves the fewest pixels to render, the others
+ * cover the pixels whose symmetric pixels are outside the image.
+ */
+class MJ_SymmetryPlan {
+public:
+    /*
+     * The center of the symmetries is at center_x, center_y in pixels of a
+     * width x height image, is_mirror for the mirror in its row and turns
+     * (1, 2 or 4) for the rotations about it. A center farther than tolerance
+     * from a pixel of the grid or the middle of two goes without the
+     * symmetries that need it.
+     */
+    MJ_SymmetryPlan(int width, int height, double center_x, double center_y, int is_mirror, int turns,
+                    double tolerance) :
+        m_width(width), m_height(height)
+    {
+        MJ_SymmetryRect whole = {0, 0, width, height};
+        double cx2 = rint(2.0 * center_x), cy2 = rint(2.0 * center_y);
+
+        if (!(fabs(cx2) < 4.0 * width + 4.0 && fabs(center_x - 0.5 * cx2) <= tolerance))
+            turns = 1;
+        if (!(fabs(cy2) < 4.0 * height + 4.0 && fabs(center_y - 0.5 * cy2) <= tolerance))
+            turns = 1, is_mirror = 0;
+        if (turns == 4 && (int(cx2) - int(cy2)) % 2)
+            turns = 2;
+
+        /* x' = xx * x + xy * y + tx, y' = yx * x + yy * y + ty */
+        Map half_turn = {-1, 0, 0, -1, int(cx2), int(cy2)};
+        Map quarter_turn = {0, 1, -1, 0, (int(cx2) - int(cy2)) / 2, (int(cx2) + int(cy2)) / 2};
+        Map turn = (turns == 4) ? quarter_turn : half_turn;
+        Map mirror = {1, 0, 0, -1, 0, int(cy2)};
+        Map map = {1, 0, 0, 1, 0, 0};
+        for (int k = 0; k < turns; k++) {
+            if (k)
+                m_maps.push_back(map);
+            if (is_mirror)
+                m_maps.push_back(compose(mirror, map));
+            map = compose(turn, map);
+        }
+
+        if (m_maps.empty()) {
+            m_rects.push_back(whole);
+            return;
+        }
+
+        /* the sides of the halves and quarters around the center */
+        int xs[4] = {0, int(floor(0.5 * cx2)) + 1, int(ceil(0.5 * cx2)), width};
+        int ys[4] = {0, int(floor(0.5 * cy2)) + 1, int(ceil(0.5 * cy2)), height};
+        std::vector<MJ_SymmetryRect> best(1, whole);
+        long best_cost = cost(whole);
+
+        /* whole sides first, a tie goes to the rectangle of the longest sides */
+        for (int x0 = 0; x0 < 4; x0++) {
+            for (int x1 = 3; x1 > x0; x1--) {
+                for (int y0 = 0; y0 < 4; y0++) {
+                    for (int y1 = 3; y1 > y0; y1--) {
+                        MJ_SymmetryRect first = {xs[x0], ys[y0], xs[x1] - xs[x0], ys[y1] - ys[y0]};
+                        if (first.x < 0 || first.y < 0 || first.width <= 0 || first.height <= 0 ||
+                            first.x + first.width > width || first.y + first.height > height)
+                            continue;
+                        std::vector<MJ_SymmetryRect> rects(1, first);
+                        long n = plan(rects);
+                        if (n < best_cost)
+                            best_cost = n, best = rects;
+                    }
+                }
+            }
+        }
+        m_rects = best;
+    }
+
+    int nb_rects() const
+    {
+        return int(m_rects.size());
+    }
+
+    const MJ_SymmetryRect& rect(int k) const
+    {
+        return m_rects[k];
+    }
+
+    /* the pixels rendered, out of all of them */
+    long nb_rendered() const
+    {
+        long n = 0;
+        for (size_t k = 0; k < m_rects.size(); k++)
+            n += long(m_rects[k].width) * m_rects[k].height;
+        return n;
+    }
+
+    /* the symmetries mapping pixels into the first rectangle */
+    int nb_maps() const
+    {
+        return int(m_maps.size());
+    }
+
+    /*
+     * The rendered pixel (sx, sy) that pixel (x, y) is a copy of, itself if
+     * it is rendered. Returns 1 + the index of the map taking it there, 0
+     * for itself.
+     */
+    int source(int x, int y, int& sx, int& sy) const
+    {
+        sx = x, sy = y;
+        for (size_t k = 0; k < m_rects.size(); k++)
+            if (m_rects[k].contains(x, y))
+                return 0;
+        for (size_t k = 0; k < m_maps.size(); k++) {
+            const Map& map = m_maps[k];
+            int mx = map.xx * x + map.xy * y + map.tx, my = map.yx * x + map.yy * y + map.ty;
+            if (m_rects[0].contains(mx, my)) {
+                sx = mx, sy = my;
+                return int(k) + 1;
+            }
+        }
+        return 0;
+    }
+
+    /* the pixels not rendered from their sources */
+    template<typename T>
+    void fill(MJ_Surface<T> const& surface) const
+    {
+        if (m_maps.empty())
+            return;
+        for (int y = 0; y < m_height; y++) {
+            for (int x = 0; x < m_width; x++) {
+                int sx, sy;
+                source(x, y, sx, sy);
+                if (sx != x || sy != y)
+                    surface(x, y) = surface(sx, sy);
+            }
+        }
+    }
+
+private:
+    struct Map {
+        int xx, xy, yx, yy, tx, ty;
+    };
+
+    /* a after b */
+    static Map compose(const Map& a, const Map& b)
+    {
+        Map m = {
+            a.xx * b.xx + a.xy * b.yx, a.xx * b.xy + a.xy * b.yy,
+            a.yx * b.xx + a.yy * b.yx, a.yx * b.xy + a.yy * b.yy,
+            a.xx * b.tx + a.xy * b.ty + a.tx, a.yx * b.tx + a.yy * b.ty + a.ty
+        };
+        return m;
+    }
+
+    /*
+     * Add to rects, holding the first rectangle, the rectangles of the
+     * pixels none of the maps takes into it and return the points to render.
+     * The image is cut into cells on the sides of the copies of the first
+     * rectangle, the cells left over are merged along the rows and then down.
+     */
+    long plan(std::vector<MJ_SymmetryRect>& rects) const
+    {
+        std::vector<MJ_SymmetryRect> copies;
+        std::vector<int> xs, ys;
+        MJ_SymmetryRect first = rects[0];
+        long total = cost(first);
+
+        copies.push_back(first);
+        for (size_t k = 0; k < m_maps.size(); k++) {
+            const Map& map = m_maps[k];
+            int fx = first.x + first.width - 1, fy = first.y + first.height - 1;
+            int x0 = map.xx * first.x + map.xy * first.y + map.tx, y0 = map.yx * first.x + map.yy * first.y + map.ty;
+            int x1 = map.xx * fx + map.xy * fy + map.tx, y1 = map.yx * fx + map.yy * fy + map.ty;
+            MJ_SymmetryRect copy = {x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, abs(x1 - x0) + 1, abs(y1 - y0) + 1};
+            copies.push_back(copy);
+        }
+
+        xs.push_back(0), xs.push_back(m_width);
+        ys.push_back(0), ys.push_back(m_height);
+        for (size_t k = 0; k < copies.size(); k++) {
+            const MJ_SymmetryRect& c = copies[k];
+            if (c.x > 0 && c.x < m_width)
+                xs.push_back(c.x);
+            if (c.x + c.width > 0 && c.x + c.width < m_width)
+                xs.push_back(c.x + c.width);
+            if (c.y > 0 && c.y < m_height)
+                ys.push_back(c.y);
+            if (c.y + c.height > 0 && c.y + c.height < m_height)
+                ys.push_back(c.y + c.height);
+        }
+        std::sort(xs.begin(), xs.end());
+        xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+        std::sort(ys.begin(), ys.end());
+        ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+
+        for (size_t j = 0; j + 1 < ys.size(); j++) {
+            for (size_t i = 0; i + 1 < xs.size(); ) {
+                size_t end = i;
+                while (end + 1 < xs.size() && !is_covered(copies, xs[end], ys[j]))
+                    end++;
+                if (end == i) {
+                    i++;
+                    continue;
+                }
+                MJ_SymmetryRect rest = {xs[i], ys[j], xs[end] - xs[i], ys[j + 1] - ys[j]};
+                size_t k = 1;
+                while (k < rects.size() && !(rects[k].x == rest.x && rects[k].width == rest.width &&
+                                             rects[k].y + rects[k].height == rest.y))
+                    k++;
+                if (k < rects.size()) {
+                    total -= cost(rects[k]);
+                    rects[k].height += rest.height;
+                    total += cost(rects[k]);
+                } else {
+                    rects.push_back(rest);
+                    total += cost(rest);
+                }
+                i = end;
+            }
+        }
+        return total;
+    }
+
+    /* the pixels of a rectangle, and some for rendering one more */
+    static long cost(const MJ_SymmetryRect& rect)
+    {
+        return long(rect.width) * rect.height + 64;
+    }
+
+    static bool is_covered(const std::vector<MJ_SymmetryRect>& copies, int x, int y)
+    {
+        for (size_t k = 0; k < copies.size(); k++)
+            if (copies[k].contains(x, y))
+                return true;
+        return false;
+    }
+
+    int                             m_width, m_height;
+    std::vector<Map>                m_maps;
+    std::vector<MJ_SymmetryRect>    m_rects;
+};
+
+#endif
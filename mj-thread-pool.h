@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2021 Muhammad Faiz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MJ_THREAD_POOL_H
+#define MJ_THREAD_POOL_H 1
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+
+class MJ_ThreadPool;
+
+/* a unit of work, deleted by the pool after run() */
+class MJ_Task {
+public:
+    virtual ~MJ_Task() {}
+    virtual void run(MJ_ThreadPool& pool) = 0;
+};
+
+/*
+ * Work-stealing pool. Each thread pops the task it spawned last from its own
+ * queue, so a single thread runs them depth first. An idle thread steals the
+ * oldest task of another queue, which is the largest piece of a recursion.
+ * The thread calling run() is one of the size() threads.
+ */
+class MJ_ThreadPool {
+public:
+    explicit MJ_ThreadPool(int nb_threads) :
+        m_queues(nb_threads < 1 ? 1 : nb_threads), m_nb_queued(0), m_nb_pending(0),
+        m_nb_sleeping(0), m_stop(0)
+    {
+        for (int k = 1; k < size(); k++)
+            m_threads.push_back(std::thread(&MJ_ThreadPool::worker, this, k));
+    }
+
+    ~MJ_ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_sleep_lock);
+            m_stop = 1;
+            m_wake.notify_all();
+        }
+        for (size_t k = 0; k < m_threads.size(); k++)
+            m_threads[k].join();
+    }
+
+    int size() const
+    {
+        return int(m_queues.size());
+    }
+
+    /* queue task on the current thread, from run() or from a running task */
+    void spawn(MJ_Task *task)
+    {
+        Queue& queue = m_queues[m_current];
+        m_nb_pending++;
+        {
+            std::lock_guard<std::mutex> guard(queue.lock);
+            queue.tasks.push_back(task);
+        }
+        m_nb_queued++;
+        if (m_nb_sleeping > 0) {
+            std::lock_guard<std::mutex> guard(m_sleep_lock);
+            m_wake.notify_one();
+        }
+    }
+
+    /* run task and everything it spawns, return when all of them are done */
+    void run(MJ_Task *task)
+    {
+        m_current = 0;
+        spawn(task);
+        loop(0);
+    }
+
+private:
+    struct Queue {
+        std::mutex              lock;
+        std::deque<MJ_Task *>   tasks;
+    };
+
+    MJ_Task *pop(int index)
+    {
+        for (int k = 0; k < size(); k++) {
+            Queue& queue = m_queues[(index + k) % size()];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.tasks.empty())
+                continue;
+            MJ_Task *task;
+            if (!k) {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            } else {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            m_nb_queued--;
+            return task;
+        }
+        return NULL;
+    }
+
+    /* the caller of run() leaves when nothing is pending, the workers when stopped */
+    void loop(int index)
+    {
+        for ( ; ; ) {
+            MJ_Task *task = pop(index);
+            if (task) {
+                task->run(*this);
+                delete task;
+                if (--m_nb_pending == 0) {
+                    std::lock_guard<std::mutex> guard(m_sleep_lock);
+                    m_wake.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(m_sleep_lock);
+            m_nb_sleeping++;
+            while (!m_nb_queued && !m_stop && !(!index && !m_nb_pending))
+                m_wake.wait(guard);
+            m_nb_sleeping--;
+            if (m_stop || (!index && !m_nb_pending))
+                return;
+        }
+    }
+
+    void worker(int index)
+    {
+        m_current = index;
+        loop(index);
+    }
+
+    std::vector<Queue>          m_queues;
+    std::vector<std::thread>    m_threads;
+    std::atomic<long>           m_nb_queued;
+    std::atomic<long>           m_nb_pending;
+    std::atomic<int>            m_nb_sleeping;
+    int                         m_stop;
+    std::mutex                  m_sleep_lock;
+    std::condition_variable     m_wake;
+
+    static inline thread_local int m_current;
+
+    MJ_ThreadPool(const MJ_ThreadPool&);
+    MJ_ThreadPool& operator=(const MJ_ThreadPool&);
+};
+
+/* body(k) for k in [begin, end), the range is halved until one index is left */
+template<typename Body>
+class MJ_ForTask : public MJ_Task {
+public:
+    MJ_ForTask(Body& body, int begin, int end) : m_body(body), m_begin(begin), m_end(end)
+    {
+    }
+
+    void run(MJ_ThreadPool& pool)
+    {
+        while (m_end - m_begin > 1) {
+            int middle = m_begin + (m_end - m_begin) / 2;
+            pool.spawn(new MJ_ForTask(m_body, middle, m_end));
+            m_end = middle;
+        }
+        m_body(m_begin);
+    }
+
+private:
+    Body&   m_body;
+    int     m_begin, m_end;
+};
+
+template<typename Body>
+void mj_parallel_for(MJ_ThreadPool& pool, int begin, int end, Body& body)
+{
+    if (begin < end)
+        pool.run(new MJ_ForTask<Body>(body, begin, end));
+}
+
+#endif